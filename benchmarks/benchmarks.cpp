@@ -0,0 +1,514 @@
+/*
+*
+* microbenchmarks of request parsing, reply serialization, middleware dispatch and whole
+* in-process request path, heap held by idle connection
+*
+* qmake && make && ./recurse_benchmarks -o results.xml,xml
+* python ../tools/benchmark_json.py results.xml > results.json
+*/
+
+#include <recurse.hpp>
+#include <QtTest>
+
+#if defined(__GLIBC__)
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace Recurse;
+
+namespace
+{
+    //!
+    //! \brief request
+    //! realistic request heads, small API call, browser page load and request with large
+    //! cookie jar and body
+    //!
+    QByteArray request(const QString &size)
+    {
+        if (size == "small")
+        {
+            return "GET /api/items?id=42 HTTP/1.1\r\n"
+                   "Host: localhost:3000\r\n"
+                   "Accept: */*\r\n"
+                   "User-Agent: curl/7.68.0\r\n"
+                   "\r\n";
+        }
+
+        QByteArray head = "GET /search?q=recurse&page=2&sort=desc&lang=en HTTP/1.1\r\n"
+                          "Host: www.example.com\r\n"
+                          "Connection: keep-alive\r\n"
+                          "Cache-Control: max-age=0\r\n"
+                          "Upgrade-Insecure-Requests: 1\r\n"
+                          "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/90.0.4430.93 Safari/537.36\r\n"
+                          "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+                          "Sec-Fetch-Site: same-origin\r\n"
+                          "Sec-Fetch-Mode: navigate\r\n"
+                          "Sec-Fetch-User: ?1\r\n"
+                          "Sec-Fetch-Dest: document\r\n"
+                          "Referer: https://www.example.com/\r\n"
+                          "Accept-Encoding: gzip, deflate, br\r\n"
+                          "Accept-Language: en-US,en;q=0.9\r\n"
+                          "Cookie: session=8f2d0c1e4b7a9f3d; theme=dark; consent=yes\r\n";
+
+        if (size == "medium")
+            return head + "\r\n";
+
+        QByteArray cookies = "Cookie: session=8f2d0c1e4b7a9f3d";
+        for (int i = 0; i < 64; ++i)
+            cookies += "; tracking_" + QByteArray::number(i) + "=" + QByteArray(48, 'a' + i % 26);
+
+        QByteArray body(16 * 1024, 'x');
+
+        head.replace("GET ", "POST ");
+        head.replace(head.mid(head.indexOf("Cookie:")), cookies + "\r\n");
+
+        return head + "Content-Type: application/octet-stream\r\n"
+                      "Content-Length: " + QByteArray::number(body.size()) + "\r\n\r\n" + body;
+    }
+}
+
+class Benchmarks : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void parse_data();
+    void parse();
+
+    void feed_data();
+    void feed();
+
+    void createReply_data();
+    void createReply();
+
+    void createSegments_data();
+    void createSegments();
+
+    void context();
+
+    void cookie();
+    void query();
+
+    void chain_data();
+    void chain();
+
+    void inject_data();
+    void inject();
+
+    void idleConnection();
+
+private:
+    //!
+    //! \brief m_socket
+    //! unconnected socket, request parser reads peer address from it
+    //!
+    QTcpSocket m_socket;
+
+    void m_response(Response &response, const QString &kind);
+};
+
+void Benchmarks::parse_data()
+{
+    QTest::addColumn<QByteArray>("data");
+
+    for (auto size : { "small", "medium", "large" })
+        QTest::newRow(size) << request(size);
+}
+
+//!
+//! \brief Benchmarks::parse
+//! whole request at once
+//!
+void Benchmarks::parse()
+{
+    QFETCH(QByteArray, data);
+
+    QString text = QString::fromUtf8(data);
+
+    QBENCHMARK
+    {
+        Request request;
+        request.socket = &m_socket;
+        request.parse(text);
+    }
+}
+
+void Benchmarks::feed_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<int>("chunk");
+
+    for (auto size : { "small", "medium", "large" })
+    {
+        QTest::newRow((QByteArray(size) + " whole").constData()) << request(size) << 0;
+        QTest::newRow((QByteArray(size) + " 1460").constData()) << request(size) << 1460;
+        QTest::newRow((QByteArray(size) + " 64").constData()) << request(size) << 64;
+    }
+}
+
+//!
+//! \brief Benchmarks::feed
+//! request as it is read from socket, in chunks of given size (0 for whole request)
+//!
+void Benchmarks::feed()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(int, chunk);
+
+    QVector<QByteArray> chunks;
+
+    for (int i = 0; i < data.size(); i += chunk ? chunk : data.size())
+        chunks.push_back(data.mid(i, chunk ? chunk : -1));
+
+    QBENCHMARK
+    {
+        Request request;
+        request.socket = &m_socket;
+
+        for (const auto &c : chunks)
+            request.feed(c);
+    }
+}
+
+void Benchmarks::m_response(Response &response, const QString &kind)
+{
+    response.status(200).setHeader("cache-control", "no-cache").setHeader("x-request-id", "5f2b9c");
+
+    if (kind == "text")
+        response.type("text/plain").body("Hello World");
+    else if (kind == "json")
+    {
+        auto json = response.json();
+        json.beginArray();
+
+        for (int i = 0; i < 100; ++i)
+            json.beginObject().key("id").value(i).key("name").value("item").endObject();
+
+        json.endArray();
+        json.flush();
+    }
+    else
+        response.type("application/octet-stream").rawBody(QByteArray(64 * 1024, 'x'));
+}
+
+void Benchmarks::createReply_data()
+{
+    QTest::addColumn<QString>("kind");
+
+    for (auto kind : { "text", "json", "64k" })
+        QTest::newRow(kind) << QString(kind);
+}
+
+void Benchmarks::createReply()
+{
+    QFETCH(QString, kind);
+
+    Response response;
+    m_response(response, kind);
+
+    QBENCHMARK
+    {
+        QByteArray reply = response.create_reply();
+        Q_UNUSED(reply);
+    }
+}
+
+void Benchmarks::createSegments_data()
+{
+    createReply_data();
+}
+
+void Benchmarks::createSegments()
+{
+    QFETCH(QString, kind);
+
+    Response response;
+    m_response(response, kind);
+
+    QBENCHMARK
+    {
+        auto segments = response.create_segments();
+        Q_UNUSED(segments);
+    }
+}
+
+//!
+//! \brief Benchmarks::context
+//! construction and destruction, done for every request
+//!
+void Benchmarks::context()
+{
+    QBENCHMARK
+    {
+        QSharedPointer<Context> ctx(new Context);
+        ctx->request.socket = &m_socket;
+    }
+}
+
+void Benchmarks::cookie()
+{
+    Request request;
+    request.socket = &m_socket;
+    request.feed(::request("large"));
+
+    QBENCHMARK
+    {
+        QString session = request.getCookie("session");
+        QString tracking = request.getCookie("tracking_63");
+        Q_UNUSED(session);
+        Q_UNUSED(tracking);
+    }
+}
+
+void Benchmarks::query()
+{
+    Request request;
+    request.socket = &m_socket;
+    request.feed(::request("medium"));
+
+    QBENCHMARK
+    {
+        QString q = request.query.queryItemValue("q");
+        QString page = request.query.queryItemValue("page");
+        Q_UNUSED(q);
+        Q_UNUSED(page);
+    }
+}
+
+void Benchmarks::chain_data()
+{
+    QTest::addColumn<QString>("kind");
+    QTest::addColumn<int>("length");
+
+    for (auto kind : { "downstream", "upstream", "final" })
+    {
+        for (int length : { 1, 5, 10, 20 })
+            QTest::newRow(QString("%1 %2").arg(kind).arg(length).toLatin1().constData()) << QString(kind) << length;
+    }
+}
+
+//!
+//! \brief Benchmarks::chain
+//! Application::dispatch through chain of middlewares added with each use() overload,
+//! last one sends response. Includes Context construction (see context())
+//!
+//!     downstream: Downstream middlewares calling next()
+//!     upstream: DownstreamUpstream middlewares calling next() and prev()
+//!     final: Downstream middlewares followed by one Final
+//!
+void Benchmarks::chain()
+{
+    QFETCH(QString, kind);
+    QFETCH(int, length);
+
+    Application app(static_cast<QCoreApplication *>(nullptr));
+
+    for (int i = 0; i < length; ++i)
+    {
+        bool last = i == length - 1;
+
+        if (kind == "upstream")
+        {
+            app.use([last](Context &ctx, NextPrev next, Prev prev)
+            {
+                if (last)
+                {
+                    ctx.response.send("ok");
+                    return;
+                }
+
+                next([prev]
+                {
+                    prev();
+                });
+            });
+        }
+        else if (kind == "final" && last)
+        {
+            app.use([](Context &ctx)
+            {
+                ctx.response.send("ok");
+            });
+        }
+        else
+        {
+            app.use([last](Context &ctx, Next next)
+            {
+                if (last)
+                    ctx.response.send("ok");
+                else
+                    next();
+            });
+        }
+    }
+
+    quint64 done = 0;
+
+    QBENCHMARK
+    {
+        QSharedPointer<Context> ctx(new Context);
+        ctx->request.socket = nullptr;
+
+        app.dispatch(ctx, [&done](Context &)
+        {
+            ++done;
+        });
+
+        // chain storage is freed by posted call
+        QCoreApplication::sendPostedEvents();
+    }
+
+    QVERIFY(done > 0);
+}
+
+void Benchmarks::inject_data()
+{
+    parse_data();
+}
+
+//!
+//! \brief Benchmarks::inject
+//! whole server path without socket, parsing, middleware and serialization
+//!
+void Benchmarks::inject()
+{
+    QFETCH(QByteArray, data);
+
+    Application app(static_cast<QCoreApplication *>(nullptr));
+
+    app.use([](Context &ctx, Next next)
+    {
+        ctx.response.setHeader("x-request-id", "5f2b9c");
+        next();
+    });
+
+    app.use([](Context &ctx)
+    {
+        ctx.response.send("Hello World");
+    });
+
+    QByteArray reply;
+
+    QBENCHMARK
+    {
+        app.inject(data, [&reply](const QByteArray &r)
+        {
+            reply = r;
+        });
+    }
+
+    QVERIFY(reply.startsWith("HTTP/1.1 200"));
+}
+
+#if defined(__GLIBC__)
+namespace
+{
+    //!
+    //! \brief heap
+    //! \return bytes currently allocated with malloc
+    //!
+    quint64 heap()
+    {
+#if __GLIBC_PREREQ(2, 33)
+        return mallinfo2().uordblks;
+#else
+        return quint64(uint(mallinfo().uordblks));
+#endif
+    }
+}
+#endif
+
+//!
+//! \brief Benchmarks::idleConnection
+//! heap held by accepted connection that hasn't sent anything yet, server side socket included.
+//! Clients are plain sockets, so their memory isn't counted. Result is bytes per connection
+//!
+void Benchmarks::idleConnection()
+{
+#if defined(__GLIBC__)
+    // server and client descriptor for each connection
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+
+    int count = int(qMin<rlim_t>(2000, (limit.rlim_cur - 64) / 2));
+
+    Application app(static_cast<QCoreApplication *>(nullptr));
+
+    app.use([](Context &ctx)
+    {
+        ctx.response.send("ok");
+    });
+
+    QTcpServer server;
+    server.setMaxPendingConnections(count);
+    QVERIFY(server.listen(QHostAddress::LocalHost));
+
+    int accepted = 0;
+
+    connect(&server, &QTcpServer::newConnection, [&server, &app, &accepted]
+    {
+        while (QTcpSocket *socket = server.nextPendingConnection())
+        {
+            app.handleConnection(socket);
+            ++accepted;
+        }
+    });
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(server.serverPort());
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    QVector<int> clients;
+    clients.reserve(count);
+
+    // let server finish its own setup before measuring
+    QCoreApplication::processEvents();
+    malloc_trim(0);
+
+    quint64 before = heap();
+
+    for (int i = 0; i < count; ++i)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        QVERIFY(fd != -1);
+
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+        clients.push_back(fd);
+
+        if (i % 64 == 0)
+            QCoreApplication::processEvents();
+    }
+
+    QTRY_COMPARE_WITH_TIMEOUT(accepted, count, 10000);
+    QCoreApplication::processEvents();
+
+    quint64 after = heap();
+    qint64 bytes = (qint64(after) - qint64(before)) / count;
+
+    qDebug() << count << "idle connections," << bytes << "bytes each";
+    QTest::setBenchmarkResult(bytes, QTest::BytesAllocated);
+
+    for (int fd : clients)
+        ::close(fd);
+
+    QTRY_COMPARE_WITH_TIMEOUT(app.metrics().value(Metrics::ConnectionsClosed), quint64(count), 10000);
+    QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+#else
+    QSKIP("heap statistics need glibc");
+#endif
+}
+
+QTEST_GUILESS_MAIN(Benchmarks)
+
+#include "benchmarks.moc"
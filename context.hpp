@@ -2,11 +2,105 @@
 #define RECURSE_CONTEXT_HPP
 
 #include <QVariant>
+#include <QAtomicInt>
+#include <QDeadlineTimer>
 #include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QObject>
+#include <QSharedPointer>
+#include <QVector>
+#include <functional>
 
 #include "request.hpp"
 #include "response.hpp"
 
+namespace Recurse
+{
+    class Profile;
+}
+
+//!
+//! \brief The Cancellation class
+//! Shared, thread-safe cancellation token
+//!
+//! Copies share the same state, so token can be captured by offloaded work
+//! and polled from any thread with isCancelled()
+//!
+class Cancellation
+{
+
+public:
+    Cancellation()
+        : m_state(new State)
+    {
+    }
+
+    //!
+    //! \brief isCancelled
+    //! safe to call from any thread
+    //!
+    //! \return true once cancelled
+    //!
+    bool isCancelled() const
+    {
+        return m_state->cancelled.loadAcquire();
+    }
+
+    //!
+    //! \brief cancel
+    //! cancel token and call registered callbacks, subsequent calls do nothing
+    //!
+    void cancel()
+    {
+        QVector<std::function<void()>> callbacks;
+
+        {
+            QMutexLocker locker(&m_state->mutex);
+
+            if (!m_state->cancelled.testAndSetOrdered(0, 1))
+                return;
+
+            callbacks.swap(m_state->callbacks);
+        }
+
+        for (const auto &f : callbacks)
+            f();
+    }
+
+    //!
+    //! \brief onCancel
+    //! register callback called on the thread that cancels the token,
+    //! if already cancelled it is called right away
+    //!
+    //! \param f callback
+    //!
+    void onCancel(std::function<void()> f)
+    {
+        {
+            QMutexLocker locker(&m_state->mutex);
+
+            if (!m_state->cancelled.loadAcquire())
+            {
+                m_state->callbacks.push_back(std::move(f));
+                return;
+            }
+        }
+
+        f();
+    }
+
+private:
+    struct State
+    {
+        QAtomicInt cancelled;
+        QMutex mutex;
+        QVector<std::function<void()>> callbacks;
+    };
+
+    QSharedPointer<State> m_state;
+};
+
 class Context
 {
 
@@ -14,6 +108,38 @@ public:
     Request request;
     Response response;
 
+    //!
+    //! \brief cancellation
+    //! cancelled when client disconnects or deadline passes,
+    //! long running work should check it and stop early
+    //!
+    Cancellation cancellation;
+
+    //!
+    //! \brief deadline
+    //! time by which response has to be sent, forever by default
+    //! set by Application from route timeout or timeout request header
+    //!
+    QDeadlineTimer deadline = QDeadlineTimer(QDeadlineTimer::Forever);
+
+    //!
+    //! \brief started
+    //! monotonic time in nanoseconds when first byte of request was read
+    //!
+    qint64 started = 0;
+
+    //!
+    //! \brief profile
+    //! middleware costs of sampled request, set by Application when profiling is enabled
+    //!
+    QSharedPointer<Recurse::Profile> profile;
+
+    //!
+    //! \brief sink
+    //! receives serialized reply of request without socket, set by Application::inject
+    //!
+    std::function<void(const QByteArray &reply)> sink;
+
     //!
     //! \brief set
     //! Set data into context that can be passed around
@@ -46,12 +172,34 @@ public:
     //!
     QHash<QString, void *> data;
 
+    //!
+    //! \brief scope
+    //! QObject that lives as long as the context (shared by its copies)
+    //! use it as parent or connection context for objects bound to the request,
+    //! they are freed and disconnected once client is gone
+    //!
+    //! \return QObject scope of the context
+    //!
+    QObject *scope()
+    {
+        if (!m_scope)
+            m_scope = QSharedPointer<QObject>(new QObject);
+
+        return m_scope.data();
+    }
+
 private:
     //!
     //! \brief m_data
     //! Context data holder
     //!
     QHash<QString, QVariant> m_data;
+
+    //!
+    //! \brief m_scope
+    //! lazily created lifetime object, see scope()
+    //!
+    QSharedPointer<QObject> m_scope;
 };
 
 #endif
@@ -13,7 +13,15 @@ SOURCES += 404.cpp
 HEADERS += ../../recurse.hpp \
            ../../request.hpp \
            ../../response.hpp \
-           ../../context.hpp
+           ../../context.hpp \
+           ../../executor.hpp \
+           ../../stream.hpp \
+           ../../json.hpp \
+           ../../writer.hpp \
+           ../../metrics.hpp \
+           ../../profiler.hpp \
+           ../../trace.hpp \
+           ../../watchdog.hpp
 
 QMAKE_CXXFLAGS += -std=c++14
 
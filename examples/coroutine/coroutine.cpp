@@ -0,0 +1,43 @@
+/*
+*
+* coroutine example, middlewares co_await thread pool work and timers
+* without blocking event loop and without managing QFutureWatcher by hand
+*/
+
+#include <recurse.hpp>
+#include <modules/coroutine.hpp>
+
+int main(int argc, char *argv[])
+{
+    Recurse::Application app(argc, argv);
+
+    // downstream middleware can be a coroutine as well
+    app.use([](Context &ctx, Recurse::Next next) -> Module::Task
+    {
+        // wait a bit without blocking other clients
+        co_await Module::delay(10);
+
+        ctx.set("delayed", true);
+        next();
+    });
+
+    app.use([](Context &ctx) -> Module::Task
+    {
+        // some long running action runs in thread pool, we resume on event loop once it's done
+        // if client disconnects in the meantime, this coroutine is destroyed and never resumed
+        auto data = co_await Module::run([]
+        {
+            QThread::sleep(1);
+
+            return QString("Hello from thread pool");
+        });
+
+        ctx.response.send(data);
+    });
+
+    auto result = app.listen(3001);
+    if (result.error())
+    {
+        qDebug() << "error upon listening:" << result.lastError();
+    }
+}
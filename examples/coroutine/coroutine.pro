@@ -0,0 +1,33 @@
+TARGET = recurse_coroutine
+
+QT       += core network concurrent
+QT       -= gui
+
+CONFIG   += console
+CONFIG   += c++2a
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+SOURCES += coroutine.cpp
+HEADERS += ../../recurse.hpp \
+           ../../request.hpp \
+           ../../response.hpp \
+           ../../context.hpp \
+           ../../executor.hpp \
+           ../../stream.hpp \
+           ../../json.hpp \
+           ../../writer.hpp \
+           ../../metrics.hpp \
+           ../../profiler.hpp \
+           ../../trace.hpp \
+           ../../watchdog.hpp \
+           ../../modules/coroutine.hpp
+
+QMAKE_CXXFLAGS += -std=c++2a
+
+macx {
+    QMAKE_CXXFLAGS += -stdlib=libc++
+}
+
+INCLUDEPATH += $$PWD/../../
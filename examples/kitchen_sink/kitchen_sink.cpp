@@ -87,8 +87,9 @@ int main(int argc, char *argv[])
         });
 
         // get results and send response to client
-        auto watcher = new QFutureWatcher<QJsonDocument>;
-        QObject::connect(watcher, &QFutureWatcher<QJsonDocument>::finished, [&res, future]()
+        // watcher is freed with the context, when client goes away nothing is called
+        auto watcher = new QFutureWatcher<QJsonDocument>(ctx.scope());
+        QObject::connect(watcher, &QFutureWatcher<QJsonDocument>::finished, ctx.scope(), [&res, future]()
         {
             qDebug() << "long running action done";
 
@@ -0,0 +1,65 @@
+/*
+*
+* connection pool example, every pool thread has its own sqlite connection
+* queries run in application's executor and results are sent from event loop
+*/
+
+#include <recurse.hpp>
+#include <modules/sql_pool.hpp>
+#include <QtSql>
+
+int main(int argc, char *argv[])
+{
+    Recurse::Application app(argc, argv);
+
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "main");
+    db.setDatabaseName("sqlite.db");
+
+    if (!db.open())
+    {
+        qDebug() << db.lastError();
+        return 1;
+    }
+
+    db.exec("DROP TABLE if exists lorem");
+    db.exec("CREATE TABLE lorem (id INTEGER PRIMARY KEY, info TEXT)");
+
+    db.transaction();
+
+    for (int i = 0; i < 10; i++)
+        db.exec(QString("INSERT INTO lorem (info) VALUES('ipsum %1')").arg(i));
+
+    db.commit();
+
+    Module::SqlPool sql(&app, db, {{ "min", 2 }, { "max", 4 }});
+
+    app.use([&sql](auto &ctx)
+    {
+        bool queued = sql.query(ctx, "SELECT info FROM lorem WHERE id > ?", { 2 }, [&ctx](auto &result)
+        {
+            if (!result.ok)
+            {
+                // database details stay in server log
+                qWarning() << "query failed:" << result.error.text();
+                ctx.response.status(500).send(ctx.response.http_codes.value(500));
+                return;
+            }
+
+            QString data;
+
+            for (const auto &row : result.rows)
+                data += row.value(0).toString() % "\n";
+
+            ctx.response.send(data);
+        });
+
+        if (!queued)
+            ctx.response.status(503).send("Service Unavailable");
+    });
+
+    auto result = app.listen(3001);
+    if (result.error())
+    {
+        qDebug() << "error upon listening:" << result.lastError();
+    }
+}
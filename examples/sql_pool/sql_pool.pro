@@ -0,0 +1,33 @@
+TARGET = recurse_sql_pool
+
+QT       += core network sql
+QT       -= gui
+
+CONFIG   += console
+CONFIG   += c++14
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+SOURCES += sql_pool.cpp
+HEADERS += ../../recurse.hpp \
+           ../../request.hpp \
+           ../../response.hpp \
+           ../../context.hpp \
+           ../../executor.hpp \
+           ../../stream.hpp \
+           ../../json.hpp \
+           ../../writer.hpp \
+           ../../metrics.hpp \
+           ../../profiler.hpp \
+           ../../trace.hpp \
+           ../../watchdog.hpp \
+           ../../modules/sql_pool.hpp
+
+QMAKE_CXXFLAGS += -std=c++14
+
+macx {
+    QMAKE_CXXFLAGS += -stdlib=libc++
+}
+
+INCLUDEPATH += $$PWD/../../
@@ -50,8 +50,9 @@ int main(int argc, char *argv[])
         });
 
         // get result from thread and send it to client
-        auto watcher = new QFutureWatcher<QString>;
-        QObject::connect(watcher, &QFutureWatcher<QString>::finished, [&ctx, future]
+        // watcher is freed with the context, when client goes away nothing is called
+        auto watcher = new QFutureWatcher<QString>(ctx.scope());
+        QObject::connect(watcher, &QFutureWatcher<QString>::finished, ctx.scope(), [&ctx, future]
         {
             ctx.response.send(future.result());
         });
@@ -0,0 +1,396 @@
+#ifndef RECURSE_EXECUTOR_HPP
+#define RECURSE_EXECUTOR_HPP
+
+#include <QAtomicInteger>
+#include <QDeadlineTimer>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QObject>
+#include <QPointer>
+#include <QRunnable>
+#include <QSharedPointer>
+#include <QThread>
+#include <QThreadPool>
+#include <QVariant>
+#include <QVector>
+#include <functional>
+
+namespace Recurse
+{
+
+    //!
+    //! \brief The Executor class
+    //! Blocking work executor with bulkheads
+    //!
+    //! Work runs in named thread pools with bounded queues, so one slow endpoint can't take
+    //! every thread. Jobs can be grouped (eg: by route) with concurrency cap per group, and
+    //! have priorities. Completion callbacks are collected from workers and delivered back to
+    //! the thread that owns the executor (application's event loop), with single wakeup
+    //! per batch of completed jobs.
+    //!
+    //! Executor is meant to be used from the thread it was created in
+    //!
+    //!     app.executor().pool("reports", 2, 16);
+    //!     app.executor().limit("/reports/yearly", 1);
+    //!
+    //!     bool queued = app.executor().run("reports", []
+    //!     {
+    //!         return QVariant(build_report());
+    //!     },
+    //!     [&ctx](const QVariant &result)
+    //!     {
+    //!         ctx.response.send(result.toString());
+    //!     }, ctx.scope(), 0, "/reports/yearly");
+    //!
+    //!     if (!queued)
+    //!         ctx.response.status(503).send("Busy");
+    //!
+    class Executor
+    {
+    public:
+        using Work = std::function<QVariant()>;
+        using Done = std::function<void(const QVariant &result)>;
+
+        Executor();
+        ~Executor();
+
+        Executor &pool(const QString &name, int threads, int queue_size = 0, int expiry_timeout = 30000);
+        Executor &limit(const QString &group, int max_concurrent);
+
+        bool run(const QString &pool, Work work, Done done, QObject *context = nullptr, int priority = 0,
+            const QString &group = QString());
+
+        QHash<QString, QVariant> stats() const;
+
+    private:
+        //!
+        //! \brief The Pool struct
+        //! thread pool and its metrics, counters are updated from workers
+        //!
+        struct Pool
+        {
+            QThreadPool threads;
+            int queue_size = 0;
+            QAtomicInteger<qint64> queued;
+            QAtomicInteger<qint64> active;
+            QAtomicInteger<qint64> completed;
+            QAtomicInteger<qint64> rejected;
+            QAtomicInteger<qint64> wait_total;
+            QAtomicInteger<qint64> wait_max;
+        };
+
+        //!
+        //! \brief The Job struct
+        //! submitted work with its bookkeeping
+        //!
+        struct Job
+        {
+            QSharedPointer<Pool> pool;
+            Work work;
+            Done done;
+            QPointer<QObject> context;
+            bool has_context;
+            int priority;
+            QString group;
+            qint64 submitted;
+
+            //!
+            //! \brief counted
+            //! job took slot of its group, group may be limited only after job was started
+            //!
+            bool counted = false;
+        };
+
+        //!
+        //! \brief The Group struct
+        //! concurrency cap, jobs over the cap wait here ordered by priority
+        //!
+        struct Group
+        {
+            int max_concurrent = 0;
+            int running = 0;
+            QList<Job> waiting;
+        };
+
+        class Runnable : public QRunnable
+        {
+        public:
+            Runnable(std::function<void()> f)
+                : m_f(std::move(f))
+            {
+            }
+
+            void run() override
+            {
+                m_f();
+            }
+
+        private:
+            std::function<void()> m_f;
+        };
+
+        QHash<QString, QSharedPointer<Pool>> m_pools;
+        QHash<QString, Group> m_groups;
+
+        QObject m_loop;
+        QMutex m_completed_mutex;
+        QVector<std::function<void()>> m_completed;
+
+        void m_start(const Job &job);
+        void m_complete(std::function<void()> f);
+        void m_drain();
+        void m_release(const QString &group, bool counted);
+
+        static qint64 m_now();
+    };
+
+    inline Executor::Executor()
+    {
+        pool("default", QThread::idealThreadCount());
+    }
+
+    inline Executor::~Executor()
+    {
+        for (auto &pool : m_pools)
+            pool->threads.waitForDone();
+    }
+
+    //!
+    //! \brief Executor::pool
+    //! create or reconfigure named thread pool
+    //!
+    //! \param name pool name, "default" pool exists with one thread per core
+    //! \param threads maximum number of threads
+    //! \param queue_size maximum number of jobs waiting for a thread, 0 for unbounded
+    //! \param expiry_timeout milliseconds after idle thread exits, -1 to keep threads forever
+    //! (eg: when they hold thread-local resources like database connections)
+    //! \return Executor chainable
+    //!
+    inline Executor &Executor::pool(const QString &name, int threads, int queue_size, int expiry_timeout)
+    {
+        auto &pool = m_pools[name];
+
+        if (!pool)
+            pool = QSharedPointer<Pool>(new Pool);
+
+        pool->threads.setMaxThreadCount(qMax(1, threads));
+        pool->threads.setExpiryTimeout(expiry_timeout);
+        pool->queue_size = queue_size;
+
+        return *this;
+    }
+
+    //!
+    //! \brief Executor::limit
+    //! cap number of concurrently running jobs of a group, eg: route
+    //!
+    //! \param group group name
+    //! \param max_concurrent maximum running jobs, 0 for no limit
+    //! \return Executor chainable
+    //!
+    inline Executor &Executor::limit(const QString &group, int max_concurrent)
+    {
+        m_groups[group].max_concurrent = max_concurrent;
+        return *this;
+    }
+
+    //!
+    //! \brief Executor::run
+    //! queue work to be run in pool
+    //!
+    //! \param pool pool name
+    //! \param work function called in pool thread
+    //! \param done function called with the result in executor's thread
+    //! \param context optional, if destroyed before done is called, done is skipped
+    //! and work still waiting for its group is dropped, eg: ctx.scope()
+    //! \param priority jobs with higher priority are started first
+    //! \param group optional group with concurrency cap, see limit()
+    //! \return false if pool does not exist or its queue is full
+    //!
+    inline bool Executor::run(const QString &pool, Work work, Done done, QObject *context, int priority, const QString &group)
+    {
+        auto p = m_pools.value(pool);
+
+        if (!p)
+            return false;
+
+        if (p->queue_size > 0 && p->queued.load() >= p->queue_size)
+        {
+            p->rejected.fetchAndAddRelaxed(1);
+            return false;
+        }
+
+        p->queued.fetchAndAddRelaxed(1);
+
+        Job job{ p, std::move(work), std::move(done), context, context != nullptr, priority, group, m_now() };
+
+        if (!group.isEmpty() && m_groups.contains(group))
+        {
+            auto &g = m_groups[group];
+
+            if (g.max_concurrent > 0 && g.running >= g.max_concurrent)
+            {
+                int i = 0;
+                while (i < g.waiting.size() && g.waiting.at(i).priority >= priority)
+                    ++i;
+
+                g.waiting.insert(i, job);
+                return true;
+            }
+
+            ++g.running;
+            job.counted = true;
+        }
+
+        m_start(job);
+        return true;
+    }
+
+    //!
+    //! \brief Executor::stats
+    //! pool metrics, eg: stats()["default"].toHash()["queued"]
+    //!
+    //! queued - jobs waiting for a thread, active - jobs running, completed, rejected,
+    //! wait_avg_ms and wait_max_ms - time jobs spent waiting before being started
+    //!
+    //! \return QHash<QString, QVariant> of pool name and its metrics
+    //!
+    inline QHash<QString, QVariant> Executor::stats() const
+    {
+        QHash<QString, QVariant> result;
+
+        for (auto i = m_pools.constBegin(); i != m_pools.constEnd(); ++i)
+        {
+            const auto &p = i.value();
+            qint64 completed = p->completed.load();
+
+            QHash<QString, QVariant> pool;
+            pool["queued"] = p->queued.load();
+            pool["active"] = p->active.load();
+            pool["completed"] = completed;
+            pool["rejected"] = p->rejected.load();
+            pool["wait_avg_ms"] = completed ? p->wait_total.load() / completed : 0;
+            pool["wait_max_ms"] = p->wait_max.load();
+            pool["threads"] = p->threads.maxThreadCount();
+
+            result[i.key()] = pool;
+        }
+
+        return result;
+    }
+
+    //!
+    //! \brief Executor::m_start
+    //! hand job over to its pool
+    //!
+    inline void Executor::m_start(const Job &job)
+    {
+        auto runnable = new Runnable([this, job]
+        {
+            auto &p = job.pool;
+
+            qint64 waited = m_now() - job.submitted;
+            p->queued.fetchAndSubRelaxed(1);
+            p->active.fetchAndAddRelaxed(1);
+            p->wait_total.fetchAndAddRelaxed(waited);
+
+            qint64 max = p->wait_max.load();
+            while (waited > max && !p->wait_max.testAndSetRelaxed(max, waited))
+                max = p->wait_max.load();
+
+            QVariant result = job.work();
+
+            p->active.fetchAndSubRelaxed(1);
+            p->completed.fetchAndAddRelaxed(1);
+
+            m_complete([this, job, result]
+            {
+                m_release(job.group, job.counted);
+
+                if (job.has_context && !job.context)
+                    return;
+
+                if (job.done)
+                    job.done(result);
+            });
+        });
+
+        runnable->setAutoDelete(true);
+        job.pool->threads.start(runnable, job.priority);
+    }
+
+    //!
+    //! \brief Executor::m_complete
+    //! called from worker, queue completion for executor's thread,
+    //! event loop is woken up only by first completion of a batch
+    //!
+    inline void Executor::m_complete(std::function<void()> f)
+    {
+        QMutexLocker locker(&m_completed_mutex);
+
+        bool wakeup = m_completed.isEmpty();
+        m_completed.push_back(std::move(f));
+
+        if (wakeup)
+            QMetaObject::invokeMethod(&m_loop, [this] { m_drain(); }, Qt::QueuedConnection);
+    }
+
+    //!
+    //! \brief Executor::m_drain
+    //! run all completions collected since last wakeup
+    //!
+    inline void Executor::m_drain()
+    {
+        QVector<std::function<void()>> completed;
+
+        {
+            QMutexLocker locker(&m_completed_mutex);
+            completed.swap(m_completed);
+        }
+
+        for (const auto &f : completed)
+            f();
+    }
+
+    //!
+    //! \brief Executor::m_release
+    //! job of a group finished, start next waiting job of the group,
+    //! jobs whose context is already gone are dropped without running
+    //!
+    //! \param group group of finished job
+    //! \param counted job took slot of the group
+    //!
+    inline void Executor::m_release(const QString &group, bool counted)
+    {
+        if (!counted || group.isEmpty() || !m_groups.contains(group))
+            return;
+
+        auto &g = m_groups[group];
+        --g.running;
+
+        while (!g.waiting.isEmpty())
+        {
+            Job job = g.waiting.takeFirst();
+
+            if (job.has_context && !job.context)
+            {
+                job.pool->queued.fetchAndSubRelaxed(1);
+                continue;
+            }
+
+            ++g.running;
+            job.counted = true;
+            m_start(job);
+            return;
+        }
+    }
+
+    inline qint64 Executor::m_now()
+    {
+        return QDeadlineTimer::current().deadline();
+    }
+}
+
+#endif
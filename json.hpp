@@ -0,0 +1,640 @@
+#ifndef RECURSE_JSON_HPP
+#define RECURSE_JSON_HPP
+
+#include <QByteArray>
+#include <QString>
+#include <QVarLengthArray>
+#include <QVariant>
+#include <cmath>
+#include <cstring>
+#include <functional>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace Recurse
+{
+
+    //!
+    //! \brief The JsonWriter class
+    //! Fast JSON writer appending straight into UTF-8 output buffer
+    //!
+    //! There is no intermediate QJsonObject/QJsonArray and no UTF-16 round trip, strings are
+    //! escaped with SSE2 where available and numbers are formatted without locale.
+    //! Commas are handled by the writer. Obtained with Response::json() or constructed with
+    //! a sink function for streamed responses, where output is handed over in chunks.
+    //!
+    //!     ctx.response.json()
+    //!         .beginObject()
+    //!             .key("hello").value("world")
+    //!             .key("items").beginArray().value(1).value(2.5).value(true).endArray()
+    //!         .endObject();
+    //!
+    //!     ctx.response.send();
+    //!
+    class JsonWriter
+    {
+    public:
+        using Sink = std::function<void(const QByteArray &chunk)>;
+
+        JsonWriter(QByteArray &out);
+        JsonWriter(Sink sink, int chunk_size = 16 * 1024);
+        ~JsonWriter();
+
+        JsonWriter(const JsonWriter &other);
+
+        JsonWriter &beginObject();
+        JsonWriter &endObject();
+        JsonWriter &beginArray();
+        JsonWriter &endArray();
+
+        JsonWriter &key(const QString &key);
+        JsonWriter &key(const char *key);
+
+        JsonWriter &value(const QString &value);
+        JsonWriter &value(const char *value);
+        JsonWriter &value(bool value);
+        JsonWriter &value(int value);
+        JsonWriter &value(uint value);
+        JsonWriter &value(long value);
+        JsonWriter &value(ulong value);
+        JsonWriter &value(qint64 value);
+        JsonWriter &value(quint64 value);
+        JsonWriter &value(double value);
+        JsonWriter &value(const QVariant &value);
+        JsonWriter &null();
+        JsonWriter &raw(const QByteArray &json);
+
+        void flush();
+
+        static void escape(QByteArray &out, const QChar *data, int size);
+        static void escape(QByteArray &out, const char *data, int size);
+        static void number(QByteArray &out, qint64 value);
+        static void number(QByteArray &out, quint64 value);
+        static void number(QByteArray &out, double value);
+
+    private:
+        QByteArray m_own;
+        QByteArray *m_out;
+        Sink m_sink;
+        int m_chunk_size = 0;
+
+        //!
+        //! \brief m_comma
+        //! per nesting level, true if next element needs comma before it
+        //!
+        QVarLengthArray<bool, 32> m_comma;
+        bool m_after_key = false;
+
+        void m_element();
+        void m_maybe_flush();
+    };
+
+    //!
+    //! \brief JsonWriter::JsonWriter
+    //! write into existing buffer, eg: response body
+    //!
+    inline JsonWriter::JsonWriter(QByteArray &out)
+        : m_out(&out)
+    {
+        m_comma.append(false);
+    }
+
+    //!
+    //! \brief JsonWriter::JsonWriter
+    //! overloaded function,
+    //! write into own buffer which is handed over to sink once it reaches chunk_size
+    //! and on flush() or destruction
+    //!
+    inline JsonWriter::JsonWriter(Sink sink, int chunk_size)
+        : m_out(&m_own),
+          m_sink(std::move(sink)),
+          m_chunk_size(chunk_size)
+    {
+        m_own.reserve(chunk_size + 1024);
+        m_comma.append(false);
+    }
+
+    inline JsonWriter::JsonWriter(const JsonWriter &other)
+        : m_own(other.m_own),
+          m_out(other.m_out == &other.m_own ? &m_own : other.m_out),
+          m_sink(other.m_sink),
+          m_chunk_size(other.m_chunk_size),
+          m_comma(other.m_comma),
+          m_after_key(other.m_after_key)
+    {
+    }
+
+    inline JsonWriter::~JsonWriter()
+    {
+        flush();
+    }
+
+    //!
+    //! \brief JsonWriter::flush
+    //! hand buffered output over to sink, no-op when writing into existing buffer
+    //!
+    inline void JsonWriter::flush()
+    {
+        if (!m_sink || m_own.isEmpty())
+            return;
+
+        m_sink(m_own);
+        m_own.resize(0);
+    }
+
+    inline JsonWriter &JsonWriter::beginObject()
+    {
+        m_element();
+        m_out->append('{');
+        m_comma.append(false);
+
+        return *this;
+    }
+
+    inline JsonWriter &JsonWriter::endObject()
+    {
+        m_comma.removeLast();
+        m_out->append('}');
+        m_maybe_flush();
+
+        return *this;
+    }
+
+    inline JsonWriter &JsonWriter::beginArray()
+    {
+        m_element();
+        m_out->append('[');
+        m_comma.append(false);
+
+        return *this;
+    }
+
+    inline JsonWriter &JsonWriter::endArray()
+    {
+        m_comma.removeLast();
+        m_out->append(']');
+        m_maybe_flush();
+
+        return *this;
+    }
+
+    inline JsonWriter &JsonWriter::key(const QString &key)
+    {
+        m_element();
+        escape(*m_out, key.constData(), key.size());
+        m_out->append(':');
+        m_after_key = true;
+
+        return *this;
+    }
+
+    //!
+    //! \brief JsonWriter::key
+    //! overloaded function, key as UTF-8 string
+    //!
+    inline JsonWriter &JsonWriter::key(const char *key)
+    {
+        m_element();
+        escape(*m_out, key, static_cast<int>(std::strlen(key)));
+        m_out->append(':');
+        m_after_key = true;
+
+        return *this;
+    }
+
+    inline JsonWriter &JsonWriter::value(const QString &value)
+    {
+        m_element();
+        escape(*m_out, value.constData(), value.size());
+        m_maybe_flush();
+
+        return *this;
+    }
+
+    //!
+    //! \brief JsonWriter::value
+    //! overloaded function, value as UTF-8 string
+    //!
+    inline JsonWriter &JsonWriter::value(const char *value)
+    {
+        m_element();
+        escape(*m_out, value, static_cast<int>(std::strlen(value)));
+        m_maybe_flush();
+
+        return *this;
+    }
+
+    inline JsonWriter &JsonWriter::value(bool value)
+    {
+        m_element();
+        m_out->append(value ? "true" : "false");
+
+        return *this;
+    }
+
+    inline JsonWriter &JsonWriter::value(int value)
+    {
+        return this->value(static_cast<qint64>(value));
+    }
+
+    inline JsonWriter &JsonWriter::value(uint value)
+    {
+        return this->value(static_cast<quint64>(value));
+    }
+
+    //!
+    //! \brief JsonWriter::value
+    //! overloaded function, long and unsigned long (eg: size_t) are distinct from
+    //! qint64 and quint64 on some platforms, without them such calls would be ambiguous
+    //!
+    inline JsonWriter &JsonWriter::value(long value)
+    {
+        return this->value(static_cast<qint64>(value));
+    }
+
+    inline JsonWriter &JsonWriter::value(ulong value)
+    {
+        return this->value(static_cast<quint64>(value));
+    }
+
+    inline JsonWriter &JsonWriter::value(qint64 value)
+    {
+        m_element();
+        number(*m_out, value);
+
+        return *this;
+    }
+
+    inline JsonWriter &JsonWriter::value(quint64 value)
+    {
+        m_element();
+        number(*m_out, value);
+
+        return *this;
+    }
+
+    inline JsonWriter &JsonWriter::value(double value)
+    {
+        m_element();
+        number(*m_out, value);
+
+        return *this;
+    }
+
+    //!
+    //! \brief JsonWriter::value
+    //! overloaded function, null variants are written as null, numbers and booleans as they are,
+    //! byte arrays as UTF-8 strings and anything else by its string conversion
+    //!
+    inline JsonWriter &JsonWriter::value(const QVariant &value)
+    {
+        if (value.isNull())
+            return null();
+
+        switch (value.userType())
+        {
+            case QMetaType::Bool:
+                return this->value(value.toBool());
+            case QMetaType::Int:
+            case QMetaType::LongLong:
+            case QMetaType::Short:
+            case QMetaType::Long:
+                return this->value(value.toLongLong());
+            case QMetaType::UInt:
+            case QMetaType::ULongLong:
+            case QMetaType::UShort:
+            case QMetaType::ULong:
+                return this->value(value.toULongLong());
+            case QMetaType::Double:
+            case QMetaType::Float:
+                return this->value(value.toDouble());
+            case QMetaType::QByteArray:
+            {
+                const QByteArray data = value.toByteArray();
+
+                m_element();
+                escape(*m_out, data.constData(), data.size());
+                m_maybe_flush();
+
+                return *this;
+            }
+            default:
+                return this->value(value.toString());
+        }
+    }
+
+    inline JsonWriter &JsonWriter::null()
+    {
+        m_element();
+        m_out->append("null");
+
+        return *this;
+    }
+
+    //!
+    //! \brief JsonWriter::raw
+    //! append already serialized JSON value, eg: cached fragment
+    //!
+    inline JsonWriter &JsonWriter::raw(const QByteArray &json)
+    {
+        m_element();
+        m_out->append(json);
+        m_maybe_flush();
+
+        return *this;
+    }
+
+    //!
+    //! \brief JsonWriter::m_element
+    //! separate element from previous one in current array or object
+    //!
+    inline void JsonWriter::m_element()
+    {
+        if (m_after_key)
+        {
+            m_after_key = false;
+            return;
+        }
+
+        if (m_comma.last())
+            m_out->append(',');
+        else
+            m_comma.last() = true;
+    }
+
+    inline void JsonWriter::m_maybe_flush()
+    {
+        if (m_sink && m_own.size() >= m_chunk_size)
+            flush();
+    }
+
+    //!
+    //! \brief JsonWriter::escape
+    //! append quoted and escaped UTF-16 string as UTF-8
+    //!
+    //! ASCII runs without characters to escape are narrowed 8 characters at a time (SSE2),
+    //! the rest is handled one character at a time
+    //!
+    inline void JsonWriter::escape(QByteArray &out, const QChar *data, int size)
+    {
+        static const char hex[] = "0123456789abcdef";
+
+        // worst case is \u00XX (6 bytes) per character, plus quotes
+        int start = out.size();
+        out.resize(start + size * 6 + 2);
+
+        char *p = out.data() + start;
+        const ushort *s = reinterpret_cast<const ushort *>(data);
+        const ushort *end = s + size;
+
+        *p++ = '"';
+
+        while (s < end)
+        {
+#ifdef __SSE2__
+            while (end - s >= 8)
+            {
+                __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+
+                // printable ASCII is 0x20..0x7f, shifting by 0x20 lets one unsigned compare check both ends
+                __m128i shifted = _mm_sub_epi16(chunk, _mm_set1_epi16(0x20));
+                __m128i outside = _mm_cmpgt_epi16(
+                    _mm_xor_si128(shifted, _mm_set1_epi16(short(0x8000))),
+                    _mm_set1_epi16(short(0x5f ^ 0x8000)));
+                __m128i quote = _mm_cmpeq_epi16(chunk, _mm_set1_epi16('"'));
+                __m128i backslash = _mm_cmpeq_epi16(chunk, _mm_set1_epi16('\\'));
+                __m128i special = _mm_or_si128(outside, _mm_or_si128(quote, backslash));
+
+                if (_mm_movemask_epi8(special))
+                    break;
+
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(p), _mm_packus_epi16(chunk, chunk));
+                p += 8;
+                s += 8;
+            }
+
+            if (s >= end)
+                break;
+#endif
+            ushort c = *s++;
+
+            if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\')
+            {
+                *p++ = char(c);
+            }
+            else if (c == '"' || c == '\\')
+            {
+                *p++ = '\\';
+                *p++ = char(c);
+            }
+            else if (c < 0x20)
+            {
+                *p++ = '\\';
+
+                switch (c)
+                {
+                    case '\n':
+                        *p++ = 'n';
+                        break;
+                    case '\r':
+                        *p++ = 'r';
+                        break;
+                    case '\t':
+                        *p++ = 't';
+                        break;
+                    case '\b':
+                        *p++ = 'b';
+                        break;
+                    case '\f':
+                        *p++ = 'f';
+                        break;
+                    default:
+                        *p++ = 'u';
+                        *p++ = '0';
+                        *p++ = '0';
+                        *p++ = hex[c >> 4];
+                        *p++ = hex[c & 0xf];
+                }
+            }
+            else if (c < 0x800)
+            {
+                *p++ = char(0xc0 | (c >> 6));
+                *p++ = char(0x80 | (c & 0x3f));
+            }
+            else if (QChar::isHighSurrogate(c) && s < end && QChar::isLowSurrogate(*s))
+            {
+                uint ucs4 = QChar::surrogateToUcs4(c, *s++);
+
+                *p++ = char(0xf0 | (ucs4 >> 18));
+                *p++ = char(0x80 | ((ucs4 >> 12) & 0x3f));
+                *p++ = char(0x80 | ((ucs4 >> 6) & 0x3f));
+                *p++ = char(0x80 | (ucs4 & 0x3f));
+            }
+            else
+            {
+                // lone surrogates are replaced, they can't be encoded in UTF-8
+                if (QChar::isSurrogate(c))
+                    c = QChar::ReplacementCharacter;
+
+                *p++ = char(0xe0 | (c >> 12));
+                *p++ = char(0x80 | ((c >> 6) & 0x3f));
+                *p++ = char(0x80 | (c & 0x3f));
+            }
+        }
+
+        *p++ = '"';
+
+        out.resize(int(p - out.data()));
+    }
+
+    //!
+    //! \brief JsonWriter::escape
+    //! overloaded function,
+    //! append quoted and escaped UTF-8 string, bytes above 0x7f are copied as they are
+    //!
+    inline void JsonWriter::escape(QByteArray &out, const char *data, int size)
+    {
+        static const char hex[] = "0123456789abcdef";
+
+        int start = out.size();
+        out.resize(start + size * 6 + 2);
+
+        char *p = out.data() + start;
+        const char *s = data;
+        const char *end = data + size;
+
+        *p++ = '"';
+
+        while (s < end)
+        {
+#ifdef __SSE2__
+            while (end - s >= 16)
+            {
+                __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+
+                // control characters are below 0x20 when compared unsigned, xor maps unsigned to signed
+                __m128i control = _mm_cmplt_epi8(
+                    _mm_xor_si128(chunk, _mm_set1_epi8(char(0x80))),
+                    _mm_set1_epi8(char(0x20 ^ 0x80)));
+                __m128i quote = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"'));
+                __m128i backslash = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\'));
+                __m128i special = _mm_or_si128(control, _mm_or_si128(quote, backslash));
+
+                if (_mm_movemask_epi8(special))
+                    break;
+
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(p), chunk);
+                p += 16;
+                s += 16;
+            }
+
+            if (s >= end)
+                break;
+#endif
+            uchar c = uchar(*s++);
+
+            if (c == '"' || c == '\\')
+            {
+                *p++ = '\\';
+                *p++ = char(c);
+            }
+            else if (c < 0x20)
+            {
+                *p++ = '\\';
+                *p++ = 'u';
+                *p++ = '0';
+                *p++ = '0';
+                *p++ = hex[c >> 4];
+                *p++ = hex[c & 0xf];
+            }
+            else
+            {
+                *p++ = char(c);
+            }
+        }
+
+        *p++ = '"';
+
+        out.resize(int(p - out.data()));
+    }
+
+    //!
+    //! \brief JsonWriter::number
+    //! append integer, two digits at a time
+    //!
+    inline void JsonWriter::number(QByteArray &out, quint64 value)
+    {
+        static const char digits[] =
+            "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+            "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+
+        char buffer[20];
+        char *p = buffer + sizeof(buffer);
+
+        while (value >= 100)
+        {
+            int i = int(value % 100) * 2;
+            value /= 100;
+
+            *--p = digits[i + 1];
+            *--p = digits[i];
+        }
+
+        if (value >= 10)
+        {
+            int i = int(value) * 2;
+
+            *--p = digits[i + 1];
+            *--p = digits[i];
+        }
+        else
+        {
+            *--p = char('0' + value);
+        }
+
+        out.append(p, int(buffer + sizeof(buffer) - p));
+    }
+
+    inline void JsonWriter::number(QByteArray &out, qint64 value)
+    {
+        if (value < 0)
+        {
+            out.append('-');
+            number(out, quint64(0) - quint64(value));
+            return;
+        }
+
+        number(out, quint64(value));
+    }
+
+    //!
+    //! \brief JsonWriter::number
+    //! append double, integral values take integer path, others shortest round-trip form,
+    //! NaN and infinity are not representable in JSON and are written as null
+    //!
+    inline void JsonWriter::number(QByteArray &out, double value)
+    {
+        if (!std::isfinite(value))
+        {
+            out.append("null");
+            return;
+        }
+
+        if (value == std::floor(value) && std::fabs(value) < 9007199254740992.0)
+        {
+            if (value == 0 && std::signbit(value))
+                out.append("-0");
+            else
+                number(out, qint64(value));
+
+            return;
+        }
+
+        out.append(QByteArray::number(value, 'g', QLocale::FloatingPointShortest));
+    }
+}
+
+#endif
@@ -0,0 +1,343 @@
+#ifndef RECURSE_METRICS_HPP
+#define RECURSE_METRICS_HPP
+
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QDeadlineTimer>
+#include <QHash>
+#include <QMutex>
+#include <QThread>
+#include <memory>
+#include <vector>
+
+#include "executor.hpp"
+
+namespace Recurse
+{
+
+    //!
+    //! \brief The Metrics class
+    //! Server counters and latency histograms, rendered in Prometheus text format
+    //!
+    //! Every thread records into its own shard, values are written by that thread only so
+    //! recording is plain relaxed load and store without locks or contended cache lines.
+    //! Scrapes sum all shards, mutex is taken only when thread records for the first time.
+    //!
+    //!     app.metricsPath("/metrics");
+    //!     app.metrics().add(Recurse::Metrics::ParseErrors);
+    //!
+    class Metrics
+    {
+    public:
+        enum Counter
+        {
+            ConnectionsAccepted,
+            ConnectionsRejected,
+            ConnectionsClosed,
+            Requests1xx,
+            Requests2xx,
+            Requests3xx,
+            Requests4xx,
+            Requests5xx,
+            BytesReceived,
+            BytesSent,
+            ParseErrors,
+            TlsHandshakeFailures,
+            EventLoopStalls,
+            CounterCount
+        };
+
+        enum Histogram
+        {
+            TimeToFirstByte,
+            RequestDuration,
+            EventLoopLag,
+            HistogramCount
+        };
+
+        Metrics();
+
+        void add(Counter counter, quint64 value = 1);
+        void observe(Histogram histogram, qint64 nsecs);
+        void request(quint16 status, qint64 nsecs);
+
+        quint64 value(Counter counter) const;
+        QByteArray render(const Executor *executor = nullptr) const;
+
+        static qint64 now();
+
+    private:
+        //!
+        //! \brief bucket upper bounds in nanoseconds, 0.5ms to 10s, last bucket is +Inf
+        //!
+        static constexpr int BucketCount = 14;
+
+        struct Shard
+        {
+            QAtomicInteger<quint64> counters[CounterCount];
+            QAtomicInteger<quint64> buckets[HistogramCount][BucketCount + 1];
+            QAtomicInteger<quint64> sums[HistogramCount];
+        };
+
+        quint64 m_id;
+        mutable QMutex m_mutex;
+        std::vector<std::unique_ptr<Shard>> m_shards;
+        QHash<Qt::HANDLE, Shard *> m_threads;
+
+        Shard *m_shard();
+
+        static const qint64 *m_bounds();
+        static void m_increment(QAtomicInteger<quint64> &value, quint64 by);
+        static void m_counter(QByteArray &out, const char *name, const char *help, quint64 value);
+    };
+
+    inline Metrics::Metrics()
+    {
+        // thread caches remember instance by id, address of destroyed instance can be reused
+        static QAtomicInteger<quint64> ids;
+        m_id = ids.fetchAndAddRelaxed(1) + 1;
+    }
+
+    //!
+    //! \brief Metrics::now
+    //! \return monotonic time in nanoseconds
+    //!
+    inline qint64 Metrics::now()
+    {
+        return QDeadlineTimer::current().deadlineNSecs();
+    }
+
+    //!
+    //! \brief Metrics::add
+    //! increase counter of current thread
+    //!
+    inline void Metrics::add(Counter counter, quint64 value)
+    {
+        m_increment(m_shard()->counters[counter], value);
+    }
+
+    //!
+    //! \brief Metrics::observe
+    //! record duration into histogram
+    //!
+    //! \param histogram
+    //! \param nsecs duration in nanoseconds
+    //!
+    inline void Metrics::observe(Histogram histogram, qint64 nsecs)
+    {
+        const qint64 *bounds = m_bounds();
+
+        int bucket = 0;
+        while (bucket < BucketCount && nsecs > bounds[bucket])
+            ++bucket;
+
+        Shard *shard = m_shard();
+
+        m_increment(shard->buckets[histogram][bucket], 1);
+        m_increment(shard->sums[histogram], quint64(qMax<qint64>(0, nsecs)));
+    }
+
+    //!
+    //! \brief Metrics::request
+    //! record finished request, its status class and total duration
+    //!
+    //! \param status HTTP response status
+    //! \param nsecs request duration in nanoseconds, negative to count status only
+    //!
+    inline void Metrics::request(quint16 status, qint64 nsecs)
+    {
+        int status_class = qBound(1, status / 100, 5);
+
+        add(Counter(Requests1xx + status_class - 1));
+
+        if (nsecs >= 0)
+            observe(RequestDuration, nsecs);
+    }
+
+    //!
+    //! \brief Metrics::value
+    //! \return counter summed over all threads
+    //!
+    inline quint64 Metrics::value(Counter counter) const
+    {
+        QMutexLocker lock(&m_mutex);
+
+        quint64 total = 0;
+        for (const auto &shard : m_shards)
+            total += shard->counters[counter].load();
+
+        return total;
+    }
+
+    //!
+    //! \brief Metrics::render
+    //! Prometheus text exposition format (version 0.0.4)
+    //!
+    //! \param executor optional, its pools are exported as gauges
+    //! \return QByteArray metrics page
+    //!
+    inline QByteArray Metrics::render(const Executor *executor) const
+    {
+        quint64 counters[CounterCount] = {};
+        quint64 buckets[HistogramCount][BucketCount + 1] = {};
+        quint64 sums[HistogramCount] = {};
+
+        {
+            QMutexLocker lock(&m_mutex);
+
+            for (const auto &shard : m_shards)
+            {
+                for (int i = 0; i < CounterCount; ++i)
+                    counters[i] += shard->counters[i].load();
+
+                for (int h = 0; h < HistogramCount; ++h)
+                {
+                    for (int b = 0; b <= BucketCount; ++b)
+                        buckets[h][b] += shard->buckets[h][b].load();
+
+                    sums[h] += shard->sums[h].load();
+                }
+            }
+        }
+
+        QByteArray out;
+        out.reserve(4096);
+
+        // closed is read after accepted, concurrent accept can only make gauge lower
+        quint64 closed = counters[ConnectionsClosed];
+        quint64 active = counters[ConnectionsAccepted] > closed ? counters[ConnectionsAccepted] - closed : 0;
+
+        out += "# HELP recurse_connections_active Open client connections.\n";
+        out += "# TYPE recurse_connections_active gauge\n";
+        out += "recurse_connections_active " + QByteArray::number(active) + "\n";
+
+        m_counter(out, "recurse_connections_accepted_total", "Accepted client connections.", counters[ConnectionsAccepted]);
+        m_counter(out, "recurse_connections_rejected_total", "Connections that failed to be accepted.", counters[ConnectionsRejected]);
+
+        out += "# HELP recurse_requests_total Finished requests by response status class.\n";
+        out += "# TYPE recurse_requests_total counter\n";
+
+        for (int i = 0; i < 5; ++i)
+        {
+            out += "recurse_requests_total{class=\"" + QByteArray::number(i + 1) + "xx\"} ";
+            out += QByteArray::number(counters[Requests1xx + i]) + "\n";
+        }
+
+        m_counter(out, "recurse_received_bytes_total", "Bytes read from clients.", counters[BytesReceived]);
+        m_counter(out, "recurse_sent_bytes_total", "Response bytes handed over to clients.", counters[BytesSent]);
+        m_counter(out, "recurse_parse_errors_total", "Requests with malformed request line.", counters[ParseErrors]);
+        m_counter(out, "recurse_tls_handshake_failures_total", "Failed TLS handshakes.", counters[TlsHandshakeFailures]);
+        m_counter(out, "recurse_event_loop_stalls_total", "Event loop stalls reported by watchdog.", counters[EventLoopStalls]);
+
+        const char *names[HistogramCount] = {
+            "recurse_time_to_first_byte_seconds",
+            "recurse_request_duration_seconds",
+            "recurse_event_loop_lag_seconds"
+        };
+        const char *helps[HistogramCount] = {
+            "Time from first request byte until response is handed over to client.",
+            "Time from first request byte until connection is closed.",
+            "Delay of event loop heartbeats measured by watchdog."
+        };
+
+        const qint64 *bounds = m_bounds();
+
+        for (int h = 0; h < HistogramCount; ++h)
+        {
+            QByteArray name = names[h];
+
+            out += "# HELP " + name + " " + helps[h] + "\n";
+            out += "# TYPE " + name + " histogram\n";
+
+            quint64 cumulative = 0;
+
+            for (int b = 0; b <= BucketCount; ++b)
+            {
+                cumulative += buckets[h][b];
+
+                QByteArray le = b < BucketCount ? QByteArray::number(double(bounds[b]) / 1e9, 'g', 6) : QByteArray("+Inf");
+                out += name + "_bucket{le=\"" + le + "\"} " + QByteArray::number(cumulative) + "\n";
+            }
+
+            out += name + "_sum " + QByteArray::number(double(sums[h]) / 1e9, 'g', 12) + "\n";
+            out += name + "_count " + QByteArray::number(cumulative) + "\n";
+        }
+
+        if (executor)
+        {
+            const auto stats = executor->stats();
+            const char *gauges[] = { "queued", "active", "completed", "rejected", "wait_max_ms", "threads" };
+
+            for (auto gauge : gauges)
+            {
+                QByteArray name = QByteArray("recurse_executor_") + gauge;
+
+                out += "# TYPE " + name + " gauge\n";
+
+                for (auto i = stats.constBegin(); i != stats.constEnd(); ++i)
+                {
+                    out += name + "{pool=\"" + i.key().toUtf8() + "\"} ";
+                    out += i.value().toHash().value(gauge).toByteArray() + "\n";
+                }
+            }
+        }
+
+        return out;
+    }
+
+    //!
+    //! \brief Metrics::m_shard
+    //! \return shard of current thread, created on first use
+    //!
+    inline Metrics::Shard *Metrics::m_shard()
+    {
+        thread_local quint64 cached_id = 0;
+        thread_local Shard *cached = nullptr;
+
+        if (cached_id == m_id)
+            return cached;
+
+        QMutexLocker lock(&m_mutex);
+
+        Shard *&shard = m_threads[QThread::currentThreadId()];
+
+        if (!shard)
+        {
+            m_shards.emplace_back(new Shard);
+            shard = m_shards.back().get();
+        }
+
+        cached_id = m_id;
+        cached = shard;
+
+        return shard;
+    }
+
+    inline const qint64 *Metrics::m_bounds()
+    {
+        static const qint64 bounds[BucketCount] = {
+            500000, 1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+            100000000, 250000000, 500000000, 1000000000, 2500000000, 5000000000, 10000000000
+        };
+
+        return bounds;
+    }
+
+    //!
+    //! \brief Metrics::m_increment
+    //! shard values have single writer, no read-modify-write instruction is needed
+    //!
+    inline void Metrics::m_increment(QAtomicInteger<quint64> &value, quint64 by)
+    {
+        value.store(value.load() + by);
+    }
+
+    inline void Metrics::m_counter(QByteArray &out, const char *name, const char *help, quint64 value)
+    {
+        out += QByteArray("# HELP ") + name + " " + help + "\n";
+        out += QByteArray("# TYPE ") + name + " counter\n";
+        out += QByteArray(name) + " " + QByteArray::number(value) + "\n";
+    }
+}
+
+#endif
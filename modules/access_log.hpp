@@ -0,0 +1,571 @@
+#ifndef RECURSE_MODULE_ACCESS_LOG_HPP
+#define RECURSE_MODULE_ACCESS_LOG_HPP
+
+#include <QAtomicInteger>
+#include <QDateTime>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+#include <QWaitCondition>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../recurse.hpp"
+
+namespace Module
+{
+
+    //!
+    //! \brief The AccessLog class
+    //! Asynchronous access log in common, combined or JSON format
+    //!
+    //! Lines are formatted by thread handling the request and copied into its own ring
+    //! buffer (single producer, single consumer, no locks). Background thread collects all
+    //! rings and appends them to file in large batched writes, rotating it by size. Request
+    //! threads never wait for disk, when ring is full the line is dropped and counted.
+    //!
+    //!     Module::AccessLog log({{ "path", "/var/log/app/access.log" }, { "format", "combined" }});
+    //!     app.use(log.middleware());
+    //!
+    class AccessLog
+    {
+    public:
+        enum Format
+        {
+            Common,
+            Combined,
+            Json
+        };
+
+        AccessLog(const QHash<QString, QVariant> &options = QHash<QString, QVariant>());
+        ~AccessLog();
+
+        Recurse::DownstreamUpstream middleware();
+
+        bool write(Context &ctx);
+        void reopen();
+
+        quint64 written() const;
+        quint64 dropped() const;
+
+    private:
+        //!
+        //! \brief The Ring struct
+        //! byte ring of length-prefixed lines, head is moved by producer and tail by consumer
+        //!
+        struct Ring
+        {
+            std::unique_ptr<char[]> data;
+            quint64 capacity = 0;
+            QAtomicInteger<quint64> head;
+            QAtomicInteger<quint64> tail;
+            QAtomicInteger<quint64> dropped;
+        };
+
+        Format m_format;
+        QString m_path;
+        quint64 m_ring_size;
+        int m_flush_interval;
+        qint64 m_max_size;
+        int m_keep;
+
+        quint64 m_id;
+        mutable QMutex m_mutex;
+        QWaitCondition m_wake;
+        bool m_stop = false;
+        std::vector<std::unique_ptr<Ring>> m_rings;
+        QHash<Qt::HANDLE, Ring *> m_threads;
+        std::thread m_thread;
+
+        QAtomicInt m_reopen;
+        QAtomicInteger<quint64> m_written;
+
+        QFile m_file;
+        qint64 m_size = 0;
+
+        Ring *m_ring();
+        void m_format_line(QByteArray &line, Context &ctx);
+        bool m_push(Ring &ring, const QByteArray &line);
+        void m_collect(Ring &ring, QByteArray &batch);
+
+        void m_run();
+        void m_write(const QByteArray &batch);
+        bool m_open();
+        void m_rotate();
+
+        static void m_quoted(QByteArray &line, const QString &value);
+        static const QByteArray &m_time(Format format, qint64 msecs);
+    };
+
+    //!
+    //! \brief AccessLog::AccessLog
+    //!
+    //! \param options QHash options of <QString, QVariant>
+    //!     "path" log file path, "-" for standard output (default)
+    //!     "format" "common" (default), "combined" or "json"
+    //!     "buffer_size" bytes of ring buffer per request thread, 1MB by default
+    //!     "flush_interval" milliseconds between batched writes, 200 by default
+    //!     "max_size" file size in bytes after which it is rotated, 0 to disable (default)
+    //!     "keep" number of rotated files kept as path.1 ... path.n, 5 by default
+    //!
+    inline AccessLog::AccessLog(const QHash<QString, QVariant> &options)
+    {
+        QString format = options.value("format", "common").toString().toLower();
+
+        m_format = format == "json" ? Json : format == "combined" ? Combined : Common;
+        m_path = options.value("path", "-").toString();
+        m_flush_interval = qMax(1, options.value("flush_interval", 200).toInt());
+        m_max_size = options.value("max_size", 0).toLongLong();
+        m_keep = qMax(0, options.value("keep", 5).toInt());
+
+        // power of two, positions are masked instead of divided
+        quint64 size = qMax<quint64>(4096, options.value("buffer_size", 1024 * 1024).toULongLong());
+        m_ring_size = 1;
+
+        while (m_ring_size < size)
+            m_ring_size <<= 1;
+
+        static QAtomicInteger<quint64> ids;
+        m_id = ids.fetchAndAddRelaxed(1) + 1;
+
+        m_thread = std::thread([this]
+        {
+            m_run();
+        });
+    }
+
+    //!
+    //! \brief AccessLog::~AccessLog
+    //! lines still in buffers are written before returning
+    //!
+    inline AccessLog::~AccessLog()
+    {
+        {
+            QMutexLocker lock(&m_mutex);
+            m_stop = true;
+            m_wake.wakeAll();
+        }
+
+        m_thread.join();
+    }
+
+    //!
+    //! \brief AccessLog::middleware
+    //! log every request once its response is done (upstream), should be used as first
+    //! middleware to see final response. Streamed responses skip upstream, use write() there
+    //!
+    //! \return DownstreamUpstream middleware
+    //!
+    inline Recurse::DownstreamUpstream AccessLog::middleware()
+    {
+        return [this](Context &ctx, Recurse::NextPrev next, Recurse::Prev prev)
+        {
+            next([this, &ctx, prev]
+            {
+                write(ctx);
+                prev();
+            });
+        };
+    }
+
+    //!
+    //! \brief AccessLog::write
+    //! log request with current response status and size
+    //!
+    //! \param ctx request context
+    //! \return false if line was dropped, buffer of current thread is full
+    //!
+    inline bool AccessLog::write(Context &ctx)
+    {
+        thread_local QByteArray line;
+
+        // reserved capacity is kept by resize(0), no allocation per line
+        if (line.capacity() < 1024)
+            line.reserve(1024);
+
+        line.resize(0);
+        m_format_line(line, ctx);
+
+        Ring *ring = m_ring();
+
+        if (m_push(*ring, line))
+            return true;
+
+        ring->dropped.store(ring->dropped.load() + 1);
+        return false;
+    }
+
+    //!
+    //! \brief AccessLog::reopen
+    //! close and reopen file on next write, eg: after external logrotate moved it
+    //!
+    inline void AccessLog::reopen()
+    {
+        m_reopen.storeRelease(1);
+    }
+
+    //!
+    //! \brief AccessLog::written
+    //! \return number of lines written to file
+    //!
+    inline quint64 AccessLog::written() const
+    {
+        return m_written.load();
+    }
+
+    //!
+    //! \brief AccessLog::dropped
+    //! \return number of lines dropped because ring buffer was full
+    //!
+    inline quint64 AccessLog::dropped() const
+    {
+        QMutexLocker lock(&m_mutex);
+
+        quint64 dropped = 0;
+        for (const auto &ring : m_rings)
+            dropped += ring->dropped.load();
+
+        return dropped;
+    }
+
+    //!
+    //! \brief AccessLog::m_ring
+    //! \return ring of current thread, created on first use
+    //!
+    inline AccessLog::Ring *AccessLog::m_ring()
+    {
+        thread_local quint64 cached_id = 0;
+        thread_local Ring *cached = nullptr;
+
+        if (cached_id == m_id)
+            return cached;
+
+        QMutexLocker lock(&m_mutex);
+
+        // cache is shared by all logs, thread may already have ring of this one
+        Ring *&ring = m_threads[QThread::currentThreadId()];
+
+        if (!ring)
+        {
+            m_rings.emplace_back(new Ring);
+            ring = m_rings.back().get();
+            ring->data.reset(new char[m_ring_size]);
+            ring->capacity = m_ring_size;
+        }
+
+        cached_id = m_id;
+        cached = ring;
+
+        return ring;
+    }
+
+    //!
+    //! \brief AccessLog::m_format_line
+    //! common: 127.0.0.1 - - [10/Oct/2000:13:55:36 +0000] "GET /a HTTP/1.1" 200 2326
+    //! combined adds "referer" "user-agent", json has one object per line
+    //!
+    inline void AccessLog::m_format_line(QByteArray &line, Context &ctx)
+    {
+        auto &request = ctx.request;
+        auto &response = ctx.response;
+
+        qint64 bytes = response.rawBody().size();
+        for (const auto &segment : response.segments())
+            bytes += segment.size();
+
+        qint64 msecs = QDateTime::currentMSecsSinceEpoch();
+
+        if (m_format == Json)
+        {
+            Recurse::JsonWriter json(line);
+
+            json.beginObject();
+            json.key("time").raw(m_time(Json, msecs));
+            json.key("ip").value(request.ip.toString());
+            json.key("method").value(request.method);
+            json.key("url").value(request.url.toString(QUrl::FullyEncoded));
+            json.key("protocol").value(request.protocol);
+            json.key("status").value(int(response.status()));
+            json.key("bytes").value(bytes);
+
+            if (ctx.started)
+                json.key("duration_ms").value(double(Recurse::Metrics::now() - ctx.started) / 1e6);
+
+            json.key("referer").value(request.getHeader("referer").trimmed());
+            json.key("user_agent").value(request.getHeader("user-agent").trimmed());
+            json.endObject();
+            json.flush();
+
+            line += '\n';
+            return;
+        }
+
+        line += request.ip.toString().toLatin1();
+        line += " - - [";
+        line += m_time(Common, msecs);
+        line += "] \"";
+        line += request.method.toLatin1();
+        line += ' ';
+        line += request.url.toEncoded();
+        line += ' ';
+        line += request.protocol.toLatin1();
+        line += "\" ";
+        line += QByteArray::number(response.status());
+        line += ' ';
+
+        if (bytes)
+            line += QByteArray::number(bytes);
+        else
+            line += '-';
+
+        if (m_format == Combined)
+        {
+            line += ' ';
+            m_quoted(line, request.getHeader("referer").trimmed());
+            line += ' ';
+            m_quoted(line, request.getHeader("user-agent").trimmed());
+        }
+
+        line += '\n';
+    }
+
+    //!
+    //! \brief AccessLog::m_push
+    //! copy line into ring, called by owning thread only
+    //!
+    inline bool AccessLog::m_push(Ring &ring, const QByteArray &line)
+    {
+        quint32 size = quint32(line.size());
+
+        quint64 head = ring.head.load();
+        quint64 tail = ring.tail.loadAcquire();
+
+        if (ring.capacity - (head - tail) < sizeof(size) + size)
+            return false;
+
+        const char *parts[2] = { reinterpret_cast<const char *>(&size), line.constData() };
+        quint64 sizes[2] = { sizeof(size), size };
+        quint64 mask = ring.capacity - 1;
+
+        for (int i = 0; i < 2; ++i)
+        {
+            quint64 offset = head & mask;
+            quint64 first = qMin(sizes[i], ring.capacity - offset);
+
+            std::memcpy(ring.data.get() + offset, parts[i], first);
+            std::memcpy(ring.data.get(), parts[i] + first, sizes[i] - first);
+
+            head += sizes[i];
+        }
+
+        ring.head.storeRelease(head);
+
+        return true;
+    }
+
+    //!
+    //! \brief AccessLog::m_collect
+    //! move all lines from ring into batch, called by writer thread only
+    //!
+    inline void AccessLog::m_collect(Ring &ring, QByteArray &batch)
+    {
+        quint64 head = ring.head.loadAcquire();
+        quint64 tail = ring.tail.load();
+        quint64 mask = ring.capacity - 1;
+
+        auto read = [&](char *out, quint64 size)
+        {
+            quint64 offset = tail & mask;
+            quint64 first = qMin(size, ring.capacity - offset);
+
+            std::memcpy(out, ring.data.get() + offset, first);
+            std::memcpy(out + first, ring.data.get(), size - first);
+
+            tail += size;
+        };
+
+        while (tail < head)
+        {
+            quint32 size;
+            read(reinterpret_cast<char *>(&size), sizeof(size));
+
+            int start = batch.size();
+            batch.resize(start + int(size));
+            read(batch.data() + start, size);
+
+            m_written.fetchAndAddRelaxed(1);
+        }
+
+        ring.tail.storeRelease(tail);
+    }
+
+    //!
+    //! \brief AccessLog::m_run
+    //! writer thread, collects rings every flush interval
+    //!
+    inline void AccessLog::m_run()
+    {
+        QByteArray batch;
+        batch.reserve(256 * 1024);
+
+        QMutexLocker lock(&m_mutex);
+
+        while (true)
+        {
+            bool stop = m_stop;
+
+            if (!stop)
+                m_wake.wait(&m_mutex, ulong(m_flush_interval));
+
+            stop = m_stop;
+
+            // rings are only added, they are collected while request threads keep writing
+            for (const auto &ring : m_rings)
+                m_collect(*ring, batch);
+
+            lock.unlock();
+
+            if (!batch.isEmpty())
+            {
+                m_write(batch);
+                batch.resize(0);
+            }
+
+            lock.relock();
+
+            if (stop)
+                break;
+        }
+
+        m_file.close();
+    }
+
+    //!
+    //! \brief AccessLog::m_write
+    //! write batch with single call, rotate file if it grew over max_size
+    //!
+    inline void AccessLog::m_write(const QByteArray &batch)
+    {
+        if (m_reopen.fetchAndStoreAcquire(0))
+            m_file.close();
+
+        if (!m_file.isOpen() && !m_open())
+            return;
+
+        qint64 written = m_file.write(batch);
+        m_file.flush();
+
+        if (written > 0)
+            m_size += written;
+
+        if (m_max_size > 0 && m_size >= m_max_size && m_path != "-")
+            m_rotate();
+    }
+
+    inline bool AccessLog::m_open()
+    {
+        if (m_path == "-")
+            return m_file.open(stdout, QIODevice::WriteOnly);
+
+        m_file.setFileName(m_path);
+
+        if (!m_file.open(QIODevice::WriteOnly | QIODevice::Append))
+            return false;
+
+        m_size = m_file.size();
+
+        return true;
+    }
+
+    //!
+    //! \brief AccessLog::m_rotate
+    //! path -> path.1 -> path.2 ... oldest one is removed, new file is opened on next write
+    //!
+    inline void AccessLog::m_rotate()
+    {
+        m_file.close();
+
+        if (!m_keep)
+        {
+            QFile::remove(m_path);
+            return;
+        }
+
+        QFile::remove(m_path + "." + QString::number(m_keep));
+
+        for (int i = m_keep - 1; i >= 1; --i)
+            QFile::rename(m_path + "." + QString::number(i), m_path + "." + QString::number(i + 1));
+
+        QFile::rename(m_path, m_path + ".1");
+    }
+
+    //!
+    //! \brief AccessLog::m_quoted
+    //! quoted header value, quotes and backslashes are escaped
+    //!
+    inline void AccessLog::m_quoted(QByteArray &line, const QString &value)
+    {
+        if (value.isEmpty())
+        {
+            line += "\"-\"";
+            return;
+        }
+
+        line += '"';
+
+        for (char c : value.toUtf8())
+        {
+            if (c == '"' || c == '\\')
+                line += '\\';
+
+            line += c;
+        }
+
+        line += '"';
+    }
+
+    //!
+    //! \brief AccessLog::m_time
+    //! timestamp of current second, formatted once per second and thread
+    //!
+    //! \return QByteArray "10/Oct/2000:13:55:36 +0000" or "\"2000-10-10T13:55:36Z\"" for JSON
+    //!
+    inline const QByteArray &AccessLog::m_time(Format format, qint64 msecs)
+    {
+        thread_local qint64 cached_second[2] = { -1, -1 };
+        thread_local QByteArray cached[2];
+
+        int index = format == Json ? 1 : 0;
+        qint64 second = msecs / 1000;
+
+        if (cached_second[index] == second)
+            return cached[index];
+
+        static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+            "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+        QDateTime time = QDateTime::fromMSecsSinceEpoch(second * 1000, Qt::UTC);
+        QDate date = time.date();
+        QTime clock = time.time();
+
+        char buffer[64];
+
+        if (index)
+            std::snprintf(buffer, sizeof(buffer), "\"%04d-%02d-%02dT%02d:%02d:%02dZ\"", date.year(),
+                date.month(), date.day(), clock.hour(), clock.minute(), clock.second());
+        else
+            std::snprintf(buffer, sizeof(buffer), "%02d/%s/%04d:%02d:%02d:%02d +0000", date.day(),
+                months[date.month() - 1], date.year(), clock.hour(), clock.minute(), clock.second());
+
+        cached_second[index] = second;
+        cached[index] = QByteArray(buffer);
+
+        return cached[index];
+    }
+}
+
+#endif
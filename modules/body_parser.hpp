@@ -0,0 +1,650 @@
+#ifndef RECURSE_MODULE_BODY_PARSER_HPP
+#define RECURSE_MODULE_BODY_PARSER_HPP
+
+#include <QDir>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonParseError>
+#include <QPointer>
+#include <QStringList>
+#include <QTemporaryFile>
+#include <QVarLengthArray>
+#include <cstring>
+
+#include "../recurse.hpp"
+
+namespace Module
+{
+
+    //!
+    //! \brief The BodyParser class
+    //! Fills ctx.request.body_parsed according to request Content-Type
+    //!
+    //! application/x-www-form-urlencoded and JSON bodies are parsed from raw body bytes on first
+    //! use only, so requests that never reach the middleware (or parse()) pay nothing.
+    //! multipart/form-data is parsed as it is received: fields are collected, file parts are
+    //! written straight to temporary files in "upload_dir" and body_parsed holds hash with
+    //! "filename", "type", "path" and "size" for them. Temporary files are removed once request
+    //! is done, move them (QFile::rename) to keep them.
+    //!
+    //! Repeated keys are collected into QStringList, repeated file fields (eg: <input multiple>)
+    //! into QVariantList of file hashes. JSON objects are merged into body_parsed,
+    //! other JSON documents are stored under "json" key.
+    //!
+    //! Malformed body is answered with 400 Bad Request, too large with 413.
+    //!
+    //!     Module::BodyParser parser(&app, {{ "max_file_size", 100 * 1024 * 1024 }});
+    //!     app.use(parser.middleware());
+    //!
+    //!     app.use([](auto &ctx)
+    //!     {
+    //!         ctx.response.send(ctx.request.body_parsed["name"].toString());
+    //!     });
+    //!
+    class BodyParser
+    {
+    public:
+        BodyParser(Recurse::Application *app, const QHash<QString, QVariant> &options = QHash<QString, QVariant>());
+
+        Recurse::Downstream middleware();
+        bool parse(Context &ctx);
+
+        static void parseUrlEncoded(const QByteArray &data, QHash<QString, QVariant> &out);
+
+    private:
+        //!
+        //! \brief The Multipart struct
+        //! streaming multipart/form-data parser state
+        //!
+        struct Multipart
+        {
+            enum State
+            {
+                Preamble,
+                Boundary,
+                Headers,
+                Data,
+                Done
+            };
+
+            State state = Preamble;
+
+            //! "\r\n--boundary", first boundary is matched thanks to "\r\n" buffer starts with
+            QByteArray delimiter;
+            QByteArray buffer = "\r\n";
+
+            QString name;
+            QString filename;
+            QString type;
+            QByteArray field;
+            QPointer<QTemporaryFile> file;
+            qint64 size = 0;
+        };
+
+        QString m_upload_dir;
+        qint64 m_max_file_size;
+        qint64 m_max_field_size;
+
+        void m_start_multipart(Context &ctx);
+        void m_feed(Context &ctx, Multipart &multipart, const QByteArray &chunk);
+        bool m_part_begin(Context &ctx, Multipart &multipart, const QByteArray &headers);
+        bool m_part_data(Multipart &multipart, const char *data, int size);
+        void m_part_end(Context &ctx, Multipart &multipart);
+        void m_fail(Context &ctx, Multipart &multipart, quint16 status);
+
+        static QString m_type(Context &ctx);
+        static QByteArray m_boundary(Context &ctx);
+        static QString m_decode(const char *data, int size);
+        static void m_insert(QHash<QString, QVariant> &out, const QString &key, const QVariant &value);
+    };
+
+    //!
+    //! \brief BodyParser::BodyParser
+    //!
+    //! \param app application to receive multipart bodies from as they arrive
+    //! \param options QHash options of <QString, QVariant>
+    //!     "upload_dir" directory for uploaded files, system temporary directory by default
+    //!     "max_file_size" maximum size of single uploaded file in bytes, 0 for unlimited (default)
+    //!     "max_field_size" maximum size of single non-file field in bytes, 1MB by default
+    //!
+    inline BodyParser::BodyParser(Recurse::Application *app, const QHash<QString, QVariant> &options)
+    {
+        m_upload_dir = options.value("upload_dir", QDir::tempPath()).toString();
+        m_max_file_size = options.value("max_file_size", 0).toLongLong();
+        m_max_field_size = options.value("max_field_size", 1024 * 1024).toLongLong();
+
+        app->onHeaders([this](Context &ctx)
+        {
+            if (m_type(ctx) == "multipart/form-data")
+                m_start_multipart(ctx);
+        });
+    }
+
+    //!
+    //! \brief BodyParser::middleware
+    //! parse body before next middleware, malformed or too large body ends the request
+    //!
+    inline Recurse::Downstream BodyParser::middleware()
+    {
+        return [this](Context &ctx, Recurse::Next next)
+        {
+            if (!parse(ctx))
+            {
+                quint16 status = static_cast<quint16>(ctx.get("body_parser.error").toUInt());
+                ctx.response.status(status).send(ctx.response.http_codes.value(status));
+                return;
+            }
+
+            next();
+        };
+    }
+
+    //!
+    //! \brief BodyParser::parse
+    //! fill body_parsed if it was not filled yet, can be called from any middleware
+    //! instead of mounting middleware() for all routes
+    //!
+    //! \param ctx request context
+    //! \return false if body is malformed or too large, error status is in ctx "body_parser.error"
+    //!
+    inline bool BodyParser::parse(Context &ctx)
+    {
+        if (ctx.get("body_parser.error").toUInt())
+            return false;
+
+        if (ctx.get("body_parser.parsed").toBool())
+            return true;
+
+        ctx.set("body_parser.parsed", true);
+
+        auto &request = ctx.request;
+
+        if (request.raw_body.isEmpty())
+            return true;
+
+        QString type = m_type(ctx);
+
+        if (type == "application/x-www-form-urlencoded")
+        {
+            parseUrlEncoded(request.raw_body, request.body_parsed);
+        }
+        else if (type == "application/json" || type.endsWith("+json"))
+        {
+            QJsonParseError error;
+            QJsonDocument document = QJsonDocument::fromJson(request.raw_body, &error);
+
+            if (error.error != QJsonParseError::NoError)
+            {
+                ctx.set("body_parser.error", 400);
+                return false;
+            }
+
+            if (document.isObject())
+            {
+                const QJsonObject object = document.object();
+
+                for (auto i = object.constBegin(); i != object.constEnd(); ++i)
+                    request.body_parsed[i.key()] = i.value().toVariant();
+            }
+            else
+            {
+                request.body_parsed["json"] = document.toVariant();
+            }
+        }
+        else if (type == "multipart/form-data")
+        {
+            // body was buffered (request arrived before parser was set up), parse it in one go
+            Multipart multipart;
+            QByteArray boundary = m_boundary(ctx);
+
+            if (boundary.isEmpty())
+            {
+                ctx.set("body_parser.error", 400);
+                return false;
+            }
+
+            multipart.delimiter = "\r\n--" + boundary;
+
+            m_feed(ctx, multipart, request.raw_body);
+            m_feed(ctx, multipart, QByteArray());
+        }
+
+        return !ctx.get("body_parser.error").toUInt();
+    }
+
+    //!
+    //! \brief BodyParser::parseUrlEncoded
+    //! decode urlencoded data, keys and values are decoded straight from slices of data
+    //!
+    //! \param data urlencoded bytes, eg: "name=johnny&tags=a&tags=b"
+    //! \param out hash to insert decoded pairs into
+    //!
+    inline void BodyParser::parseUrlEncoded(const QByteArray &data, QHash<QString, QVariant> &out)
+    {
+        const char *p = data.constData();
+        const char *end = p + data.size();
+
+        while (p < end)
+        {
+            auto amp = static_cast<const char *>(std::memchr(p, '&', end - p));
+            if (!amp)
+                amp = end;
+
+            auto eq = static_cast<const char *>(std::memchr(p, '=', amp - p));
+            const char *key_end = eq ? eq : amp;
+
+            if (key_end > p)
+            {
+                QString value = eq ? m_decode(eq + 1, int(amp - eq - 1)) : QString("");
+                m_insert(out, m_decode(p, int(key_end - p)), value);
+            }
+
+            p = amp + 1;
+        }
+    }
+
+    //!
+    //! \brief BodyParser::m_start_multipart
+    //! called once headers are parsed, body is handed over to multipart parser as it arrives
+    //!
+    inline void BodyParser::m_start_multipart(Context &ctx)
+    {
+        QByteArray boundary = m_boundary(ctx);
+
+        if (boundary.isEmpty())
+        {
+            ctx.set("body_parser.error", 400);
+            return;
+        }
+
+        ctx.set("body_parser.parsed", true);
+
+        auto multipart = QSharedPointer<Multipart>::create();
+        multipart->delimiter = "\r\n--" + boundary;
+
+        ctx.request.body_reader = [this, &ctx, multipart](const QByteArray &chunk)
+        {
+            m_feed(ctx, *multipart, chunk);
+        };
+    }
+
+    //!
+    //! \brief BodyParser::m_feed
+    //! advance multipart parser with next chunk of body, empty chunk marks end of body
+    //!
+    inline void BodyParser::m_feed(Context &ctx, Multipart &multipart, const QByteArray &chunk)
+    {
+        if (multipart.state == Multipart::Done)
+            return;
+
+        if (chunk.isEmpty())
+        {
+            m_fail(ctx, multipart, 400);
+            return;
+        }
+
+        multipart.buffer += chunk;
+        auto &buffer = multipart.buffer;
+        const auto &delimiter = multipart.delimiter;
+
+        while (true)
+        {
+            switch (multipart.state)
+            {
+                case Multipart::Preamble:
+                {
+                    int index = buffer.indexOf(delimiter);
+
+                    if (index == -1)
+                    {
+                        // keep possible beginning of delimiter
+                        buffer.remove(0, qMax(0, buffer.size() - delimiter.size() + 1));
+                        return;
+                    }
+
+                    buffer.remove(0, index + delimiter.size());
+                    multipart.state = Multipart::Boundary;
+                    break;
+                }
+                case Multipart::Boundary:
+                {
+                    if (buffer.size() < 2)
+                        return;
+
+                    if (buffer.startsWith("--"))
+                    {
+                        multipart.state = Multipart::Done;
+                        buffer.clear();
+                        return;
+                    }
+
+                    if (!buffer.startsWith("\r\n"))
+                    {
+                        m_fail(ctx, multipart, 400);
+                        return;
+                    }
+
+                    buffer.remove(0, 2);
+                    multipart.state = Multipart::Headers;
+                    break;
+                }
+                case Multipart::Headers:
+                {
+                    int index = buffer.indexOf("\r\n\r\n");
+
+                    if (index == -1)
+                    {
+                        if (buffer.size() > 16 * 1024)
+                            m_fail(ctx, multipart, 400);
+
+                        return;
+                    }
+
+                    if (!m_part_begin(ctx, multipart, buffer.left(index)))
+                        return;
+
+                    buffer.remove(0, index + 4);
+                    multipart.state = Multipart::Data;
+                    break;
+                }
+                case Multipart::Data:
+                {
+                    int index = buffer.indexOf(delimiter);
+
+                    if (index == -1)
+                    {
+                        // everything but possible beginning of delimiter is part data
+                        int safe = buffer.size() - delimiter.size() + 1;
+
+                        if (safe > 0)
+                        {
+                            if (!m_part_data(multipart, buffer.constData(), safe))
+                            {
+                                m_fail(ctx, multipart, 413);
+                                return;
+                            }
+
+                            buffer.remove(0, safe);
+                        }
+
+                        return;
+                    }
+
+                    if (!m_part_data(multipart, buffer.constData(), index))
+                    {
+                        m_fail(ctx, multipart, 413);
+                        return;
+                    }
+
+                    m_part_end(ctx, multipart);
+
+                    buffer.remove(0, index + delimiter.size());
+                    multipart.state = Multipart::Boundary;
+                    break;
+                }
+                case Multipart::Done:
+                    return;
+            }
+        }
+    }
+
+    //!
+    //! \brief BodyParser::m_part_begin
+    //! parse part headers, open temporary file for file parts
+    //!
+    inline bool BodyParser::m_part_begin(Context &ctx, Multipart &multipart, const QByteArray &headers)
+    {
+        multipart.name.clear();
+        multipart.filename.clear();
+        multipart.type.clear();
+        multipart.field.clear();
+        multipart.size = 0;
+
+        for (const auto &line : headers.split('\n'))
+        {
+            int colon = line.indexOf(':');
+            if (colon == -1)
+                continue;
+
+            QString key = QString::fromUtf8(line.left(colon)).trimmed().toLower();
+            QString value = QString::fromUtf8(line.mid(colon + 1)).trimmed();
+
+            if (key == "content-type")
+            {
+                multipart.type = value;
+                continue;
+            }
+
+            if (key != "content-disposition")
+                continue;
+
+            // eg: form-data; name="avatar"; filename="me.png"
+            for (const auto &param : value.split(";"))
+            {
+                int eq = param.indexOf("=");
+                if (eq == -1)
+                    continue;
+
+                QString name = param.left(eq).trimmed().toLower();
+                QString content = param.mid(eq + 1).trimmed();
+
+                if (content.size() >= 2 && content.startsWith('"') && content.endsWith('"'))
+                    content = content.mid(1, content.size() - 2);
+
+                if (name == "name")
+                    multipart.name = content;
+                else if (name == "filename")
+                    multipart.filename = content;
+            }
+        }
+
+        if (multipart.name.isEmpty())
+        {
+            m_fail(ctx, multipart, 400);
+            return false;
+        }
+
+        if (multipart.filename.isNull())
+            return true;
+
+        // removed together with the request, unless moved by application
+        multipart.file = new QTemporaryFile(m_upload_dir + "/recurse_upload_XXXXXX", ctx.scope());
+
+        if (!multipart.file->open())
+        {
+            m_fail(ctx, multipart, 500);
+            return false;
+        }
+
+        return true;
+    }
+
+    //!
+    //! \brief BodyParser::m_part_data
+    //! \return false if part exceeded its size limit
+    //!
+    inline bool BodyParser::m_part_data(Multipart &multipart, const char *data, int size)
+    {
+        if (size <= 0)
+            return true;
+
+        multipart.size += size;
+
+        if (!multipart.filename.isNull())
+        {
+            if (m_max_file_size > 0 && multipart.size > m_max_file_size)
+                return false;
+
+            return multipart.file && multipart.file->write(data, size) == size;
+        }
+
+        if (multipart.size > m_max_field_size)
+            return false;
+
+        multipart.field.append(data, size);
+        return true;
+    }
+
+    //!
+    //! \brief BodyParser::m_part_end
+    //! store completed part into body_parsed
+    //!
+    inline void BodyParser::m_part_end(Context &ctx, Multipart &multipart)
+    {
+        auto &parsed = ctx.request.body_parsed;
+
+        if (multipart.filename.isNull())
+        {
+            m_insert(parsed, multipart.name, QString::fromUtf8(multipart.field));
+            multipart.field.clear();
+            return;
+        }
+
+        if (!multipart.file)
+            return;
+
+        multipart.file->close();
+
+        QHash<QString, QVariant> file;
+        file["filename"] = multipart.filename;
+        file["type"] = multipart.type;
+        file["path"] = multipart.file->fileName();
+        file["size"] = multipart.size;
+
+        m_insert(parsed, multipart.name, file);
+        multipart.file.clear();
+    }
+
+    //!
+    //! \brief BodyParser::m_fail
+    //! stop parsing, remaining body is ignored and files uploaded so far are removed
+    //!
+    inline void BodyParser::m_fail(Context &ctx, Multipart &multipart, quint16 status)
+    {
+        multipart.state = Multipart::Done;
+        multipart.buffer.clear();
+        multipart.field.clear();
+
+        ctx.set("body_parser.error", status);
+
+        for (auto file : ctx.scope()->findChildren<QTemporaryFile *>(QString(), Qt::FindDirectChildrenOnly))
+            delete file;
+    }
+
+    //!
+    //! \brief BodyParser::m_type
+    //! \return lowercase media type without parameters
+    //!
+    inline QString BodyParser::m_type(Context &ctx)
+    {
+        QString type = ctx.request.getHeader("content-type");
+
+        int semicolon = type.indexOf(';');
+        if (semicolon != -1)
+            type.truncate(semicolon);
+
+        return type.trimmed().toLower();
+    }
+
+    //!
+    //! \brief BodyParser::m_boundary
+    //! \return multipart boundary from Content-Type parameters
+    //!
+    inline QByteArray BodyParser::m_boundary(Context &ctx)
+    {
+        for (const auto &param : ctx.request.getHeader("content-type").split(";"))
+        {
+            QString trimmed = param.trimmed();
+
+            if (trimmed.startsWith("boundary=", Qt::CaseInsensitive))
+                return trimmed.mid(9).remove('"').toUtf8();
+        }
+
+        return QByteArray();
+    }
+
+    //!
+    //! \brief BodyParser::m_decode
+    //! percent-decode urlencoded slice, "+" stands for space
+    //!
+    inline QString BodyParser::m_decode(const char *data, int size)
+    {
+        int i = 0;
+        while (i < size && data[i] != '%' && data[i] != '+')
+            ++i;
+
+        if (i == size)
+            return QString::fromUtf8(data, size);
+
+        auto hex = [](char c) -> int
+        {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+            return -1;
+        };
+
+        QVarLengthArray<char, 256> decoded;
+        decoded.append(data, i);
+
+        for (; i < size; ++i)
+        {
+            char c = data[i];
+
+            if (c == '+')
+            {
+                decoded.append(' ');
+            }
+            else if (c == '%' && i + 2 < size && hex(data[i + 1]) >= 0 && hex(data[i + 2]) >= 0)
+            {
+                decoded.append(char(hex(data[i + 1]) * 16 + hex(data[i + 2])));
+                i += 2;
+            }
+            else
+            {
+                decoded.append(c);
+            }
+        }
+
+        return QString::fromUtf8(decoded.constData(), decoded.size());
+    }
+
+    //!
+    //! \brief BodyParser::m_insert
+    //! insert value, repeated keys are collected into QStringList, repeated files into
+    //! QVariantList
+    //!
+    inline void BodyParser::m_insert(QHash<QString, QVariant> &out, const QString &key, const QVariant &value)
+    {
+        auto it = out.find(key);
+
+        if (it == out.end())
+        {
+            out.insert(key, value);
+            return;
+        }
+
+        if (value.type() == QVariant::Hash)
+        {
+            QVariantList files = it->toList();
+            if (it->type() != QVariant::List)
+                files = QVariantList{ *it };
+
+            files.append(value);
+            *it = files;
+            return;
+        }
+
+        QStringList list = it->toStringList();
+        if (it->type() != QVariant::StringList)
+            list = QStringList{ it->toString() };
+
+        list.append(value.toString());
+        *it = list;
+    }
+}
+
+#endif
@@ -0,0 +1,445 @@
+#ifndef RECURSE_MODULE_CACHE_HPP
+#define RECURSE_MODULE_CACHE_HPP
+
+#include <QDeadlineTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRegExp>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QTimer>
+#include <QVector>
+#include <list>
+
+#include "../recurse.hpp"
+
+namespace Module
+{
+
+    //!
+    //! \brief The Cache class
+    //! In-memory response cache middleware
+    //!
+    //! Responses are captured on the way upstream and stored in a sharded, memory bounded LRU
+    //! keyed by method, url and request headers listed in response "Vary" header.
+    //! Hits are served without calling next, stale entries are served while being refreshed
+    //! in the background through Application::dispatch (stale-while-revalidate)
+    //!
+    //! Example:
+    //!
+    //!     Module::Cache cache(&app, {{ "ttl", 10 }, { "max_size", 32 * 1024 * 1024 }});
+    //!     cache.route(QRegExp("^/reports/"), 300, 60);
+    //!     app.use(cache.middleware());
+    //!
+    class Cache
+    {
+    public:
+        Cache(Recurse::Application *app, const QHash<QString, QVariant> &options = QHash<QString, QVariant>());
+
+        Cache &route(const QRegExp &path, qint64 ttl, qint64 stale = 0);
+        Recurse::DownstreamUpstream middleware();
+        void clear();
+
+    private:
+        //!
+        //! \brief The Rule struct
+        //! per-route freshness, in milliseconds
+        //!
+        struct Rule
+        {
+            QRegExp path;
+            qint64 ttl;
+            qint64 stale;
+        };
+
+        //!
+        //! \brief The Entry struct
+        //! cached response and its bookkeeping data
+        //!
+        struct Entry
+        {
+            quint16 status;
+            QHash<QString, QString> headers;
+            QByteArray body;
+            QString primary;
+            qint64 stored;
+            qint64 expires;
+            qint64 stale_until;
+            qint64 cost;
+            bool revalidating;
+            std::list<QString>::iterator lru;
+        };
+
+        //!
+        //! \brief The Shard struct
+        //! independently locked part of the cache, front of lru list is most recently used
+        //!
+        struct Shard
+        {
+            QMutex mutex;
+            QHash<QString, Entry> entries;
+            QHash<QString, QStringList> vary;
+            QHash<QString, int> variants;
+            std::list<QString> lru;
+            qint64 size = 0;
+        };
+
+        Recurse::Application *m_app;
+        QVector<QSharedPointer<Shard>> m_shards;
+        QVector<Rule> m_rules;
+        qint64 m_shard_size;
+        qint64 m_revalidate_timeout;
+        Rule m_default;
+
+        const Rule &m_rule(const QString &path) const;
+        Shard &m_shard(const QString &primary);
+        void m_store(Context &ctx, const QString &primary, const Rule &rule, const QHash<QString, QString> &before);
+        void m_revalidate(const Request &request, const QString &primary, const QString &key);
+        void m_evict(Shard &shard, QHash<QString, Entry>::iterator it);
+
+        static qint64 m_now();
+        static QString m_key(Request &request, const QString &primary, const QStringList &vary);
+    };
+
+    //!
+    //! \brief Cache::Cache
+    //!
+    //! \param app application used for background revalidation
+    //! \param options QHash options of <QString, QVariant>
+    //!     "ttl" default freshness in seconds for routes without rule, 0 disables caching (default)
+    //!     "stale" default stale-while-revalidate window in seconds, 0 by default
+    //!     "max_size" memory limit in bytes, 64MB by default
+    //!     "shards" number of independently locked shards, 16 by default
+    //!     "revalidate_timeout" seconds after which background refresh is given up and cancelled,
+    //!         next hit of stale entry tries again, 30 by default
+    //!
+    inline Cache::Cache(Recurse::Application *app, const QHash<QString, QVariant> &options)
+        : m_app(app)
+    {
+        int shards = qMax(1, options.value("shards", 16).toInt());
+        qint64 max_size = options.value("max_size", 64 * 1024 * 1024).toLongLong();
+
+        for (int i = 0; i < shards; ++i)
+            m_shards.push_back(QSharedPointer<Shard>(new Shard));
+
+        m_shard_size = max_size / shards;
+
+        m_revalidate_timeout = options.value("revalidate_timeout", 30).toLongLong() * 1000;
+
+        m_default.ttl = options.value("ttl", 0).toLongLong() * 1000;
+        m_default.stale = options.value("stale", 0).toLongLong() * 1000;
+    }
+
+    //!
+    //! \brief Cache::route
+    //! Set freshness for requests with matching url path, first matching rule wins
+    //!
+    //! \param path regular expression matched against url path, eg: "^/api/"
+    //! \param ttl freshness in seconds, 0 disables caching for the route
+    //! \param stale seconds after ttl during which stale response is served while refreshing
+    //! \return Cache chainable
+    //!
+    inline Cache &Cache::route(const QRegExp &path, qint64 ttl, qint64 stale)
+    {
+        m_rules.push_back({ path, ttl * 1000, stale * 1000 });
+        return *this;
+    }
+
+    //!
+    //! \brief Cache::clear
+    //! Drop all cached responses
+    //!
+    inline void Cache::clear()
+    {
+        for (auto &shard : m_shards)
+        {
+            QMutexLocker locker(&shard->mutex);
+
+            shard->entries.clear();
+            shard->vary.clear();
+            shard->variants.clear();
+            shard->lru.clear();
+            shard->size = 0;
+        }
+    }
+
+    //!
+    //! \brief Cache::middleware
+    //! Middleware to be passed to Application::use
+    //!
+    //! \return DownstreamUpstream middleware
+    //!
+    inline Recurse::DownstreamUpstream Cache::middleware()
+    {
+        return [this](Context &ctx, Recurse::NextPrev next, Recurse::Prev prev)
+        {
+            auto &request = ctx.request;
+
+            if (request.method != "GET" && request.method != "HEAD")
+            {
+                next(prev);
+                return;
+            }
+
+            const Rule &rule = m_rule(request.url.path());
+
+            if (rule.ttl <= 0)
+            {
+                next(prev);
+                return;
+            }
+
+            QString primary = request.method % " " % request.url.toString();
+            auto before = ctx.response.getHeaders();
+
+            // background refresh, always run the chain and store the result
+            if (ctx.get("cache.revalidate").toBool())
+            {
+                next([this, &ctx, prev, primary, rule, before]
+                {
+                    m_store(ctx, primary, rule, before);
+                    prev();
+                });
+                return;
+            }
+
+            Entry entry;
+            bool hit = false;
+            bool refresh = false;
+            QString key;
+            qint64 now = m_now();
+
+            {
+                Shard &shard = m_shard(primary);
+                QMutexLocker locker(&shard.mutex);
+
+                key = m_key(request, primary, shard.vary.value(primary));
+                auto it = shard.entries.find(key);
+
+                if (it != shard.entries.end() && now < it->stale_until)
+                {
+                    shard.lru.splice(shard.lru.begin(), shard.lru, it->lru);
+
+                    if (now >= it->expires && !it->revalidating)
+                    {
+                        it->revalidating = true;
+                        refresh = true;
+                    }
+
+                    entry = *it;
+                    hit = true;
+                }
+            }
+
+            if (!hit)
+            {
+                next([this, &ctx, prev, primary, rule, before]
+                {
+                    m_store(ctx, primary, rule, before);
+                    prev();
+                });
+                return;
+            }
+
+            if (refresh)
+                m_revalidate(request, primary, key);
+
+            auto &response = ctx.response;
+            response.status(entry.status);
+
+            for (auto i = entry.headers.constBegin(); i != entry.headers.constEnd(); ++i)
+                response.setHeader(i.key(), i.value());
+
+            response.setHeader("age", QString::number((now - entry.stored) / 1000));
+            response.rawBody(entry.body);
+            response.send();
+        };
+    }
+
+    //!
+    //! \brief Cache::m_rule
+    //! find freshness rule for url path
+    //!
+    inline const Cache::Rule &Cache::m_rule(const QString &path) const
+    {
+        for (const auto &rule : m_rules)
+        {
+            if (rule.path.indexIn(path) != -1)
+                return rule;
+        }
+
+        return m_default;
+    }
+
+    inline Cache::Shard &Cache::m_shard(const QString &primary)
+    {
+        return *m_shards[qHash(primary) % m_shards.size()];
+    }
+
+    //!
+    //! \brief Cache::m_store
+    //! capture response on the way upstream, only headers added downstream of this middleware
+    //! are stored so that headers set by previous middlewares are not replayed on hits
+    //!
+    //! responses setting cookies are never stored, responses to requests with credentials
+    //! only when marked "public" or "s-maxage"
+    //!
+    inline void Cache::m_store(Context &ctx, const QString &primary, const Rule &rule, const QHash<QString, QString> &before)
+    {
+        auto &response = ctx.response;
+        auto all_headers = response.getHeaders();
+
+        // segments (files, large buffers) are not kept in memory cache
+        if (response.status() != 200 || !response.segments().isEmpty())
+            return;
+
+        QString cache_control = all_headers.value("cache-control").toLower();
+
+        if (cache_control.contains("no-store") || cache_control.contains("private"))
+            return;
+
+        if (all_headers.contains("set-cookie"))
+            return;
+
+        bool shared = cache_control.contains("public") || cache_control.contains("s-maxage");
+
+        if (!shared && !ctx.request.getHeader("authorization").isEmpty())
+            return;
+
+        QStringList vary;
+
+        for (const auto &name : all_headers.value("vary").split(",", QString::SkipEmptyParts))
+            vary << name.trimmed().toLower();
+
+        if (vary.contains("*"))
+            return;
+
+        vary.sort();
+
+        Entry entry;
+        entry.status = response.status();
+        entry.body = response.rawBody();
+        entry.primary = primary;
+        entry.stored = m_now();
+        entry.expires = entry.stored + rule.ttl;
+        entry.stale_until = entry.expires + rule.stale;
+        entry.revalidating = false;
+        entry.cost = 128 + primary.size() * 2 + entry.body.size();
+
+        for (auto i = all_headers.constBegin(); i != all_headers.constEnd(); ++i)
+        {
+            if (before.contains(i.key()) && before.value(i.key()) == i.value())
+                continue;
+
+            entry.headers[i.key()] = i.value();
+            entry.cost += (i.key().size() + i.value().size()) * 2 + 32;
+        }
+
+        QString key = m_key(ctx.request, primary, vary);
+        entry.cost += key.size() * 2;
+
+        Shard &shard = m_shard(primary);
+
+        if (entry.cost > m_shard_size)
+            return;
+
+        QMutexLocker locker(&shard.mutex);
+
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end())
+            m_evict(shard, it);
+
+        shard.vary[primary] = vary;
+        ++shard.variants[primary];
+
+        shard.lru.push_front(key);
+        entry.lru = shard.lru.begin();
+        shard.size += entry.cost;
+        shard.entries.insert(key, entry);
+
+        while (shard.size > m_shard_size && !shard.lru.empty())
+            m_evict(shard, shard.entries.find(shard.lru.back()));
+    }
+
+    //!
+    //! \brief Cache::m_evict
+    //! remove entry from shard, vary list of its url is dropped with its last variant and is set
+    //! again on next store
+    //!
+    inline void Cache::m_evict(Shard &shard, QHash<QString, Entry>::iterator it)
+    {
+        shard.size -= it->cost;
+        shard.lru.erase(it->lru);
+
+        auto variants = shard.variants.find(it->primary);
+        if (variants != shard.variants.end() && --*variants <= 0)
+        {
+            shard.variants.erase(variants);
+            shard.vary.remove(it->primary);
+        }
+
+        shard.entries.erase(it);
+    }
+
+    //!
+    //! \brief Cache::m_revalidate
+    //! refresh stale entry in the background by running the chain again as a subrequest.
+    //! Refresh taking longer than "revalidate_timeout" is cancelled through ctx.cancellation,
+    //! subrequest is freed only once its chain finishes, so middlewares should honor it
+    //!
+    inline void Cache::m_revalidate(const Request &request, const QString &primary, const QString &key)
+    {
+        auto ctx = QSharedPointer<Context>(new Context);
+        ctx->request = request;
+        ctx->request.socket = nullptr;
+        ctx->set("cache.revalidate", true);
+
+        // on failed or stuck refresh allow next hit to try again
+        auto release = [this, primary, key]
+        {
+            Shard &shard = m_shard(primary);
+            QMutexLocker locker(&shard.mutex);
+
+            auto it = shard.entries.find(key);
+            if (it != shard.entries.end())
+                it->revalidating = false;
+        };
+
+        if (m_revalidate_timeout > 0)
+        {
+            Cancellation cancellation = ctx->cancellation;
+
+            QTimer::singleShot(int(m_revalidate_timeout), ctx->scope(), [cancellation, release]() mutable
+            {
+                cancellation.cancel();
+                release();
+            });
+        }
+
+        m_app->dispatch(ctx, [release](Context & /* ctx */)
+        {
+            release();
+        });
+    }
+
+    inline qint64 Cache::m_now()
+    {
+        return QDeadlineTimer::current().deadline();
+    }
+
+    //!
+    //! \brief Cache::m_key
+    //! cache key made of method, url and request header values listed in vary
+    //!
+    inline QString Cache::m_key(Request &request, const QString &primary, const QStringList &vary)
+    {
+        QString key = primary;
+
+        for (const auto &name : vary)
+            key += "\n" % name % ":" % request.getHeader(name).trimmed();
+
+        return key;
+    }
+}
+
+#endif
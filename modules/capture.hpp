@@ -0,0 +1,327 @@
+#ifndef RECURSE_MODULE_CAPTURE_HPP
+#define RECURSE_MODULE_CAPTURE_HPP
+
+#include <QDateTime>
+#include <QDebug>
+#include <QFile>
+#include <QStringList>
+#include <QVector>
+#include <QtEndian>
+#include <algorithm>
+
+#include "../recurse.hpp"
+
+namespace Module
+{
+
+    //!
+    //! \brief The Capture class
+    //! Samples raw requests with their arrival times into compact binary file, to be replayed
+    //! against server later (tools/loadgen --replay)
+    //!
+    //! Values of redacted headers are overwritten with 'x' of the same length, so parsing cost
+    //! of replayed request stays the same. Bodies consumed by body_reader are replaced with
+    //! zero bytes of the same length.
+    //!
+    //!     Module::Capture capture({{ "path", "/tmp/traffic.rcap" }, { "sample", 10 }});
+    //!     app.use(capture.middleware());
+    //!
+    //! file starts with "RCAP", version byte and capture start (8 bytes, milliseconds since
+    //! epoch, little-endian), records follow:
+    //!
+    //!     varint zigzag   arrival time in microseconds relative to previous record
+    //!     varint          request length
+    //!     bytes           request head and body
+    //!
+    class Capture
+    {
+    public:
+        struct Record
+        {
+            qint64 time;
+            QByteArray data;
+        };
+
+        Capture(const QHash<QString, QVariant> &options);
+        ~Capture();
+
+        Recurse::Downstream middleware();
+
+        bool record(Context &ctx);
+        quint64 records() const;
+
+        static QVector<Record> load(const QString &path, QString *error = nullptr);
+
+    private:
+        QFile m_file;
+        int m_sample;
+        quint64 m_counter = 0;
+        quint64 m_records = 0;
+        qint64 m_max_size;
+        qint64 m_size = 0;
+        qint64 m_last = 0;
+        QVector<QByteArray> m_redact;
+        QByteArray m_buffer;
+
+        QByteArray m_request(Context &ctx) const;
+        void m_flush();
+
+        static void m_varint(QByteArray &out, quint64 value);
+        static bool m_varint(const QByteArray &in, int &position, quint64 &value);
+    };
+
+    //!
+    //! \brief Capture::Capture
+    //!
+    //! \param options QHash options of <QString, QVariant>
+    //!     "path" capture file, it is truncated
+    //!     "sample" capture every n-th request, 1 by default (every request)
+    //!     "redact" QStringList of headers whose values are hidden,
+    //!         default: authorization, proxy-authorization, cookie
+    //!     "max_size" stop capturing once file has this many bytes, 0 for no limit (default)
+    //!
+    inline Capture::Capture(const QHash<QString, QVariant> &options)
+    {
+        m_sample = qMax(1, options.value("sample", 1).toInt());
+        m_max_size = options.value("max_size", 0).toLongLong();
+
+        QStringList redact = options.value("redact", QStringList{ "authorization", "proxy-authorization", "cookie" }).toStringList();
+
+        for (const auto &header : redact)
+            m_redact.push_back(header.trimmed().toLower().toLatin1());
+
+        m_file.setFileName(options.value("path").toString());
+
+        if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        {
+            qWarning() << "capture: can't open" << m_file.fileName() << m_file.errorString();
+            return;
+        }
+
+        QByteArray header("RCAP\x01", 5);
+        char start[8];
+        qToLittleEndian<qint64>(QDateTime::currentMSecsSinceEpoch(), start);
+        header.append(start, 8);
+
+        m_size = m_file.write(header);
+        m_buffer.reserve(64 * 1024);
+    }
+
+    inline Capture::~Capture()
+    {
+        m_flush();
+    }
+
+    //!
+    //! \brief Capture::middleware
+    //! Middleware to be passed to Application::use, should be used as first middleware
+    //!
+    //! \return Downstream middleware
+    //!
+    inline Recurse::Downstream Capture::middleware()
+    {
+        return [this](Context &ctx, Recurse::Next next)
+        {
+            record(ctx);
+            next();
+        };
+    }
+
+    //!
+    //! \brief Capture::record
+    //! capture request if it's sampled, records are buffered and written in 64KB blocks
+    //!
+    //! \param ctx request context
+    //! \return true if request was captured
+    //!
+    inline bool Capture::record(Context &ctx)
+    {
+        if (!m_file.isOpen() || m_counter++ % m_sample)
+            return false;
+
+        QByteArray request = m_request(ctx);
+
+        if (m_max_size > 0 && m_size + m_buffer.size() + request.size() + 20 > m_max_size)
+        {
+            m_flush();
+            m_file.close();
+            return false;
+        }
+
+        qint64 time = ctx.started ? ctx.started : Recurse::Metrics::now();
+        qint64 delta = m_records ? (time - m_last) / 1000 : 0;
+
+        m_last = m_records ? m_last + delta * 1000 : time;
+
+        m_varint(m_buffer, quint64((delta << 1) ^ (delta >> 63)));
+        m_varint(m_buffer, quint64(request.size()));
+        m_buffer += request;
+
+        ++m_records;
+
+        if (m_buffer.size() >= 64 * 1024)
+            m_flush();
+
+        return true;
+    }
+
+    //!
+    //! \brief Capture::records
+    //! \return number of captured requests
+    //!
+    inline quint64 Capture::records() const
+    {
+        return m_records;
+    }
+
+    //!
+    //! \brief Capture::load
+    //! read capture file
+    //!
+    //! \param path capture file
+    //! \param error optional, set when file is not valid capture
+    //! \return QVector<Record> requests ordered by arrival time, in nanoseconds since first one
+    //!
+    inline QVector<Capture::Record> Capture::load(const QString &path, QString *error)
+    {
+        QVector<Record> records;
+        QFile file(path);
+
+        if (!file.open(QIODevice::ReadOnly))
+        {
+            if (error)
+                *error = file.errorString();
+
+            return records;
+        }
+
+        QByteArray data = file.readAll();
+
+        if (!data.startsWith("RCAP\x01") || data.size() < 13)
+        {
+            if (error)
+                *error = "not a capture file";
+
+            return records;
+        }
+
+        int position = 13;
+        qint64 time = 0;
+
+        while (position < data.size())
+        {
+            quint64 zigzag;
+            quint64 size;
+
+            if (!m_varint(data, position, zigzag) || !m_varint(data, position, size) || size > quint64(data.size() - position))
+            {
+                if (error)
+                    *error = "truncated capture file";
+
+                break;
+            }
+
+            time += qint64(zigzag >> 1) ^ -qint64(zigzag & 1);
+
+            records.push_back({ time * 1000, data.mid(position, int(size)) });
+            position += int(size);
+        }
+
+        // requests are recorded once complete, slow ones can arrive before previous record
+        std::stable_sort(records.begin(), records.end(), [](const Record &a, const Record &b)
+        {
+            return a.time < b.time;
+        });
+
+        if (!records.isEmpty())
+        {
+            qint64 first = records.first().time;
+
+            for (auto &record : records)
+                record.time -= first;
+        }
+
+        return records;
+    }
+
+    //!
+    //! \brief Capture::m_request
+    //! \return request as received, with redacted header values
+    //!
+    inline QByteArray Capture::m_request(Context &ctx) const
+    {
+        auto &request = ctx.request;
+
+        // data holds request line and headers, each ending with CRLF
+        QByteArray head = request.data.toUtf8();
+
+        int line = 0;
+
+        while (line < head.size())
+        {
+            int end = head.indexOf("\r\n", line);
+            if (end == -1)
+                break;
+
+            int colon = head.indexOf(':', line);
+
+            if (colon != -1 && colon < end && m_redact.contains(head.mid(line, colon - line).trimmed().toLower()))
+            {
+                for (int i = colon + 1; i < end; ++i)
+                {
+                    if (head.at(i) != ' ')
+                        head[i] = 'x';
+                }
+            }
+
+            line = end + 2;
+        }
+
+        head += "\r\n";
+
+        // body handed over to body_reader is not kept
+        if (request.raw_body.size() == request.length)
+            return head + request.raw_body;
+
+        return head + QByteArray(int(request.length), '\0');
+    }
+
+    inline void Capture::m_flush()
+    {
+        if (m_buffer.isEmpty() || !m_file.isOpen())
+            return;
+
+        m_size += m_file.write(m_buffer);
+        m_file.flush();
+        m_buffer.resize(0);
+    }
+
+    inline void Capture::m_varint(QByteArray &out, quint64 value)
+    {
+        while (value >= 0x80)
+        {
+            out += char((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+
+        out += char(value);
+    }
+
+    inline bool Capture::m_varint(const QByteArray &in, int &position, quint64 &value)
+    {
+        value = 0;
+
+        for (int shift = 0; shift < 64 && position < in.size(); shift += 7)
+        {
+            quint8 byte = quint8(in.at(position++));
+            value |= quint64(byte & 0x7f) << shift;
+
+            if (!(byte & 0x80))
+                return true;
+        }
+
+        return false;
+    }
+}
+
+#endif
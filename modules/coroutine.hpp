@@ -0,0 +1,329 @@
+#ifndef RECURSE_MODULE_COROUTINE_HPP
+#define RECURSE_MODULE_COROUTINE_HPP
+
+#include <QFutureWatcher>
+#include <QIODevice>
+#include <QPointer>
+#include <QTimer>
+#include <QtConcurrent/QtConcurrent>
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+
+#include "../recurse.hpp"
+
+//!
+//! C++20 coroutine support for middlewares, requires CONFIG += c++2a (or -std=c++20)
+//!
+//! Any middleware can be a coroutine by returning Module::Task, awaited operations resume on
+//! the thread that started them (application's event loop). Coroutine frame is tied to the
+//! Context it was called with: when client goes away and context is freed, suspended frame
+//! is destroyed and pending operations are dropped, so captured `ctx` is never dangling.
+//!
+//!     app.use([](Context &ctx) -> Module::Task
+//!     {
+//!         auto data = co_await Module::run([] { return query(); });
+//!         co_await Module::delay(10);
+//!
+//!         ctx.response.send(data);
+//!     });
+//!
+
+namespace Module
+{
+
+    //!
+    //! \brief The Awaitable struct
+    //! base for awaitables, scope is set by Task when awaited and is used as
+    //! parent and connection context of Qt objects serving the operation
+    //!
+    struct Awaitable
+    {
+        QObject *scope = nullptr;
+    };
+
+    //!
+    //! \brief The Task struct
+    //! fire-and-forget coroutine return type, starts right away and frees itself when done
+    //!
+    struct Task
+    {
+        struct promise_type
+        {
+            Context *ctx = nullptr;
+            QMetaObject::Connection guard;
+
+            //!
+            //! \brief promise_type
+            //! coroutine arguments are passed here, first Context found binds the frame to it
+            //!
+            template <typename... Args>
+            promise_type(Args &... args)
+            {
+                (m_bind(args), ...);
+            }
+
+            ~promise_type()
+            {
+                QObject::disconnect(guard);
+            }
+
+            Task get_return_object()
+            {
+                if (ctx)
+                {
+                    auto handle = std::coroutine_handle<promise_type>::from_promise(*this);
+
+                    guard = QObject::connect(ctx->scope(), &QObject::destroyed, [handle]
+                    {
+                        handle.destroy();
+                    });
+                }
+
+                return Task();
+            }
+
+            std::suspend_never initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            std::suspend_never final_suspend() noexcept
+            {
+                return {};
+            }
+
+            void return_void()
+            {
+            }
+
+            void unhandled_exception()
+            {
+                std::terminate();
+            }
+
+            template <typename T>
+            T &&await_transform(T &&awaitable)
+            {
+                if constexpr (std::is_base_of_v<Awaitable, std::decay_t<T>>)
+                {
+                    if (ctx)
+                        awaitable.scope = ctx->scope();
+                }
+
+                return std::forward<T>(awaitable);
+            }
+
+        private:
+            void m_bind(Context &context)
+            {
+                if (!ctx)
+                    ctx = &context;
+            }
+
+            template <typename T>
+            void m_bind(T &)
+            {
+            }
+        };
+    };
+
+    //!
+    //! \brief The FutureAwaiter struct
+    //! resumes once future is finished, returns its result
+    //!
+    template <typename T>
+    struct FutureAwaiter : Awaitable
+    {
+        QFuture<T> future;
+
+        bool await_ready() const
+        {
+            return future.isFinished();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            auto watcher = new QFutureWatcher<T>(scope);
+
+            QObject::connect(watcher, &QFutureWatcherBase::finished, watcher, [watcher, handle]
+            {
+                watcher->deleteLater();
+                handle.resume();
+            });
+
+            watcher->setFuture(future);
+        }
+
+        T await_resume()
+        {
+            if constexpr (!std::is_void_v<T>)
+                return future.result();
+        }
+    };
+
+    //!
+    //! \brief await
+    //! await already running QFuture
+    //!
+    template <typename T>
+    FutureAwaiter<T> await(const QFuture<T> &future)
+    {
+        FutureAwaiter<T> awaiter;
+        awaiter.future = future;
+
+        return awaiter;
+    }
+
+    //!
+    //! \brief run
+    //! run function in global thread pool
+    //!
+    //!     auto rows = co_await Module::run([] { return query(); });
+    //!
+    template <typename F>
+    auto run(F &&f)
+    {
+        return await(QtConcurrent::run(std::forward<F>(f)));
+    }
+
+    //!
+    //! \brief run
+    //! run function in provided thread pool
+    //!
+    template <typename F>
+    auto run(QThreadPool *pool, F &&f)
+    {
+        return await(QtConcurrent::run(pool, std::forward<F>(f)));
+    }
+
+    //!
+    //! \brief The DelayAwaiter struct
+    //! resumes after timeout, without blocking event loop
+    //!
+    struct DelayAwaiter : Awaitable
+    {
+        int msec;
+
+        bool await_ready() const
+        {
+            return msec < 0;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            QTimer::singleShot(msec, scope ? scope : QCoreApplication::instance(), [handle]
+            {
+                handle.resume();
+            });
+        }
+
+        void await_resume()
+        {
+        }
+    };
+
+    //!
+    //! \brief delay
+    //! suspend for msec milliseconds
+    //!
+    inline DelayAwaiter delay(int msec)
+    {
+        DelayAwaiter awaiter;
+        awaiter.msec = msec;
+
+        return awaiter;
+    }
+
+    //!
+    //! \brief The DeviceAwaiter struct
+    //! resumes when device (eg: socket) becomes readable or its write buffer drains
+    //! returns false if device was closed in the meantime
+    //!
+    struct DeviceAwaiter : Awaitable
+    {
+        QPointer<QIODevice> device;
+        bool write;
+        qint64 threshold;
+
+        bool await_ready() const
+        {
+            if (!device || !device->isOpen())
+                return true;
+
+            if (write)
+                return device->bytesToWrite() <= threshold;
+
+            return device->bytesAvailable() > 0;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            auto done = QSharedPointer<QMetaObject::Connection>::create();
+            auto closed = QSharedPointer<QMetaObject::Connection>::create();
+            QObject *context = scope ? scope : device.data();
+
+            auto resume = [done, closed, handle]
+            {
+                QObject::disconnect(*done);
+                QObject::disconnect(*closed);
+                handle.resume();
+            };
+
+            if (write)
+            {
+                QPointer<QIODevice> d = device;
+                qint64 limit = threshold;
+
+                *done = QObject::connect(device, &QIODevice::bytesWritten, context, [d, limit, resume]
+                {
+                    if (d && d->bytesToWrite() > limit)
+                        return;
+
+                    resume();
+                });
+            }
+            else
+            {
+                *done = QObject::connect(device, &QIODevice::readyRead, context, resume);
+            }
+
+            *closed = QObject::connect(device, &QIODevice::aboutToClose, context, resume);
+        }
+
+        bool await_resume() const
+        {
+            return device && device->isOpen();
+        }
+    };
+
+    //!
+    //! \brief readyRead
+    //! suspend until device has data available
+    //!
+    inline DeviceAwaiter readyRead(QIODevice *device)
+    {
+        DeviceAwaiter awaiter;
+        awaiter.device = device;
+        awaiter.write = false;
+        awaiter.threshold = 0;
+
+        return awaiter;
+    }
+
+    //!
+    //! \brief bytesWritten
+    //! suspend until device's write buffer drains to threshold bytes, useful for flow control
+    //!
+    inline DeviceAwaiter bytesWritten(QIODevice *device, qint64 threshold = 0)
+    {
+        DeviceAwaiter awaiter;
+        awaiter.device = device;
+        awaiter.write = true;
+        awaiter.threshold = threshold;
+
+        return awaiter;
+    }
+}
+
+#endif
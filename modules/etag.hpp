@@ -0,0 +1,228 @@
+#ifndef RECURSE_MODULE_ETAG_HPP
+#define RECURSE_MODULE_ETAG_HPP
+
+#include <QStringList>
+#include <QtEndian>
+#include <cstring>
+
+#include "../recurse.hpp"
+
+namespace Module
+{
+
+    //!
+    //! \brief The ETag class
+    //! Conditional GET support
+    //!
+    //! Upstream middleware hashes final response body (xxHash64), sets strong ETag header and
+    //! answers matching If-None-Match with empty 304 Not Modified.
+    //!
+    //! Handlers that know version of the resource can skip rendering completely:
+    //!
+    //!     app.use(etag.middleware());
+    //!
+    //!     app.use([](auto &ctx)
+    //!     {
+    //!         if (Module::ETag::notModified(ctx, QString::number(article.version)))
+    //!             return;
+    //!
+    //!         ctx.response.send(render(article));
+    //!     });
+    //!
+    class ETag
+    {
+    public:
+        Recurse::DownstreamUpstream middleware();
+
+        static bool notModified(Context &ctx, const QString &version);
+        static quint64 hash(const char *data, qint64 size, quint64 seed = 0);
+
+    private:
+        static bool m_matches(const QString &if_none_match, const QString &etag);
+    };
+
+    //!
+    //! \brief ETag::middleware
+    //! Middleware to be passed to Application::use, should be used before middlewares
+    //! that produce the response. ETag already set downstream is kept as is
+    //!
+    //! \return DownstreamUpstream middleware
+    //!
+    inline Recurse::DownstreamUpstream ETag::middleware()
+    {
+        return [](Context &ctx, Recurse::NextPrev next, Recurse::Prev prev)
+        {
+            if (ctx.request.method != "GET" && ctx.request.method != "HEAD")
+            {
+                next(prev);
+                return;
+            }
+
+            next([&ctx, prev]
+            {
+                auto &response = ctx.response;
+
+                if (response.status() != 200)
+                {
+                    prev();
+                    return;
+                }
+
+                QString etag = response.getHeader("etag");
+
+                // body segments are not hashed, their handlers should set etag themselves
+                if (etag.isEmpty() && response.segments().isEmpty())
+                {
+                    const QByteArray &body = response.rawBody();
+                    quint64 h = hash(body.constData(), body.size());
+
+                    etag = "\"" % QString::number(h, 16).rightJustified(16, '0') % "\"";
+                    response.setHeader("etag", etag);
+                }
+
+                if (!etag.isEmpty() && m_matches(ctx.request.getHeader("if-none-match"), etag))
+                    response.status(304).body("");
+
+                prev();
+            });
+        };
+    }
+
+    //!
+    //! \brief ETag::notModified
+    //! Set ETag from resource version before doing expensive work, if client already has
+    //! this version 304 Not Modified is sent right away
+    //!
+    //! \param ctx request context
+    //! \param version resource version, eg: revision number or last modification timestamp
+    //! \return true if response was sent and handler should return
+    //!
+    inline bool ETag::notModified(Context &ctx, const QString &version)
+    {
+        QString etag = "\"" % version % "\"";
+        ctx.response.setHeader("etag", etag);
+
+        if (!m_matches(ctx.request.getHeader("if-none-match"), etag))
+            return false;
+
+        ctx.response.status(304).body("");
+        ctx.response.send();
+
+        return true;
+    }
+
+    //!
+    //! \brief ETag::m_matches
+    //! If-None-Match uses weak comparison, https://tools.ietf.org/html/rfc7232#section-3.2
+    //!
+    inline bool ETag::m_matches(const QString &if_none_match, const QString &etag)
+    {
+        if (if_none_match.isEmpty())
+            return false;
+
+        QString opaque = etag.startsWith("W/") ? etag.mid(2) : etag;
+
+        for (auto tag : if_none_match.splitRef(","))
+        {
+            tag = tag.trimmed();
+
+            if (tag == "*")
+                return true;
+
+            if (tag.startsWith("W/"))
+                tag = tag.mid(2);
+
+            if (tag == opaque)
+                return true;
+        }
+
+        return false;
+    }
+
+    //!
+    //! \brief ETag::hash
+    //! xxHash64, fast non-cryptographic hash, https://github.com/Cyan4973/xxHash
+    //!
+    //! \param data input buffer
+    //! \param size size of the buffer in bytes
+    //! \param seed hash seed
+    //! \return quint64 hash value
+    //!
+    inline quint64 ETag::hash(const char *data, qint64 size, quint64 seed)
+    {
+        const quint64 prime1 = 0x9E3779B185EBCA87ULL;
+        const quint64 prime2 = 0xC2B2AE3D27D4EB4FULL;
+        const quint64 prime3 = 0x165667B19E3779F9ULL;
+        const quint64 prime4 = 0x85EBCA77C2B2AE63ULL;
+        const quint64 prime5 = 0x27D4EB2F165667C5ULL;
+
+        auto rotl = [](quint64 x, int r) { return (x << r) | (x >> (64 - r)); };
+        auto read64 = [](const char *p) { quint64 v; std::memcpy(&v, p, 8); return qFromLittleEndian(v); };
+        auto read32 = [](const char *p) { quint32 v; std::memcpy(&v, p, 4); return qFromLittleEndian(v); };
+        auto round = [&](quint64 acc, quint64 input)
+        {
+            acc += input * prime2;
+            acc = rotl(acc, 31);
+            return acc * prime1;
+        };
+        auto merge = [&](quint64 acc, quint64 val)
+        {
+            acc ^= round(0, val);
+            return acc * prime1 + prime4;
+        };
+
+        const char *p = data;
+        const char *end = data + size;
+        quint64 h;
+
+        if (size >= 32)
+        {
+            quint64 v1 = seed + prime1 + prime2;
+            quint64 v2 = seed + prime2;
+            quint64 v3 = seed;
+            quint64 v4 = seed - prime1;
+
+            for (; p + 32 <= end; p += 32)
+            {
+                v1 = round(v1, read64(p));
+                v2 = round(v2, read64(p + 8));
+                v3 = round(v3, read64(p + 16));
+                v4 = round(v4, read64(p + 24));
+            }
+
+            h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+            h = merge(h, v1);
+            h = merge(h, v2);
+            h = merge(h, v3);
+            h = merge(h, v4);
+        }
+        else
+        {
+            h = seed + prime5;
+        }
+
+        h += static_cast<quint64>(size);
+
+        for (; p + 8 <= end; p += 8)
+            h = rotl(h ^ round(0, read64(p)), 27) * prime1 + prime4;
+
+        if (p + 4 <= end)
+        {
+            h = rotl(h ^ (static_cast<quint64>(read32(p)) * prime1), 23) * prime2 + prime3;
+            p += 4;
+        }
+
+        for (; p < end; ++p)
+            h = rotl(h ^ (static_cast<quint64>(static_cast<quint8>(*p)) * prime5), 11) * prime1;
+
+        h ^= h >> 33;
+        h *= prime2;
+        h ^= h >> 29;
+        h *= prime3;
+        h ^= h >> 32;
+
+        return h;
+    }
+}
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef RECURSE_MODULE_SINGLE_FLIGHT_HPP
+#define RECURSE_MODULE_SINGLE_FLIGHT_HPP
+
+#include <QPointer>
+#include <QTcpSocket>
+#include <QVector>
+
+#include "../recurse.hpp"
+
+namespace Module
+{
+
+    //!
+    //! \brief The SingleFlight class
+    //! Request coalescing middleware
+    //!
+    //! Concurrent requests with the same key are grouped, only the first one (leader) runs the
+    //! rest of the chain, others (followers) are parked and answered from leader's response.
+    //! If leader's client disconnects before response is ready, first remaining follower takes
+    //! over and runs the chain instead
+    //!
+    //! Middleware must be used from application's thread only, there is no locking
+    //!
+    //! Example:
+    //!
+    //!     Module::SingleFlight single_flight;
+    //!     app.use(single_flight.middleware());
+    //!
+    class SingleFlight
+    {
+    public:
+        //!
+        //! \brief Key
+        //! returns key to group requests by, empty key disables coalescing for the request
+        //!
+        using Key = std::function<QString(Context &ctx)>;
+
+        SingleFlight(Key key = nullptr);
+
+        Recurse::DownstreamUpstream middleware();
+        int inFlight() const;
+
+    private:
+        //!
+        //! \brief The Waiting struct
+        //! parked request, socket guards context lifetime as context is freed with its socket
+        //!
+        struct Waiting
+        {
+            QPointer<QTcpSocket> socket;
+            Context *ctx;
+            Recurse::NextPrev next;
+            Recurse::Prev prev;
+            QHash<QString, QString> before;
+        };
+
+        struct Flight
+        {
+            quint64 id;
+            QMetaObject::Connection leader;
+            QVector<Waiting> followers;
+        };
+
+        Key m_key;
+        QHash<QString, Flight> m_flights;
+        quint64 m_last_id = 0;
+
+        void m_lead(const QString &key, const Waiting &leader, const QVector<Waiting> &followers);
+        void m_complete(const QString &key, quint64 id, Context &ctx, const QHash<QString, QString> &before);
+        void m_abandon(const QString &key, quint64 id);
+    };
+
+    //!
+    //! \brief SingleFlight::SingleFlight
+    //!
+    //! \param key function returning grouping key, by default GET and HEAD requests
+    //! are grouped by method, url and credentials (Cookie and Authorization headers), so that
+    //! personalized response is only shared between requests of the same user. Other requests
+    //! are not coalesced
+    //!
+    inline SingleFlight::SingleFlight(Key key)
+        : m_key(std::move(key))
+    {
+        if (m_key)
+            return;
+
+        m_key = [](Context &ctx) -> QString
+        {
+            if (ctx.request.method != "GET" && ctx.request.method != "HEAD")
+                return QString();
+
+            auto &request = ctx.request;
+
+            return request.method % " " % request.url.toString() % "\n" % request.getHeader("cookie")
+                % "\n" % request.getHeader("authorization");
+        };
+    }
+
+    //!
+    //! \brief SingleFlight::inFlight
+    //! number of keys currently being processed
+    //!
+    inline int SingleFlight::inFlight() const
+    {
+        return m_flights.size();
+    }
+
+    //!
+    //! \brief SingleFlight::middleware
+    //! Middleware to be passed to Application::use
+    //!
+    //! \return DownstreamUpstream middleware
+    //!
+    inline Recurse::DownstreamUpstream SingleFlight::middleware()
+    {
+        return [this](Context &ctx, Recurse::NextPrev next, Recurse::Prev prev)
+        {
+            QString key = m_key(ctx);
+
+            // subrequests have no socket to watch for, they always run the chain
+            if (key.isEmpty() || !ctx.request.socket)
+            {
+                next(prev);
+                return;
+            }
+
+            Waiting waiting{ ctx.request.socket, &ctx, next, prev, ctx.response.getHeaders() };
+
+            auto it = m_flights.find(key);
+            if (it != m_flights.end())
+            {
+                it->followers.push_back(waiting);
+                return;
+            }
+
+            m_lead(key, waiting, QVector<Waiting>());
+        };
+    }
+
+    //!
+    //! \brief SingleFlight::m_lead
+    //! start new flight and run the chain for its leader
+    //!
+    inline void SingleFlight::m_lead(const QString &key, const Waiting &leader, const QVector<Waiting> &followers)
+    {
+        quint64 id = ++m_last_id;
+
+        Flight &flight = m_flights[key];
+        flight.id = id;
+        flight.followers = followers;
+        flight.leader = QObject::connect(leader.socket.data(), &QObject::destroyed, [this, key, id]
+        {
+            m_abandon(key, id);
+        });
+
+        Context *ctx = leader.ctx;
+        auto prev = leader.prev;
+        auto before = leader.before;
+
+        leader.next([this, key, id, ctx, prev, before]
+        {
+            m_complete(key, id, *ctx, before);
+            prev();
+        });
+    }
+
+    //!
+    //! \brief SingleFlight::m_complete
+    //! answer all followers with leader's response, only headers added downstream
+    //! of this middleware are copied
+    //!
+    inline void SingleFlight::m_complete(const QString &key, quint64 id, Context &ctx, const QHash<QString, QString> &before)
+    {
+        auto it = m_flights.find(key);
+        if (it == m_flights.end() || it->id != id)
+            return;
+
+        QObject::disconnect(it->leader);
+        auto followers = it->followers;
+        m_flights.erase(it);
+
+        auto &response = ctx.response;
+        auto all_headers = response.getHeaders();
+        QHash<QString, QString> headers;
+
+        for (auto i = all_headers.constBegin(); i != all_headers.constEnd(); ++i)
+        {
+            if (!before.contains(i.key()) || before.value(i.key()) != i.value())
+                headers[i.key()] = i.value();
+        }
+
+        for (const auto &follower : followers)
+        {
+            if (!follower.socket)
+                continue;
+
+            auto &follower_response = follower.ctx->response;
+            follower_response.status(response.status());
+
+            for (auto i = headers.constBegin(); i != headers.constEnd(); ++i)
+                follower_response.setHeader(i.key(), i.value());
+
+            follower_response.rawBody(response.rawBody());
+
+            for (const auto &segment : response.segments())
+            {
+                if (segment.path.isEmpty())
+                    follower_response.writeRaw(segment.data);
+                else
+                    follower_response.writeFile(segment.path, segment.offset, segment.length);
+            }
+            follower_response.send();
+        }
+    }
+
+    //!
+    //! \brief SingleFlight::m_abandon
+    //! leader's client went away, hand the flight over to first follower still connected
+    //!
+    inline void SingleFlight::m_abandon(const QString &key, quint64 id)
+    {
+        auto it = m_flights.find(key);
+        if (it == m_flights.end() || it->id != id)
+            return;
+
+        auto followers = it->followers;
+        m_flights.erase(it);
+
+        while (!followers.isEmpty())
+        {
+            auto leader = followers.takeFirst();
+
+            if (!leader.socket)
+                continue;
+
+            m_lead(key, leader, followers);
+            return;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef RECURSE_MODULE_SQL_BATCH_HPP
+#define RECURSE_MODULE_SQL_BATCH_HPP
+
+#include <QTimer>
+
+#include "sql_pool.hpp"
+
+namespace Module
+{
+
+    //!
+    //! \brief The SqlBatch class
+    //! Write-behind batching of many requests' writes into one transaction
+    //!
+    //! Writes are collected on the event loop and committed together once there are "rows"
+    //! of them or "interval" milliseconds passed since the first one, whichever comes first.
+    //! Only one batch is committed at a time (SQLite has single writer anyway). Each request
+    //! is answered only after its batch is committed, so durability semantics stay the same
+    //! as with one transaction per request, at a fraction of fsyncs.
+    //!
+    //!     Module::SqlBatch batch(&sql, {{ "rows", 200 }, { "interval", 5 }});
+    //!
+    //!     app.use([&batch](auto &ctx)
+    //!     {
+    //!         batch.write(ctx, "INSERT INTO lorem VALUES(?)", { ctx.request.body }, [&ctx](auto &result)
+    //!         {
+    //!             if (!result.ok)
+    //!             {
+    //!                 qWarning() << "write failed:" << result.error;
+    //!                 ctx.response.status(500).send(ctx.response.http_codes.value(500));
+    //!                 return;
+    //!             }
+    //!
+    //!             ctx.response.status(201).send();
+    //!         });
+    //!     });
+    //!
+    class SqlBatch
+    {
+    public:
+        //!
+        //! \brief The Result struct
+        //! outcome of single write, ok only if the statement and its batch commit succeeded
+        //!
+        struct Result
+        {
+            bool ok = false;
+            QString error;
+            QVariant last_insert_id;
+            int rows_affected = -1;
+        };
+
+        using Done = std::function<void(const Result &result)>;
+
+        SqlBatch(SqlPool *pool, const QHash<QString, QVariant> &options = QHash<QString, QVariant>());
+
+        void write(Context &ctx, const QString &sql, const QVariantList &binds, Done done);
+        void flush();
+        int pending() const;
+
+    private:
+        struct Write
+        {
+            QString sql;
+            QVariantList binds;
+            Done done;
+            QPointer<QObject> scope;
+            Cancellation token;
+            Result result;
+        };
+
+        SqlPool *m_pool;
+        int m_rows;
+        QTimer m_timer;
+        bool m_flushing = false;
+        QVector<Write> m_pending;
+
+        void m_schedule();
+        static void m_commit(QSqlDatabase &db, QVector<Write> &writes);
+    };
+
+    //!
+    //! \brief SqlBatch::SqlBatch
+    //!
+    //! \param pool connection pool to commit batches in
+    //! \param options QHash options of <QString, QVariant>
+    //!     "rows" number of writes that triggers commit right away, 100 by default
+    //!     "interval" maximum milliseconds a write waits for its batch, 10 by default
+    //!
+    inline SqlBatch::SqlBatch(SqlPool *pool, const QHash<QString, QVariant> &options)
+        : m_pool(pool)
+    {
+        m_rows = qMax(1, options.value("rows", 100).toInt());
+
+        m_timer.setSingleShot(true);
+        m_timer.setInterval(options.value("interval", 10).toInt());
+
+        QObject::connect(&m_timer, &QTimer::timeout, [this]
+        {
+            flush();
+        });
+    }
+
+    //!
+    //! \brief SqlBatch::write
+    //! queue write to be committed with next batch
+    //!
+    //! \param ctx request context, write is committed even if client goes away
+    //! but done is called only while request is alive
+    //! \param sql statement with positional placeholders
+    //! \param binds positional values
+    //! \param done called on the event loop once batch is committed
+    //!
+    inline void SqlBatch::write(Context &ctx, const QString &sql, const QVariantList &binds, Done done)
+    {
+        Write write;
+        write.sql = sql;
+        write.binds = binds;
+        write.done = std::move(done);
+        write.scope = ctx.scope();
+        write.token = ctx.cancellation;
+
+        m_pending.push_back(write);
+        m_schedule();
+    }
+
+    //!
+    //! \brief SqlBatch::pending
+    //! \return number of writes waiting for their batch
+    //!
+    inline int SqlBatch::pending() const
+    {
+        return m_pending.size();
+    }
+
+    //!
+    //! \brief SqlBatch::flush
+    //! commit pending writes now, unless other batch is being committed
+    //!
+    inline void SqlBatch::flush()
+    {
+        if (m_flushing || m_pending.isEmpty())
+            return;
+
+        m_timer.stop();
+
+        auto writes = QSharedPointer<QVector<Write>>::create();
+        writes->swap(m_pending);
+
+        m_flushing = true;
+
+        bool queued = m_pool->run([writes](QSqlDatabase &db)
+        {
+            m_commit(db, *writes);
+            return QVariant();
+        },
+        [this, writes](const QVariant &)
+        {
+            m_flushing = false;
+
+            for (const auto &write : *writes)
+            {
+                if (!write.done || !write.scope || write.token.isCancelled())
+                    continue;
+
+                write.done(write.result);
+            }
+
+            m_schedule();
+        });
+
+        // pool is busy, put writes back and try again later
+        if (!queued)
+        {
+            m_flushing = false;
+            *writes += m_pending;
+            m_pending.swap(*writes);
+            m_timer.start();
+        }
+    }
+
+    //!
+    //! \brief SqlBatch::m_schedule
+    //! commit right away when batch is full, otherwise make sure timer is running
+    //!
+    inline void SqlBatch::m_schedule()
+    {
+        if (m_pending.isEmpty() || m_flushing)
+            return;
+
+        if (m_pending.size() >= m_rows)
+            flush();
+        else if (!m_timer.isActive())
+            m_timer.start();
+    }
+
+    //!
+    //! \brief SqlBatch::m_commit
+    //! called in pool thread, run all writes in one transaction, each inside its own savepoint
+    //! so that failed statement is undone without aborting others (PostgreSQL aborts whole
+    //! transaction otherwise). Without savepoints failed statement rolls back whole batch,
+    //! failed commit fails them all too
+    //!
+    inline void SqlBatch::m_commit(QSqlDatabase &db, QVector<Write> &writes)
+    {
+        bool transaction = db.transaction();
+        bool savepoints = transaction;
+        QString failed;
+        QHash<QString, QSqlQuery> statements;
+        QSqlQuery savepoint(db);
+
+        for (auto &write : writes)
+        {
+            if (savepoints)
+                savepoints = savepoint.exec("SAVEPOINT recurse_batch");
+
+            auto it = statements.find(write.sql);
+
+            if (it == statements.end())
+            {
+                QSqlQuery query(db);
+                query.prepare(write.sql);
+                it = statements.insert(write.sql, query);
+            }
+
+            auto result = SqlPool::exec(*it, write.binds);
+
+            write.result.ok = result.ok;
+            write.result.error = result.error.text();
+            write.result.last_insert_id = result.last_insert_id;
+            write.result.rows_affected = result.rows_affected;
+
+            if (savepoints)
+                savepoint.exec(result.ok ? "RELEASE SAVEPOINT recurse_batch" : "ROLLBACK TO SAVEPOINT recurse_batch");
+            else if (!result.ok && failed.isEmpty())
+                failed = write.result.error;
+        }
+
+        if (!transaction)
+            return;
+
+        if (failed.isEmpty() && db.commit())
+            return;
+
+        QString error = db.lastError().text();
+
+        if (!failed.isEmpty())
+            error = "batch rolled back: " + failed;
+
+        db.rollback();
+
+        for (auto &write : writes)
+        {
+            if (!write.result.ok)
+                continue;
+
+            write.result.ok = false;
+            write.result.error = error;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,342 @@
+#ifndef RECURSE_MODULE_SQL_POOL_HPP
+#define RECURSE_MODULE_SQL_POOL_HPP
+
+#include <QDeadlineTimer>
+#include <QSemaphore>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QThread>
+#include <QThreadStorage>
+
+#include "../recurse.hpp"
+
+namespace Module
+{
+
+    //!
+    //! \brief The SqlPool class
+    //! Thread-affine QtSql connection pool with asynchronous query API
+    //!
+    //! QSqlDatabase can only be used from the thread that created it, so every pool thread
+    //! opens its own clone of the prototype connection. Queries run in application's executor
+    //! (pool named by "pool" option) and results are delivered back on the event loop,
+    //! unless the request was cancelled or client went away in the meantime.
+    //!
+    //! Each connection keeps a cache of prepared statements and is health checked
+    //! when it was idle for a while. Pool is meant to live as long as the application.
+    //!
+    //!     QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "main");
+    //!     db.setDatabaseName("sqlite.db");
+    //!
+    //!     Module::SqlPool sql(&app, db, {{ "min", 2 }, { "max", 8 }});
+    //!
+    //!     app.use([&sql](auto &ctx)
+    //!     {
+    //!         sql.query(ctx, "SELECT info FROM lorem WHERE id = ?", { 1 }, [&ctx](auto &result)
+    //!         {
+    //!             ctx.response.send(result.rows.first().value(0).toString());
+    //!         });
+    //!     });
+    //!
+    class SqlPool
+    {
+    public:
+        //!
+        //! \brief The Result struct
+        //! query result, rows are fetched completely in pool thread
+        //!
+        struct Result
+        {
+            bool ok = false;
+            QSqlError error;
+            QVector<QSqlRecord> rows;
+            QVariant last_insert_id;
+            int rows_affected = -1;
+        };
+
+        using Done = std::function<void(const Result &result)>;
+        using Work = std::function<QVariant(QSqlDatabase &db)>;
+
+        SqlPool(Recurse::Application *app, const QSqlDatabase &prototype,
+            const QHash<QString, QVariant> &options = QHash<QString, QVariant>());
+
+        bool query(Context &ctx, const QString &sql, const QVariantList &binds, Done done);
+        bool run(Context &ctx, Work work, Recurse::Executor::Done done);
+        bool run(Work work, Recurse::Executor::Done done, QObject *context = nullptr);
+
+        static Result exec(QSqlQuery &query, const QVariantList &binds);
+
+    private:
+        //!
+        //! \brief The Connection struct
+        //! per-thread database clone with its prepared statements
+        //!
+        struct Connection
+        {
+            QString name;
+            qint64 last_used = 0;
+            QHash<QString, QSqlQuery> statements;
+
+            ~Connection()
+            {
+                statements.clear();
+                QSqlDatabase::database(name, false).close();
+                QSqlDatabase::removeDatabase(name);
+            }
+        };
+
+        Recurse::Executor &m_executor;
+        QSqlDatabase m_prototype;
+        QString m_pool;
+        int m_statements;
+        qint64 m_health_interval;
+        QString m_health_query;
+
+        QThreadStorage<Connection *> m_connections;
+
+        Connection &m_connection();
+        QSqlDatabase m_database(Connection &connection);
+        QSqlQuery &m_prepare(Connection &connection, const QString &sql);
+
+        static qint64 m_now();
+    };
+
+    //!
+    //! \brief SqlPool::SqlPool
+    //!
+    //! \param app application whose executor runs the queries
+    //! \param prototype configured (not necessarily opened) connection to be cloned per thread
+    //! \param options QHash options of <QString, QVariant>
+    //!     "pool" executor pool name, "sql" by default
+    //!     "min" connections opened right away, 1 by default
+    //!     "max" maximum number of connections (pool threads), 4 by default
+    //!     "queue" maximum number of waiting queries, 0 for unbounded (default)
+    //!     "statements" prepared statements cached per connection, 64 by default
+    //!     "health_check" milliseconds of idleness after which connection is checked, 30000 by default
+    //!     "health_query" query used for health check, "SELECT 1" by default
+    //!
+    inline SqlPool::SqlPool(Recurse::Application *app, const QSqlDatabase &prototype, const QHash<QString, QVariant> &options)
+        : m_executor(app->executor()),
+          m_prototype(prototype)
+    {
+        m_pool = options.value("pool", "sql").toString();
+        m_statements = options.value("statements", 64).toInt();
+        m_health_interval = options.value("health_check", 30000).toLongLong();
+        m_health_query = options.value("health_query", "SELECT 1").toString();
+
+        int max = qMax(1, options.value("max", 4).toInt());
+        int min = qBound(0, options.value("min", 1).toInt(), max);
+
+        // threads are kept forever so their connections stay open
+        m_executor.pool(m_pool, max, options.value("queue", 0).toInt(), -1);
+
+        // open min connections, each warm-up job waits for others so they land on different threads
+        auto arrived = QSharedPointer<QSemaphore>::create();
+
+        for (int i = 0; i < min; ++i)
+        {
+            m_executor.run(m_pool, [this, arrived, min]
+            {
+                m_database(m_connection());
+
+                arrived->release();
+                if (arrived->tryAcquire(min, 5000))
+                    arrived->release(min);
+
+                return QVariant();
+            }, nullptr);
+        }
+    }
+
+    //!
+    //! \brief SqlPool::query
+    //! run parametrized query with cached prepared statement
+    //!
+    //! \param ctx request context, result is dropped if it is cancelled or gone
+    //! \param sql query with positional placeholders
+    //! \param binds positional values
+    //! \param done called on the event loop with query result
+    //! \return false if pool queue is full
+    //!
+    inline bool SqlPool::query(Context &ctx, const QString &sql, const QVariantList &binds, Done done)
+    {
+        auto result = QSharedPointer<Result>::create();
+        auto token = ctx.cancellation;
+
+        return m_executor.run(m_pool, [this, result, token, sql, binds]
+        {
+            if (token.isCancelled())
+                return QVariant();
+
+            Connection &connection = m_connection();
+            m_database(connection);
+
+            *result = exec(m_prepare(connection, sql), binds);
+
+            return QVariant();
+        },
+        [result, token, done](const QVariant &)
+        {
+            if (!token.isCancelled())
+                done(*result);
+        }, ctx.scope());
+    }
+
+    //!
+    //! \brief SqlPool::run
+    //! run arbitrary work with thread's connection, eg: transactions or streaming
+    //!
+    //! \param ctx request context, work and result are skipped if it is cancelled or gone
+    //! \param work called in pool thread with opened connection
+    //! \param done optional, called on the event loop with the value work returned
+    //! \return false if pool queue is full
+    //!
+    inline bool SqlPool::run(Context &ctx, Work work, Recurse::Executor::Done done)
+    {
+        auto token = ctx.cancellation;
+
+        return m_executor.run(m_pool, [this, token, work]
+        {
+            if (token.isCancelled())
+                return QVariant();
+
+            QSqlDatabase db = m_database(m_connection());
+            return work(db);
+        },
+        [token, done](const QVariant &result)
+        {
+            if (done && !token.isCancelled())
+                done(result);
+        }, ctx.scope());
+    }
+
+    //!
+    //! \brief SqlPool::run
+    //! overloaded function,
+    //! run work not bound to any request, eg: batched writes of many requests
+    //!
+    //! \param work called in pool thread with opened connection
+    //! \param done optional, called on the event loop with the value work returned
+    //! \param context optional, if destroyed before work is done, done is skipped
+    //! \return false if pool queue is full
+    //!
+    inline bool SqlPool::run(Work work, Recurse::Executor::Done done, QObject *context)
+    {
+        return m_executor.run(m_pool, [this, work]
+        {
+            QSqlDatabase db = m_database(m_connection());
+            return work(db);
+        }, done, context);
+    }
+
+    //!
+    //! \brief SqlPool::exec
+    //! bind values, execute prepared query and collect all rows
+    //!
+    inline SqlPool::Result SqlPool::exec(QSqlQuery &query, const QVariantList &binds)
+    {
+        Result result;
+
+        for (int i = 0; i < binds.size(); ++i)
+            query.bindValue(i, binds.at(i));
+
+        result.ok = query.exec();
+
+        if (!result.ok)
+        {
+            result.error = query.lastError();
+            return result;
+        }
+
+        if (query.isSelect())
+        {
+            while (query.next())
+                result.rows.push_back(query.record());
+        }
+
+        result.last_insert_id = query.lastInsertId();
+        result.rows_affected = query.numRowsAffected();
+
+        // keep statement prepared but release its result set
+        query.finish();
+
+        return result;
+    }
+
+    //!
+    //! \brief SqlPool::m_connection
+    //! connection of current pool thread, created on first use
+    //!
+    inline SqlPool::Connection &SqlPool::m_connection()
+    {
+        if (!m_connections.hasLocalData())
+        {
+            auto connection = new Connection;
+            connection->name = QString("recurse_sql_%1_%2")
+                                   .arg(reinterpret_cast<quintptr>(this))
+                                   .arg(reinterpret_cast<quintptr>(QThread::currentThreadId()));
+
+            QSqlDatabase::cloneDatabase(m_prototype, connection->name);
+            m_connections.setLocalData(connection);
+        }
+
+        return *m_connections.localData();
+    }
+
+    //!
+    //! \brief SqlPool::m_database
+    //! open connection if needed and check its health if it was idle for too long,
+    //! broken connection is reopened and its prepared statements dropped
+    //!
+    inline QSqlDatabase SqlPool::m_database(Connection &connection)
+    {
+        QSqlDatabase db = QSqlDatabase::database(connection.name, false);
+        qint64 now = m_now();
+
+        bool healthy = db.isOpen();
+
+        if (healthy && m_health_interval >= 0 && now - connection.last_used > m_health_interval)
+        {
+            QSqlQuery check(db);
+            healthy = check.exec(m_health_query);
+        }
+
+        if (!healthy)
+        {
+            connection.statements.clear();
+            db.close();
+            db.open();
+        }
+
+        connection.last_used = now;
+        return db;
+    }
+
+    //!
+    //! \brief SqlPool::m_prepare
+    //! prepared statement from connection's cache
+    //!
+    inline QSqlQuery &SqlPool::m_prepare(Connection &connection, const QString &sql)
+    {
+        auto it = connection.statements.find(sql);
+        if (it != connection.statements.end())
+            return *it;
+
+        if (connection.statements.size() >= m_statements)
+            connection.statements.clear();
+
+        QSqlQuery query(QSqlDatabase::database(connection.name, false));
+        query.prepare(sql);
+
+        return *connection.statements.insert(sql, query);
+    }
+
+    inline qint64 SqlPool::m_now()
+    {
+        return QDeadlineTimer::current().deadline();
+    }
+}
+
+#endif
@@ -0,0 +1,271 @@
+#ifndef RECURSE_MODULE_SQL_STREAM_HPP
+#define RECURSE_MODULE_SQL_STREAM_HPP
+
+#include <QDebug>
+#include <QQueue>
+#include <QSemaphore>
+
+#include "sql_pool.hpp"
+
+namespace Module
+{
+
+    //!
+    //! \brief The SqlStream class
+    //! Stream query result rows to client as chunked JSON array or NDJSON
+    //!
+    //! Query is iterated with forward-only cursor in SqlPool thread, rows are serialized there
+    //! with JsonWriter in batches and handed over to the event loop through small bounded queue.
+    //! When client reads slowly, socket buffer fills up, queue fills up and the worker waits,
+    //! so large exports run in constant memory. First row is sent as soon as it is fetched,
+    //! the rest in batches of about 16KB.
+    //!
+    //!     app.use([&sql](auto &ctx)
+    //!     {
+    //!         Module::SqlStream::send(sql, ctx, "SELECT * FROM lorem", {}, Module::SqlStream::NdJson);
+    //!     });
+    //!
+    class SqlStream
+    {
+    public:
+        enum Format
+        {
+            JsonArray,
+            NdJson
+        };
+
+        static bool send(SqlPool &pool, Context &ctx, const QString &sql, const QVariantList &binds = QVariantList(),
+            Format format = JsonArray);
+
+    private:
+        //!
+        //! \brief The Channel struct
+        //! bounded hand-over of serialized batches from worker to event loop,
+        //! free counts batches worker may still queue
+        //!
+        struct Channel
+        {
+            QMutex mutex;
+            QQueue<QByteArray> batches;
+            QSemaphore free{ 4 };
+            bool finished = false;
+            QString error;
+
+            QSharedPointer<QObject> notifier;
+            QSharedPointer<Recurse::Stream> stream;
+        };
+
+        static void m_pump(QSharedPointer<Channel> channel);
+        static bool m_push(const QSharedPointer<Channel> &channel, const Cancellation &token, const QByteArray &batch);
+        static void m_finish(const QSharedPointer<Channel> &channel, const QString &error);
+    };
+
+    //!
+    //! \brief SqlStream::send
+    //! run query and stream its rows as response, status and headers already set on
+    //! ctx.response are kept. If query fails before first row is sent client gets 500,
+    //! database error is only logged
+    //!
+    //! \param pool connection pool to run query in
+    //! \param ctx request context
+    //! \param sql query with positional placeholders
+    //! \param binds positional values
+    //! \param format JsonArray (application/json) or NdJson (application/x-ndjson)
+    //! \return false if pool queue is full, response is not started then
+    //!
+    inline bool SqlStream::send(SqlPool &pool, Context &ctx, const QString &sql, const QVariantList &binds, Format format)
+    {
+        auto channel = QSharedPointer<Channel>::create();
+        auto token = ctx.cancellation;
+
+        // notifier lives in event loop thread, it may be released from worker
+        channel->notifier = QSharedPointer<QObject>(new QObject, &QObject::deleteLater);
+
+        bool queued = pool.run(ctx, [channel, token, sql, binds, format](QSqlDatabase &db)
+        {
+            QSqlQuery query(db);
+            query.setForwardOnly(true);
+
+            if (!query.prepare(sql))
+            {
+                m_finish(channel, query.lastError().text());
+                return QVariant();
+            }
+
+            for (int i = 0; i < binds.size(); ++i)
+                query.bindValue(i, binds.at(i));
+
+            if (!query.exec())
+            {
+                m_finish(channel, query.lastError().text());
+                return QVariant();
+            }
+
+            QByteArray batch;
+            batch.reserve(20 * 1024);
+
+            if (format == JsonArray)
+                batch += '[';
+
+            QSqlRecord record = query.record();
+            QVector<QByteArray> names;
+
+            for (int i = 0; i < record.count(); ++i)
+                names.push_back(record.fieldName(i).toUtf8());
+
+            bool first = true;
+            bool pushed = false;
+
+            while (query.next())
+            {
+                if (format == JsonArray && !first)
+                    batch += ',';
+
+                Recurse::JsonWriter row(batch);
+                row.beginObject();
+
+                for (int i = 0; i < names.size(); ++i)
+                    row.key(names.at(i).constData()).value(query.value(i));
+
+                row.endObject();
+
+                if (format == NdJson)
+                    batch += '\n';
+
+                first = false;
+
+                // first row goes out right away, client doesn't wait for whole batch
+                if (!pushed || batch.size() >= 16 * 1024)
+                {
+                    if (!m_push(channel, token, batch))
+                        return QVariant();
+
+                    batch.resize(0);
+                    pushed = true;
+                }
+            }
+
+            if (query.lastError().isValid())
+            {
+                m_finish(channel, query.lastError().text());
+                return QVariant();
+            }
+
+            if (format == JsonArray)
+                batch += ']';
+
+            if (m_push(channel, token, batch))
+                m_finish(channel, QString());
+
+            return QVariant();
+        },
+        nullptr);
+
+        if (!queued)
+            return false;
+
+        channel->stream = QSharedPointer<Recurse::Stream>::create(ctx, format == JsonArray ? "application/json" : "application/x-ndjson");
+
+        return true;
+    }
+
+    //!
+    //! \brief SqlStream::m_push
+    //! called from worker, waits while queue is full, gives up when request is cancelled
+    //!
+    inline bool SqlStream::m_push(const QSharedPointer<Channel> &channel, const Cancellation &token, const QByteArray &batch)
+    {
+        while (!channel->free.tryAcquire(1, 100))
+        {
+            if (token.isCancelled())
+                return false;
+        }
+
+        bool wakeup;
+
+        {
+            QMutexLocker locker(&channel->mutex);
+
+            wakeup = channel->batches.isEmpty();
+            channel->batches.enqueue(batch);
+        }
+
+        if (wakeup)
+            QMetaObject::invokeMethod(channel->notifier.data(), [channel] { m_pump(channel); }, Qt::QueuedConnection);
+
+        return true;
+    }
+
+    //!
+    //! \brief SqlStream::m_finish
+    //! called from worker, mark end of rows or error
+    //!
+    inline void SqlStream::m_finish(const QSharedPointer<Channel> &channel, const QString &error)
+    {
+        {
+            QMutexLocker locker(&channel->mutex);
+
+            channel->finished = true;
+            channel->error = error;
+        }
+
+        QMetaObject::invokeMethod(channel->notifier.data(), [channel] { m_pump(channel); }, Qt::QueuedConnection);
+    }
+
+    //!
+    //! \brief SqlStream::m_pump
+    //! event loop side, write queued batches while socket accepts them,
+    //! otherwise continue once it drains
+    //!
+    inline void SqlStream::m_pump(QSharedPointer<Channel> channel)
+    {
+        auto &stream = channel->stream;
+
+        if (!stream || !stream->isOpen())
+            return;
+
+        while (stream->writable())
+        {
+            QByteArray batch;
+            bool queued;
+            bool finished;
+            QString error;
+
+            {
+                QMutexLocker locker(&channel->mutex);
+
+                queued = !channel->batches.isEmpty();
+                finished = channel->finished && !queued;
+                error = channel->error;
+
+                if (queued)
+                    batch = channel->batches.dequeue();
+            }
+
+            if (finished)
+            {
+                if (error.isEmpty())
+                {
+                    stream->end();
+                }
+                else
+                {
+                    qWarning() << "sql stream:" << error;
+                    stream->abort(500);
+                }
+
+                return;
+            }
+
+            if (!queued)
+                return;
+
+            channel->free.release();
+            stream->write(batch);
+        }
+
+        stream->onDrain([channel] { m_pump(channel); });
+    }
+}
+
+#endif
@@ -0,0 +1,361 @@
+#ifndef RECURSE_MODULE_SSE_HPP
+#define RECURSE_MODULE_SSE_HPP
+
+#include <QPointer>
+#include <QQueue>
+#include <QSet>
+#include <QSharedPointer>
+#include <QTimer>
+
+#include "../recurse.hpp"
+
+namespace Module
+{
+
+    //!
+    //! \brief The EventSource class
+    //! Server-Sent Events channel with broadcast fan-out
+    //!
+    //! middleware() turns request into subscription: response head is sent and connection is
+    //! kept open. broadcast() encodes event once, the same implicitly shared buffer is queued for
+    //! every subscriber and written as its socket drains, so socket buffers hold at most
+    //! "watermark" bytes per client. Subscribers whose queue grows above "queue_size"
+    //! are dropped, they can reconnect with Last-Event-ID.
+    //!
+    //! Heartbeats are driven by single timer wheel: subscribers are spread over its slots
+    //! and each tick visits one slot, idle subscribers in it get comment line.
+    //!
+    //!     Module::EventSource prices({{ "heartbeat", 15000 }});
+    //!     app.use(prices.middleware());
+    //!
+    //!     prices.broadcast("tick", QByteArray("{\"EUR\":1.08}"));
+    //!
+    class EventSource
+    {
+    public:
+        EventSource(const QHash<QString, QVariant> &options = QHash<QString, QVariant>());
+        ~EventSource();
+
+        Recurse::Final middleware();
+        void subscribe(Context &ctx);
+
+        int broadcast(const QString &event, const QByteArray &data, const QString &id = QString());
+        int broadcast(const QByteArray &data);
+        int subscribers() const;
+        quint64 dropped() const;
+
+        static QByteArray encode(const QString &event, const QByteArray &data, const QString &id = QString());
+
+    private:
+        //!
+        //! \brief The Subscriber struct
+        //! queued events share their buffers with all other subscribers
+        //!
+        struct Subscriber
+        {
+            QPointer<QTcpSocket> socket;
+            QMetaObject::Connection written;
+            QMetaObject::Connection closed;
+            QQueue<QByteArray> queue;
+            qint64 queued = 0;
+            int slot = 0;
+            bool active = false;
+        };
+
+        qint64 m_queue_size;
+        qint64 m_watermark;
+        int m_retry;
+
+        QHash<QTcpSocket *, QSharedPointer<Subscriber>> m_subscribers;
+        QVector<QSet<QTcpSocket *>> m_wheel;
+        int m_tick = 0;
+        QTimer m_timer;
+        quint64 m_dropped = 0;
+
+        QByteArray m_heartbeat = ":\n\n";
+
+        bool m_enqueue(Subscriber &subscriber, const QByteArray &buffer);
+        void m_pump(Subscriber &subscriber);
+        void m_remove(QTcpSocket *socket);
+        void m_heartbeats();
+    };
+
+    //!
+    //! \brief EventSource::EventSource
+    //!
+    //! \param options QHash options of <QString, QVariant>
+    //!     "queue_size" bytes waiting for subscriber above which it is dropped, 1MB by default
+    //!     "watermark" bytes handed over to subscriber socket at most, 16KB by default
+    //!     "heartbeat" milliseconds of idleness after which comment is sent, 15000 by default, 0 to disable
+    //!     "retry" reconnection time sent to clients in milliseconds, 0 to leave browser default (default)
+    //!
+    inline EventSource::EventSource(const QHash<QString, QVariant> &options)
+    {
+        m_queue_size = options.value("queue_size", 1024 * 1024).toLongLong();
+        m_watermark = options.value("watermark", 16 * 1024).toLongLong();
+        m_retry = options.value("retry", 0).toInt();
+
+        int heartbeat = options.value("heartbeat", 15000).toInt();
+
+        // one wheel turn per heartbeat interval, ticking at most once per 100ms
+        int slots = qBound(1, heartbeat / 100, 64);
+        m_wheel.resize(slots);
+
+        QObject::connect(&m_timer, &QTimer::timeout, [this]
+        {
+            m_heartbeats();
+        });
+
+        if (heartbeat > 0)
+            m_timer.start(heartbeat / slots);
+    }
+
+    //!
+    //! \brief EventSource::~EventSource
+    //! subscriptions end with the channel, their connections are closed and clients reconnect
+    //!
+    inline EventSource::~EventSource()
+    {
+        const auto subscribers = m_subscribers;
+
+        for (const auto &subscriber : subscribers)
+        {
+            QObject::disconnect(subscriber->written);
+            QObject::disconnect(subscriber->closed);
+
+            if (subscriber->socket)
+                subscriber->socket->disconnectFromHost();
+        }
+    }
+
+    //!
+    //! \brief EventSource::middleware
+    //! subscribe every request reaching it, mount it on events path
+    //!
+    inline Recurse::Final EventSource::middleware()
+    {
+        return [this](Context &ctx)
+        {
+            subscribe(ctx);
+        };
+    }
+
+    //!
+    //! \brief EventSource::subscribe
+    //! send response head and keep connection open for events,
+    //! status and headers already set on ctx.response are kept
+    //!
+    //! \param ctx request context
+    //!
+    inline void EventSource::subscribe(Context &ctx)
+    {
+        auto &request = ctx.request;
+        auto &response = ctx.response;
+        QTcpSocket *socket = request.socket;
+
+        if (response.sent || !socket || m_subscribers.contains(socket))
+            return;
+
+        response.method = request.method;
+        response.protocol = request.protocol;
+        response.sent = true;
+
+        // subscription outlives its request, it's not counted into request duration
+        response.upgraded = true;
+
+        // body is delimited by connection close, there is no chunk framing to copy events into
+        response.type("text/event-stream");
+        response.setHeader("cache-control", "no-cache");
+        response.setHeader("connection", "close");
+
+        socket->write(response.create_head());
+
+        if (m_retry > 0)
+            socket->write("retry: " + QByteArray::number(m_retry) + "\n\n");
+
+        auto subscriber = QSharedPointer<Subscriber>::create();
+        subscriber->socket = socket;
+        subscriber->slot = qHash(socket) % m_wheel.size();
+
+        m_subscribers.insert(socket, subscriber);
+        m_wheel[subscriber->slot].insert(socket);
+
+        subscriber->written = QObject::connect(socket, &QIODevice::bytesWritten, socket, [this, socket]
+        {
+            auto subscriber = m_subscribers.value(socket);
+            if (subscriber)
+                m_pump(*subscriber);
+        });
+
+        subscriber->closed = QObject::connect(socket, &QAbstractSocket::disconnected, socket, [this, socket]
+        {
+            m_remove(socket);
+        });
+    }
+
+    //!
+    //! \brief EventSource::broadcast
+    //! encode event once and queue it for all subscribers
+    //!
+    //! \param event event type, empty for default "message"
+    //! \param data event data, multiple lines are sent as multiple data fields
+    //! \param id optional event id, sent back by reconnecting client as Last-Event-ID header
+    //! \return number of subscribers event was queued for
+    //!
+    inline int EventSource::broadcast(const QString &event, const QByteArray &data, const QString &id)
+    {
+        QByteArray buffer = encode(event, data, id);
+
+        int queued = 0;
+        QVector<QPointer<QTcpSocket>> slow;
+
+        for (auto &subscriber : m_subscribers)
+        {
+            if (m_enqueue(*subscriber, buffer))
+                ++queued;
+            else
+                slow.push_back(subscriber->socket);
+        }
+
+        // dropped after loop, disconnecting removes them from subscribers
+        for (auto &socket : slow)
+        {
+            ++m_dropped;
+
+            if (socket)
+                socket->abort();
+        }
+
+        return queued;
+    }
+
+    //!
+    //! \brief EventSource::broadcast
+    //! overloaded function, broadcast data as default "message" event
+    //!
+    inline int EventSource::broadcast(const QByteArray &data)
+    {
+        return broadcast(QString(), data);
+    }
+
+    inline int EventSource::subscribers() const
+    {
+        return m_subscribers.size();
+    }
+
+    //!
+    //! \brief EventSource::dropped
+    //! \return number of subscribers dropped for being too slow
+    //!
+    inline quint64 EventSource::dropped() const
+    {
+        return m_dropped;
+    }
+
+    //!
+    //! \brief EventSource::encode
+    //! serialize event to text/event-stream format
+    //!
+    inline QByteArray EventSource::encode(const QString &event, const QByteArray &data, const QString &id)
+    {
+        QByteArray buffer;
+        buffer.reserve(data.size() + event.size() + id.size() + 32);
+
+        if (!id.isEmpty())
+            buffer += "id: " + id.toUtf8() + "\n";
+
+        if (!event.isEmpty())
+            buffer += "event: " + event.toUtf8() + "\n";
+
+        int start = 0;
+
+        while (true)
+        {
+            int end = data.indexOf('\n', start);
+
+            buffer += "data: ";
+            buffer.append(data.constData() + start, (end == -1 ? data.size() : end) - start);
+            buffer += '\n';
+
+            if (end == -1)
+                break;
+
+            start = end + 1;
+        }
+
+        buffer += '\n';
+
+        return buffer;
+    }
+
+    //!
+    //! \brief EventSource::m_enqueue
+    //! \return false if subscriber is too slow and should be dropped
+    //!
+    inline bool EventSource::m_enqueue(Subscriber &subscriber, const QByteArray &buffer)
+    {
+        if (subscriber.queued + buffer.size() > m_queue_size)
+            return false;
+
+        subscriber.queue.enqueue(buffer);
+        subscriber.queued += buffer.size();
+        subscriber.active = true;
+
+        m_pump(subscriber);
+
+        return true;
+    }
+
+    //!
+    //! \brief EventSource::m_pump
+    //! hand queued events over to socket while it is below watermark
+    //!
+    inline void EventSource::m_pump(Subscriber &subscriber)
+    {
+        if (!subscriber.socket)
+            return;
+
+        while (!subscriber.queue.isEmpty() && subscriber.socket->bytesToWrite() < m_watermark)
+        {
+            QByteArray buffer = subscriber.queue.dequeue();
+            subscriber.queued -= buffer.size();
+
+            subscriber.socket->write(buffer);
+        }
+    }
+
+    inline void EventSource::m_remove(QTcpSocket *socket)
+    {
+        auto subscriber = m_subscribers.take(socket);
+
+        if (subscriber)
+            m_wheel[subscriber->slot].remove(socket);
+    }
+
+    //!
+    //! \brief EventSource::m_heartbeats
+    //! timer wheel tick, subscribers of current slot get heartbeat unless they got event
+    //! since last turn
+    //!
+    inline void EventSource::m_heartbeats()
+    {
+        m_tick = (m_tick + 1) % m_wheel.size();
+
+        const auto sockets = m_wheel.at(m_tick);
+
+        for (auto socket : sockets)
+        {
+            auto subscriber = m_subscribers.value(socket);
+
+            if (!subscriber)
+                continue;
+
+            if (!subscriber->active && subscriber->queue.isEmpty())
+                m_enqueue(*subscriber, m_heartbeat);
+
+            subscriber->active = false;
+        }
+    }
+}
+
+#endif
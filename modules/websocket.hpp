@@ -0,0 +1,1123 @@
+#ifndef RECURSE_MODULE_WEBSOCKET_HPP
+#define RECURSE_MODULE_WEBSOCKET_HPP
+
+#include <QCryptographicHash>
+#include <QPointer>
+#include <QRegExp>
+#include <QSet>
+#include <QStringList>
+#include <QTimer>
+#include <cstring>
+
+#ifndef RECURSE_WEBSOCKET_NO_DEFLATE
+#include <zlib.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "../recurse.hpp"
+
+namespace Module
+{
+
+    //!
+    //! \brief The WebSocket class
+    //! WebSocket (RFC 6455) upgrade for HTTP and HTTPS connections
+    //!
+    //! middleware() answers upgrade requests on matching path with 101 Switching Protocols and
+    //! hands connection over to on_open, other requests are passed to next middleware.
+    //! Fragmented messages are reassembled, ping/pong keepalive runs on one timer shared by
+    //! all connections and permessage-deflate (RFC 7692) is negotiated when client offers it.
+    //!
+    //! Connection lives as long as its socket, so Context (and anything bound to ctx.scope())
+    //! stays valid until client goes away.
+    //!
+    //! permessage-deflate needs zlib (LIBS += -lz), define RECURSE_WEBSOCKET_NO_DEFLATE to
+    //! build without it.
+    //!
+    //!     Module::WebSocket ws({{ "ping_interval", 20000 }});
+    //!
+    //!     app.use(ws.middleware(QRegExp("^/live$"), [](auto *connection, auto &ctx)
+    //!     {
+    //!         connection->onMessage([connection](const QByteArray &data, bool binary)
+    //!         {
+    //!             connection->send(data, binary);
+    //!         });
+    //!     }));
+    //!
+    class WebSocket
+    {
+    public:
+        //!
+        //! \brief The Connection class
+        //! single upgraded connection, owned by its socket
+        //!
+        class Connection : public QObject
+        {
+        public:
+            using OnMessage = std::function<void(const QByteArray &data, bool binary)>;
+            using OnClose = std::function<void(quint16 code, const QString &reason)>;
+
+            ~Connection();
+
+            bool send(const QByteArray &data, bool binary = true);
+            bool sendText(const QString &text);
+            bool ping(const QByteArray &payload = QByteArray());
+            void close(quint16 code = 1000, const QString &reason = QString());
+
+            void onMessage(OnMessage f);
+            void onClose(OnClose f);
+
+            bool isOpen() const;
+            qint64 bytesToWrite() const;
+            QTcpSocket *socket() const;
+
+        private:
+            friend class WebSocket;
+
+            enum State
+            {
+                Open,
+                Closing,
+                Closed
+            };
+
+            Connection(WebSocket *owner, QTcpSocket *socket, bool deflate, int window_bits);
+
+            WebSocket *m_owner;
+            QPointer<QTcpSocket> m_socket;
+            State m_state = Open;
+            bool m_alive = true;
+
+            QByteArray m_buffer;
+            int m_offset = 0;
+
+            bool m_in_message = false;
+            bool m_binary = false;
+            bool m_compressed = false;
+            QByteArray m_message;
+
+            OnMessage m_on_message;
+            OnClose m_on_close;
+            bool m_close_reported = false;
+
+            bool m_deflate;
+            int m_window_bits;
+
+#ifndef RECURSE_WEBSOCKET_NO_DEFLATE
+            z_stream *m_deflater = nullptr;
+            z_stream *m_inflater = nullptr;
+
+            bool m_compress(const QByteArray &data, QByteArray &out);
+            bool m_decompress(const QByteArray &data, QByteArray &out);
+#endif
+
+            void m_read();
+            bool m_frame(bool fin, bool rsv1, int opcode, const char *payload, qint64 size);
+            void m_write_frame(bool fin, bool rsv1, int opcode, const char *data, qint64 size);
+            void m_fail(quint16 code);
+            void m_closed(quint16 code, const QString &reason);
+        };
+
+        using OnOpen = std::function<void(Connection *connection, Context &ctx)>;
+
+        WebSocket(const QHash<QString, QVariant> &options = QHash<QString, QVariant>());
+        ~WebSocket();
+
+        Recurse::Downstream middleware(const QRegExp &path, OnOpen on_open);
+        int connections() const;
+
+        static void unmask(char *data, qint64 size, quint32 key);
+        static bool isUtf8(const char *data, qint64 size);
+
+    private:
+        qint64 m_max_message_size;
+        qint64 m_fragment_size;
+        int m_deflate_threshold;
+        bool m_deflate;
+
+        QTimer m_ping_timer;
+        QSet<Connection *> m_connections;
+
+        bool m_handshake(Context &ctx, bool &deflate, int &window_bits);
+        void m_keepalive();
+    };
+
+    //!
+    //! \brief WebSocket::WebSocket
+    //! module has to outlive its connections, eg: it lives as long as the application
+    //!
+    //! \param options QHash options of <QString, QVariant>
+    //!     "max_message_size" maximum size of (reassembled, decompressed) message, 16MB by default
+    //!     "fragment_size" outgoing messages above this size are fragmented, 0 to never fragment (default)
+    //!     "ping_interval" milliseconds between pings, connection without any traffic for two
+    //!         intervals is dropped, 30000 by default, 0 to disable
+    //!     "deflate" negotiate permessage-deflate when offered, true by default
+    //!     "deflate_threshold" smaller outgoing messages are not compressed, 128 bytes by default
+    //!
+    inline WebSocket::WebSocket(const QHash<QString, QVariant> &options)
+    {
+        m_max_message_size = options.value("max_message_size", 16 * 1024 * 1024).toLongLong();
+        m_fragment_size = options.value("fragment_size", 0).toLongLong();
+        m_deflate_threshold = options.value("deflate_threshold", 128).toInt();
+
+#ifndef RECURSE_WEBSOCKET_NO_DEFLATE
+        m_deflate = options.value("deflate", true).toBool();
+#else
+        m_deflate = false;
+#endif
+
+        int ping_interval = options.value("ping_interval", 30000).toInt();
+
+        QObject::connect(&m_ping_timer, &QTimer::timeout, [this]
+        {
+            m_keepalive();
+        });
+
+        if (ping_interval > 0)
+            m_ping_timer.start(ping_interval);
+    }
+
+    inline WebSocket::~WebSocket()
+    {
+        for (auto connection : m_connections)
+            connection->m_owner = nullptr;
+    }
+
+    //!
+    //! \brief WebSocket::middleware
+    //! upgrade matching requests to WebSocket
+    //!
+    //! \param path regular expression matched against url path, eg: "^/live$"
+    //! \param on_open called once connection is upgraded, set message and close callbacks here
+    //!
+    inline Recurse::Downstream WebSocket::middleware(const QRegExp &path, OnOpen on_open)
+    {
+        return [this, path, on_open](Context &ctx, Recurse::Next next)
+        {
+            if (path.indexIn(ctx.request.url.path()) == -1
+                || !ctx.request.getHeader("upgrade").contains("websocket", Qt::CaseInsensitive))
+            {
+                next();
+                return;
+            }
+
+            bool deflate = false;
+            int window_bits = 15;
+
+            if (!m_handshake(ctx, deflate, window_bits))
+                return;
+
+            auto connection = new Connection(this, ctx.request.socket, deflate, window_bits);
+            m_connections.insert(connection);
+
+            on_open(connection, ctx);
+
+            // frames sent together with handshake
+            if (ctx.request.socket->bytesAvailable())
+                connection->m_read();
+        };
+    }
+
+    //!
+    //! \brief WebSocket::connections
+    //! \return number of open connections
+    //!
+    inline int WebSocket::connections() const
+    {
+        return m_connections.size();
+    }
+
+    //!
+    //! \brief WebSocket::m_handshake
+    //! validate upgrade request and answer it, bad requests get regular error response
+    //!
+    //! \return true if connection was upgraded
+    //!
+    inline bool WebSocket::m_handshake(Context &ctx, bool &deflate, int &window_bits)
+    {
+        auto &request = ctx.request;
+        auto &response = ctx.response;
+
+        QString key = request.getHeader("sec-websocket-key").trimmed();
+
+        if (request.method != "GET" || key.isEmpty()
+            || !request.getHeader("connection").contains("upgrade", Qt::CaseInsensitive))
+        {
+            response.status(400).send(response.http_codes.value(400));
+            return false;
+        }
+
+        if (request.getHeader("sec-websocket-version").trimmed() != "13")
+        {
+            response.setHeader("sec-websocket-version", "13");
+            response.status(426).send("Upgrade Required");
+            return false;
+        }
+
+        QByteArray accept = QCryptographicHash::hash(key.toLatin1() + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11",
+            QCryptographicHash::Sha1).toBase64();
+
+        QByteArray reply = "HTTP/1.1 101 Switching Protocols\r\n"
+                           "Upgrade: websocket\r\n"
+                           "Connection: Upgrade\r\n"
+                           "Sec-WebSocket-Accept: " + accept + "\r\n";
+
+        // permessage-deflate offers, first acceptable one wins
+        // eg: permessage-deflate; client_max_window_bits, permessage-deflate
+        if (m_deflate)
+        {
+            for (const auto &offer : request.getHeader("sec-websocket-extensions").split(","))
+            {
+                auto params = offer.split(";");
+
+                if (params.first().trimmed() != "permessage-deflate")
+                    continue;
+
+                bool acceptable = true;
+                window_bits = 15;
+
+                for (int i = 1; i < params.size(); ++i)
+                {
+                    QString param = params.at(i).trimmed();
+                    QString name = param.section('=', 0, 0).trimmed();
+                    QString value = param.section('=', 1).trimmed().remove('"');
+
+                    if (name == "server_max_window_bits")
+                    {
+                        // zlib can't do raw deflate with 8 bits window
+                        window_bits = value.toInt();
+                        acceptable = window_bits >= 9 && window_bits <= 15;
+                    }
+                    else if (name != "client_max_window_bits" && name != "server_no_context_takeover"
+                        && name != "client_no_context_takeover")
+                    {
+                        acceptable = false;
+                    }
+                }
+
+                if (!acceptable)
+                    continue;
+
+                // contexts are reset after each message, it keeps per connection state small
+                // and lets compressed messages be decoded independently
+                reply += "Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; "
+                         "client_no_context_takeover";
+
+                if (window_bits < 15)
+                    reply += "; server_max_window_bits=" + QByteArray::number(window_bits);
+
+                reply += "\r\n";
+
+                deflate = true;
+                break;
+            }
+        }
+
+        reply += "\r\n";
+
+        response.status(101);
+        response.sent = true;
+        response.upgraded = true;
+
+        request.socket->write(reply);
+
+        return true;
+    }
+
+    //!
+    //! \brief WebSocket::m_keepalive
+    //! called by shared ping timer, connections silent since last round are dropped,
+    //! others are pinged
+    //!
+    inline void WebSocket::m_keepalive()
+    {
+        for (auto connection : m_connections.values())
+        {
+            if (connection->m_state != Connection::Open)
+                continue;
+
+            if (!connection->m_alive)
+            {
+                if (connection->m_socket)
+                    connection->m_socket->abort();
+
+                continue;
+            }
+
+            connection->m_alive = false;
+            connection->ping();
+        }
+    }
+
+    //!
+    //! \brief WebSocket::unmask
+    //! XOR payload with masking key in place, 32 (AVX2) or 16 (SSE2) bytes at a time
+    //! with 8 bytes at a time fallback
+    //!
+    //! \param data payload
+    //! \param size payload size
+    //! \param key masking key, its 4 bytes in order they came in frame
+    //!
+    inline void WebSocket::unmask(char *data, qint64 size, quint32 key)
+    {
+        qint64 i = 0;
+
+#ifdef __AVX2__
+        const __m256i mask256 = _mm256_set1_epi32(int(key));
+
+        for (; i + 128 <= size; i += 128)
+        {
+            auto p = reinterpret_cast<__m256i *>(data + i);
+
+            _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), mask256));
+            _mm256_storeu_si256(p + 1, _mm256_xor_si256(_mm256_loadu_si256(p + 1), mask256));
+            _mm256_storeu_si256(p + 2, _mm256_xor_si256(_mm256_loadu_si256(p + 2), mask256));
+            _mm256_storeu_si256(p + 3, _mm256_xor_si256(_mm256_loadu_si256(p + 3), mask256));
+        }
+#endif
+
+#ifdef __SSE2__
+        const __m128i mask128 = _mm_set1_epi32(int(key));
+
+        for (; i + 64 <= size; i += 64)
+        {
+            auto p = reinterpret_cast<__m128i *>(data + i);
+
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask128));
+            _mm_storeu_si128(p + 1, _mm_xor_si128(_mm_loadu_si128(p + 1), mask128));
+            _mm_storeu_si128(p + 2, _mm_xor_si128(_mm_loadu_si128(p + 2), mask128));
+            _mm_storeu_si128(p + 3, _mm_xor_si128(_mm_loadu_si128(p + 3), mask128));
+        }
+
+        for (; i + 16 <= size; i += 16)
+        {
+            auto p = reinterpret_cast<__m128i *>(data + i);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask128));
+        }
+#endif
+
+        // key repeated twice, byte order in memory is the same on any endianness
+        const quint64 mask64 = (quint64(key) << 32) | key;
+
+        for (; i + 8 <= size; i += 8)
+        {
+            quint64 value;
+            std::memcpy(&value, data + i, 8);
+            value ^= mask64;
+            std::memcpy(data + i, &value, 8);
+        }
+
+        // i is multiple of 8 here, so key index is i & 3
+        const auto bytes = reinterpret_cast<const char *>(&key);
+
+        for (; i < size; ++i)
+            data[i] ^= bytes[i & 3];
+    }
+
+    //!
+    //! \brief WebSocket::isUtf8
+    //! validate text message, ASCII is skipped 8 bytes at a time
+    //!
+    inline bool WebSocket::isUtf8(const char *data, qint64 size)
+    {
+        auto p = reinterpret_cast<const uchar *>(data);
+        auto end = p + size;
+
+        while (p < end)
+        {
+            if (end - p >= 8)
+            {
+                quint64 value;
+                std::memcpy(&value, p, 8);
+
+                if (!(value & 0x8080808080808080ULL))
+                {
+                    p += 8;
+                    continue;
+                }
+            }
+
+            uchar c = *p;
+
+            if (c < 0x80)
+            {
+                ++p;
+                continue;
+            }
+
+            int length;
+            uint min;
+            uint code;
+
+            if ((c & 0xe0) == 0xc0)
+            {
+                length = 2;
+                min = 0x80;
+                code = c & 0x1f;
+            }
+            else if ((c & 0xf0) == 0xe0)
+            {
+                length = 3;
+                min = 0x800;
+                code = c & 0x0f;
+            }
+            else if ((c & 0xf8) == 0xf0)
+            {
+                length = 4;
+                min = 0x10000;
+                code = c & 0x07;
+            }
+            else
+            {
+                return false;
+            }
+
+            if (end - p < length)
+                return false;
+
+            for (int i = 1; i < length; ++i)
+            {
+                if ((p[i] & 0xc0) != 0x80)
+                    return false;
+
+                code = (code << 6) | (p[i] & 0x3f);
+            }
+
+            // overlong forms, surrogates and code points above unicode range
+            if (code < min || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff))
+                return false;
+
+            p += length;
+        }
+
+        return true;
+    }
+
+    inline WebSocket::Connection::Connection(WebSocket *owner, QTcpSocket *socket, bool deflate, int window_bits)
+        : QObject(socket),
+          m_owner(owner),
+          m_socket(socket),
+          m_deflate(deflate),
+          m_window_bits(window_bits)
+    {
+        connect(socket, &QIODevice::readyRead, this, [this]
+        {
+            m_read();
+        });
+
+        connect(socket, &QAbstractSocket::disconnected, this, [this]
+        {
+            m_state = Closed;
+            m_closed(1006, QString());
+        });
+    }
+
+    inline WebSocket::Connection::~Connection()
+    {
+        if (m_owner)
+            m_owner->m_connections.remove(this);
+
+#ifndef RECURSE_WEBSOCKET_NO_DEFLATE
+        if (m_deflater)
+        {
+            deflateEnd(m_deflater);
+            delete m_deflater;
+        }
+
+        if (m_inflater)
+        {
+            inflateEnd(m_inflater);
+            delete m_inflater;
+        }
+#endif
+    }
+
+    //!
+    //! \brief Connection::onMessage
+    //! \param f called with each complete message, text messages are valid UTF-8
+    //!
+    inline void WebSocket::Connection::onMessage(OnMessage f)
+    {
+        m_on_message = std::move(f);
+    }
+
+    //!
+    //! \brief Connection::onClose
+    //! \param f called once when connection is closed, code 1006 if client just went away
+    //!
+    inline void WebSocket::Connection::onClose(OnClose f)
+    {
+        m_on_close = std::move(f);
+    }
+
+    inline bool WebSocket::Connection::isOpen() const
+    {
+        return m_state == Open && m_socket && m_socket->state() == QAbstractSocket::ConnectedState;
+    }
+
+    //!
+    //! \brief Connection::bytesToWrite
+    //! \return bytes buffered for sending, use it to skip or drop messages for slow clients
+    //!
+    inline qint64 WebSocket::Connection::bytesToWrite() const
+    {
+        return m_socket ? m_socket->bytesToWrite() : 0;
+    }
+
+    inline QTcpSocket *WebSocket::Connection::socket() const
+    {
+        return m_socket.data();
+    }
+
+    //!
+    //! \brief Connection::send
+    //! send message, compressed if negotiated and message is large enough
+    //!
+    //! \param data message
+    //! \param binary binary (default) or text message, text has to be valid UTF-8
+    //! \return false if connection is not open
+    //!
+    inline bool WebSocket::Connection::send(const QByteArray &data, bool binary)
+    {
+        if (!isOpen())
+            return false;
+
+        int opcode = binary ? 0x2 : 0x1;
+        bool rsv1 = false;
+        QByteArray payload = data;
+
+#ifndef RECURSE_WEBSOCKET_NO_DEFLATE
+        QByteArray compressed;
+
+        if (m_deflate && m_owner && data.size() >= m_owner->m_deflate_threshold && m_compress(data, compressed))
+        {
+            payload = compressed;
+            rsv1 = true;
+        }
+#endif
+
+        qint64 fragment = m_owner ? m_owner->m_fragment_size : 0;
+
+        if (fragment <= 0 || payload.size() <= fragment)
+        {
+            m_write_frame(true, rsv1, opcode, payload.constData(), payload.size());
+            return true;
+        }
+
+        for (qint64 i = 0; i < payload.size(); i += fragment)
+        {
+            qint64 size = qMin(fragment, payload.size() - i);
+            bool first = i == 0;
+
+            m_write_frame(i + size >= payload.size(), first && rsv1, first ? opcode : 0x0, payload.constData() + i, size);
+        }
+
+        return true;
+    }
+
+    inline bool WebSocket::Connection::sendText(const QString &text)
+    {
+        return send(text.toUtf8(), false);
+    }
+
+    //!
+    //! \brief Connection::ping
+    //! \param payload optional, up to 125 bytes
+    //!
+    inline bool WebSocket::Connection::ping(const QByteArray &payload)
+    {
+        if (!isOpen())
+            return false;
+
+        m_write_frame(true, false, 0x9, payload.constData(), qMin(payload.size(), 125));
+        return true;
+    }
+
+    //!
+    //! \brief Connection::close
+    //! start closing handshake, socket is closed once client answers or after 5 seconds
+    //!
+    //! \param code status code, 1000 for normal closure
+    //! \param reason optional, up to 123 bytes of UTF-8
+    //!
+    inline void WebSocket::Connection::close(quint16 code, const QString &reason)
+    {
+        if (!isOpen())
+            return;
+
+        QByteArray payload;
+        payload.append(char(code >> 8));
+        payload.append(char(code & 0xff));
+        payload.append(reason.toUtf8().left(123));
+
+        m_write_frame(true, false, 0x8, payload.constData(), payload.size());
+        m_state = Closing;
+
+        QTimer::singleShot(5000, this, [this]
+        {
+            if (m_socket)
+                m_socket->abort();
+        });
+    }
+
+    //!
+    //! \brief Connection::m_read
+    //! parse all complete frames in buffer, payloads are unmasked in place
+    //!
+    inline void WebSocket::Connection::m_read()
+    {
+        if (!m_socket)
+            return;
+
+        m_buffer += m_socket->readAll();
+        m_alive = true;
+
+        qint64 max = m_owner ? m_owner->m_max_message_size : 16 * 1024 * 1024;
+
+        while (m_state != Closed)
+        {
+            auto p = reinterpret_cast<const uchar *>(m_buffer.constData()) + m_offset;
+            qint64 available = m_buffer.size() - m_offset;
+
+            if (available < 2)
+                break;
+
+            bool fin = p[0] & 0x80;
+            bool rsv1 = p[0] & 0x40;
+            int opcode = p[0] & 0x0f;
+            bool masked = p[1] & 0x80;
+            quint64 size = p[1] & 0x7f;
+            int header = 2;
+
+            if (size == 126)
+            {
+                if (available < 4)
+                    break;
+
+                size = (quint64(p[2]) << 8) | p[3];
+                header = 4;
+            }
+            else if (size == 127)
+            {
+                if (available < 10)
+                    break;
+
+                size = 0;
+                for (int i = 2; i < 10; ++i)
+                    size = (size << 8) | p[i];
+
+                header = 10;
+            }
+
+            // client frames have to be masked, extensions other than deflate are not negotiated
+            if (!masked || (p[0] & 0x30) || (rsv1 && !(m_deflate && (opcode == 0x1 || opcode == 0x2))))
+            {
+                m_fail(1002);
+                return;
+            }
+
+            if (size > quint64(max))
+            {
+                m_fail(1009);
+                return;
+            }
+
+            header += 4;
+
+            if (available < header + qint64(size))
+                break;
+
+            quint32 key;
+            std::memcpy(&key, p + header - 4, 4);
+
+            char *payload = m_buffer.data() + m_offset + header;
+            unmask(payload, qint64(size), key);
+
+            m_offset += header + int(size);
+
+            if (!m_frame(fin, rsv1, opcode, payload, qint64(size)))
+                return;
+        }
+
+        // drop consumed data, partial frame is kept
+        if (m_offset == m_buffer.size())
+        {
+            m_buffer.clear();
+            m_offset = 0;
+        }
+        else if (m_offset > 64 * 1024)
+        {
+            m_buffer.remove(0, m_offset);
+            m_offset = 0;
+        }
+    }
+
+    //!
+    //! \brief Connection::m_frame
+    //! handle one unmasked frame
+    //!
+    //! \return false if connection was failed or closed
+    //!
+    inline bool WebSocket::Connection::m_frame(bool fin, bool rsv1, int opcode, const char *payload, qint64 size)
+    {
+        // control frames, can be interleaved with fragments of data message
+        if (opcode >= 0x8)
+        {
+            if (!fin || size > 125)
+            {
+                m_fail(1002);
+                return false;
+            }
+
+            switch (opcode)
+            {
+                case 0x8:
+                {
+                    quint16 code = 1005;
+                    QString reason;
+
+                    // body is either empty or code followed by UTF-8 reason
+                    if (size == 1)
+                    {
+                        m_fail(1002);
+                        return false;
+                    }
+
+                    if (size >= 2)
+                    {
+                        code = quint16((uchar(payload[0]) << 8) | uchar(payload[1]));
+
+                        // 1004-1006 and 1015 are never sent, others below 3000 are not assigned
+                        bool valid = (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014)
+                            || (code >= 3000 && code <= 4999);
+
+                        if (!valid)
+                        {
+                            m_fail(1002);
+                            return false;
+                        }
+
+                        if (!isUtf8(payload + 2, size - 2))
+                        {
+                            m_fail(1007);
+                            return false;
+                        }
+
+                        reason = QString::fromUtf8(payload + 2, int(size - 2));
+                    }
+
+                    // answer closing handshake started by client
+                    if (m_state == Open)
+                        m_write_frame(true, false, 0x8, payload, qMin<qint64>(size, 2));
+
+                    m_state = Closed;
+                    m_closed(code, reason);
+
+                    if (m_socket)
+                        m_socket->disconnectFromHost();
+
+                    return false;
+                }
+                case 0x9:
+                    if (m_state == Open)
+                        m_write_frame(true, false, 0xA, payload, size);
+                    return true;
+                case 0xA:
+                    return true;
+                default:
+                    m_fail(1002);
+                    return false;
+            }
+        }
+
+        if (opcode == 0x0)
+        {
+            if (!m_in_message)
+            {
+                m_fail(1002);
+                return false;
+            }
+
+            m_message.append(payload, int(size));
+        }
+        else if (opcode == 0x1 || opcode == 0x2)
+        {
+            if (m_in_message)
+            {
+                m_fail(1002);
+                return false;
+            }
+
+            m_in_message = true;
+            m_binary = opcode == 0x2;
+            m_compressed = rsv1;
+            m_message = QByteArray(payload, int(size));
+        }
+        else
+        {
+            m_fail(1002);
+            return false;
+        }
+
+        qint64 max = m_owner ? m_owner->m_max_message_size : 16 * 1024 * 1024;
+
+        if (m_message.size() > max)
+        {
+            m_fail(1009);
+            return false;
+        }
+
+        if (!fin)
+            return true;
+
+        m_in_message = false;
+
+        QByteArray message;
+        message.swap(m_message);
+
+#ifndef RECURSE_WEBSOCKET_NO_DEFLATE
+        if (m_compressed)
+        {
+            QByteArray decompressed;
+
+            if (!m_decompress(message, decompressed))
+                return false;
+
+            message.swap(decompressed);
+        }
+#endif
+
+        if (!m_binary && !isUtf8(message.constData(), message.size()))
+        {
+            m_fail(1007);
+            return false;
+        }
+
+        if (m_on_message && m_state == Open)
+            m_on_message(message, m_binary);
+
+        return m_state != Closed;
+    }
+
+    //!
+    //! \brief Connection::m_write_frame
+    //! write unmasked server frame
+    //!
+    inline void WebSocket::Connection::m_write_frame(bool fin, bool rsv1, int opcode, const char *data, qint64 size)
+    {
+        if (!m_socket)
+            return;
+
+        char header[10];
+        int length;
+
+        header[0] = char((fin ? 0x80 : 0) | (rsv1 ? 0x40 : 0) | opcode);
+
+        if (size < 126)
+        {
+            header[1] = char(size);
+            length = 2;
+        }
+        else if (size < 65536)
+        {
+            header[1] = 126;
+            header[2] = char(size >> 8);
+            header[3] = char(size & 0xff);
+            length = 4;
+        }
+        else
+        {
+            header[1] = 127;
+            for (int i = 0; i < 8; ++i)
+                header[2 + i] = char((quint64(size) >> (56 - i * 8)) & 0xff);
+            length = 10;
+        }
+
+        m_socket->write(header, length);
+
+        if (size)
+            m_socket->write(data, size);
+    }
+
+    //!
+    //! \brief Connection::m_fail
+    //! protocol error, send close frame with status code and drop connection
+    //!
+    inline void WebSocket::Connection::m_fail(quint16 code)
+    {
+        if (m_state == Open)
+        {
+            char payload[2] = { char(code >> 8), char(code & 0xff) };
+            m_write_frame(true, false, 0x8, payload, 2);
+        }
+
+        m_state = Closed;
+        m_buffer.clear();
+        m_offset = 0;
+        m_message.clear();
+
+        m_closed(code, QString());
+
+        if (m_socket)
+            m_socket->disconnectFromHost();
+    }
+
+    //!
+    //! \brief Connection::m_closed
+    //! report close once
+    //!
+    inline void WebSocket::Connection::m_closed(quint16 code, const QString &reason)
+    {
+        if (m_close_reported)
+            return;
+
+        m_close_reported = true;
+
+        if (m_on_close)
+            m_on_close(code, reason);
+    }
+
+#ifndef RECURSE_WEBSOCKET_NO_DEFLATE
+    //!
+    //! \brief Connection::m_compress
+    //! raw deflate of whole message, trailing empty block (00 00 ff ff) is removed as RFC 7692 says
+    //!
+    inline bool WebSocket::Connection::m_compress(const QByteArray &data, QByteArray &out)
+    {
+        if (!m_deflater)
+        {
+            m_deflater = new z_stream;
+            std::memset(m_deflater, 0, sizeof(z_stream));
+
+            if (deflateInit2(m_deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -m_window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                delete m_deflater;
+                m_deflater = nullptr;
+                m_deflate = false;
+                return false;
+            }
+        }
+
+        z_stream &z = *m_deflater;
+
+        out.resize(int(deflateBound(&z, uLong(data.size()))) + 16);
+
+        z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.constData()));
+        z.avail_in = uInt(data.size());
+
+        int written = 0;
+
+        do
+        {
+            if (written == out.size())
+                out.resize(out.size() * 2);
+
+            z.next_out = reinterpret_cast<Bytef *>(out.data() + written);
+            z.avail_out = uInt(out.size() - written);
+
+            if (deflate(&z, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+            {
+                deflateReset(&z);
+                return false;
+            }
+
+            written = out.size() - int(z.avail_out);
+        } while (z.avail_out == 0);
+
+        deflateReset(&z);
+
+        out.resize(written);
+
+        if (out.endsWith(QByteArray("\x00\x00\xff\xff", 4)))
+            out.chop(4);
+
+        return true;
+    }
+
+    //!
+    //! \brief Connection::m_decompress
+    //! inflate whole message, output is limited by max_message_size
+    //!
+    inline bool WebSocket::Connection::m_decompress(const QByteArray &data, QByteArray &out)
+    {
+        if (!m_inflater)
+        {
+            m_inflater = new z_stream;
+            std::memset(m_inflater, 0, sizeof(z_stream));
+
+            // 15 bits window decodes any window size client used
+            if (inflateInit2(m_inflater, -15) != Z_OK)
+            {
+                delete m_inflater;
+                m_inflater = nullptr;
+                m_fail(1011);
+                return false;
+            }
+        }
+
+        z_stream &z = *m_inflater;
+        qint64 max = m_owner ? m_owner->m_max_message_size : 16 * 1024 * 1024;
+
+        QByteArray input = data + QByteArray("\x00\x00\xff\xff", 4);
+
+        z.next_in = reinterpret_cast<Bytef *>(input.data());
+        z.avail_in = uInt(input.size());
+
+        out.resize(qMax(1024, input.size() * 4));
+        int written = 0;
+        int result;
+
+        do
+        {
+            if (written == out.size())
+            {
+                if (out.size() >= max)
+                {
+                    inflateReset(&z);
+                    m_fail(1009);
+                    return false;
+                }
+
+                out.resize(int(qMin<qint64>(out.size() * 2, max + 1)));
+            }
+
+            z.next_out = reinterpret_cast<Bytef *>(out.data() + written);
+            z.avail_out = uInt(out.size() - written);
+
+            result = inflate(&z, Z_SYNC_FLUSH);
+            written = out.size() - int(z.avail_out);
+
+            if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+            {
+                inflateReset(&z);
+                m_fail(1007);
+                return false;
+            }
+
+            // final block or no progress possible, rest of input is ignored
+            if (result == Z_STREAM_END || (result == Z_BUF_ERROR && z.avail_out > 0))
+                break;
+        } while (z.avail_in > 0 || z.avail_out == 0);
+
+        inflateReset(&z);
+
+        if (written > max)
+        {
+            m_fail(1009);
+            return false;
+        }
+
+        out.resize(written);
+        return true;
+    }
+#endif
+}
+
+#endif
@@ -0,0 +1,522 @@
+#ifndef RECURSE_PROFILER_HPP
+#define RECURSE_PROFILER_HPP
+
+#include <QDeadlineTimer>
+#include <QHash>
+#include <QSharedPointer>
+#include <QString>
+#include <QStringBuilder>
+#include <QVarLengthArray>
+#include <QVariant>
+#include <QVector>
+#include <QtAlgorithms>
+
+#ifdef Q_OS_UNIX
+#include <time.h>
+#endif
+
+#ifdef RECURSE_PROFILE_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+#endif
+
+namespace Recurse
+{
+
+    //!
+    //! \brief The Profile class
+    //! Per-middleware costs of single request
+    //!
+    //! Middlewares run nested in each other (next() calls following middleware right away),
+    //! so profile keeps stack of running middlewares and every cost is charged to the one on
+    //! top. Each middleware gets its own (self) downstream and upstream time only.
+    //!
+    class Profile
+    {
+    public:
+        struct Cost
+        {
+            qint64 wall = 0;
+            qint64 cpu = 0;
+            quint64 allocations = 0;
+        };
+
+        struct Entry
+        {
+            Cost downstream;
+            Cost upstream;
+        };
+
+        void enter(int index, bool upstream);
+        bool leave();
+        void update();
+
+        const QVector<Entry> &entries() const;
+
+        //!
+        //! \brief finished
+        //! costs were already added to profiler histograms
+        //!
+        bool finished = false;
+
+        static qint64 cpuTime();
+        static quint64 &allocations();
+
+    private:
+        struct Frame
+        {
+            int index;
+            bool upstream;
+        };
+
+        QVarLengthArray<Frame, 32> m_stack;
+        QVector<Entry> m_entries;
+
+        qint64 m_wall = 0;
+        qint64 m_cpu = 0;
+        quint64 m_allocations = 0;
+    };
+
+    //!
+    //! \brief Profile::enter
+    //! middleware starts running, time since last change belongs to the one it runs in
+    //!
+    //! \param index middleware index
+    //! \param upstream true for upstream part of middleware
+    //!
+    inline void Profile::enter(int index, bool upstream)
+    {
+        update();
+        m_stack.append({ index, upstream });
+    }
+
+    //!
+    //! \brief Profile::leave
+    //! middleware returned
+    //!
+    //! \return true once no middleware is running anymore
+    //!
+    inline bool Profile::leave()
+    {
+        update();
+
+        if (!m_stack.isEmpty())
+            m_stack.removeLast();
+
+        return m_stack.isEmpty();
+    }
+
+    //!
+    //! \brief Profile::update
+    //! charge costs since last change to running middleware
+    //!
+    inline void Profile::update()
+    {
+        qint64 wall = QDeadlineTimer::current().deadlineNSecs();
+        qint64 cpu = cpuTime();
+        quint64 allocations = Profile::allocations();
+
+        if (!m_stack.isEmpty())
+        {
+            const Frame &frame = m_stack.last();
+
+            if (m_entries.size() <= frame.index)
+                m_entries.resize(frame.index + 1);
+
+            Entry &entry = m_entries[frame.index];
+            Cost &cost = frame.upstream ? entry.upstream : entry.downstream;
+
+            cost.wall += wall - m_wall;
+            cost.cpu += cpu - m_cpu;
+            cost.allocations += allocations - m_allocations;
+        }
+
+        m_wall = wall;
+        m_cpu = cpu;
+        m_allocations = allocations;
+    }
+
+    inline const QVector<Profile::Entry> &Profile::entries() const
+    {
+        return m_entries;
+    }
+
+    //!
+    //! \brief Profile::cpuTime
+    //! \return CPU time of current thread in nanoseconds, 0 where it is not available
+    //!
+    inline qint64 Profile::cpuTime()
+    {
+#ifdef Q_OS_UNIX
+        timespec ts;
+
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+            return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+        return 0;
+    }
+
+    //!
+    //! \brief Profile::allocations
+    //! number of heap allocations made by current thread, counted only when
+    //! RECURSE_PROFILE_ALLOCATIONS is defined (see bottom of this file)
+    //!
+    inline quint64 &Profile::allocations()
+    {
+        thread_local quint64 count = 0;
+        return count;
+    }
+
+    //!
+    //! \brief The Profiler class
+    //! Opt-in per-middleware profiling, see Application::profile()
+    //!
+    //! Sampled requests record wall time, thread CPU time and heap allocations of every
+    //! middleware, separately for downstream and upstream part. Costs are aggregated into
+    //! histograms per middleware index, named with Application::named(). Results are available
+    //! as text report and in Server-Timing header of sampled responses.
+    //!
+    //!     app.profile({{ "sample", 100 }});
+    //!
+    //!     app.use(auth);
+    //!     app.named("auth");
+    //!
+    //!     std::cout << app.profiler().report().toStdString();
+    //!
+    class Profiler
+    {
+    public:
+        void enable(const QHash<QString, QVariant> &options);
+        bool isEnabled() const;
+
+        QSharedPointer<Profile> start();
+        void leave(Profile &profile, bool sent);
+
+        void name(int index, const QString &name);
+        QString name(int index) const;
+
+        bool serverTiming() const;
+        QString serverTiming(Profile &profile) const;
+
+        QString report() const;
+        void reset();
+
+    private:
+        //!
+        //! \brief The Distribution struct
+        //! log-linear histogram, four buckets per power of two (at most 25% error)
+        //!
+        struct Distribution
+        {
+            quint64 buckets[248] = {};
+            quint64 count = 0;
+
+            void record(qint64 value);
+            qint64 percentile(double q) const;
+        };
+
+        struct Stats
+        {
+            Distribution downstream;
+            Distribution upstream;
+            Distribution cpu;
+            quint64 allocations = 0;
+        };
+
+        bool m_enabled = false;
+        bool m_server_timing = true;
+        int m_sample = 1;
+        quint64 m_counter = 0;
+        quint64 m_requests = 0;
+
+        QVector<QSharedPointer<Stats>> m_stats;
+        QHash<int, QString> m_names;
+
+        void m_finish(const Profile &profile);
+    };
+
+    //!
+    //! \brief Profiler::enable
+    //!
+    //! \param options QHash options of <QString, QVariant>
+    //!     "sample" profile every n-th request, 1 by default (every request)
+    //!     "server_timing" add Server-Timing header to profiled responses, true by default
+    //!
+    inline void Profiler::enable(const QHash<QString, QVariant> &options)
+    {
+        m_sample = qMax(1, options.value("sample", 1).toInt());
+        m_server_timing = options.value("server_timing", true).toBool();
+        m_enabled = true;
+    }
+
+    inline bool Profiler::isEnabled() const
+    {
+        return m_enabled;
+    }
+
+    //!
+    //! \brief Profiler::start
+    //! \return profile for new request, null if request is not sampled
+    //!
+    inline QSharedPointer<Profile> Profiler::start()
+    {
+        if (!m_enabled || m_counter++ % m_sample)
+            return QSharedPointer<Profile>();
+
+        return QSharedPointer<Profile>::create();
+    }
+
+    //!
+    //! \brief Profiler::leave
+    //! middleware of profiled request returned, costs are recorded once response is sent
+    //! and no middleware is running
+    //!
+    //! \param profile
+    //! \param sent response was already handed over to client
+    //!
+    inline void Profiler::leave(Profile &profile, bool sent)
+    {
+        if (profile.leave() && sent && !profile.finished)
+        {
+            profile.finished = true;
+            m_finish(profile);
+        }
+    }
+
+    //!
+    //! \brief Profiler::name
+    //! set middleware name used in report and Server-Timing header
+    //!
+    inline void Profiler::name(int index, const QString &name)
+    {
+        m_names[index] = name;
+    }
+
+    //!
+    //! \brief Profiler::name
+    //! \return middleware name, "mw<index>" if it was not named
+    //!
+    inline QString Profiler::name(int index) const
+    {
+        return m_names.value(index, "mw" + QString::number(index));
+    }
+
+    inline bool Profiler::serverTiming() const
+    {
+        return m_server_timing;
+    }
+
+    //!
+    //! \brief Profiler::serverTiming
+    //! Server-Timing header value, eg: "auth;dur=0.412, router;dur=1.030"
+    //! upstream parts still running are included up to now
+    //!
+    inline QString Profiler::serverTiming(Profile &profile) const
+    {
+        profile.update();
+
+        QString value;
+        const auto &entries = profile.entries();
+
+        for (int i = 0; i < entries.size(); ++i)
+        {
+            qint64 wall = entries.at(i).downstream.wall + entries.at(i).upstream.wall;
+
+            if (!wall)
+                continue;
+
+            // metric names are tokens
+            QString metric = name(i);
+            for (auto &c : metric)
+            {
+                if (!c.isLetterOrNumber() && c != '-' && c != '_' && c != '.')
+                    c = '_';
+            }
+
+            if (!value.isEmpty())
+                value += ", ";
+
+            value += metric % ";dur=" % QString::number(wall / 1e6, 'f', 3);
+        }
+
+        return value;
+    }
+
+    //!
+    //! \brief Profiler::report
+    //! text table of per-middleware percentiles, times in milliseconds
+    //!
+    inline QString Profiler::report() const
+    {
+        QString report = QString("profiled requests: %1\n").arg(m_requests);
+
+        report += QString("%1 %2 %3 %4 %5 %6 %7 %8\n")
+            .arg("middleware", -20)
+            .arg("down p50", 10).arg("down p99", 10)
+            .arg("up p50", 10).arg("up p99", 10)
+            .arg("cpu p50", 10).arg("cpu p99", 10)
+            .arg("allocs/req", 11);
+
+        auto ms = [](qint64 ns)
+        {
+            return QString::number(ns / 1e6, 'f', 3);
+        };
+
+        for (int i = 0; i < m_stats.size(); ++i)
+        {
+            const auto &stats = m_stats.at(i);
+
+            if (!stats)
+                continue;
+
+            report += QString("%1 %2 %3 %4 %5 %6 %7 %8\n")
+                .arg(name(i), -20)
+                .arg(ms(stats->downstream.percentile(0.5)), 10)
+                .arg(ms(stats->downstream.percentile(0.99)), 10)
+                .arg(ms(stats->upstream.percentile(0.5)), 10)
+                .arg(ms(stats->upstream.percentile(0.99)), 10)
+                .arg(ms(stats->cpu.percentile(0.5)), 10)
+                .arg(ms(stats->cpu.percentile(0.99)), 10)
+                .arg(QString::number(m_requests ? double(stats->allocations) / m_requests : 0, 'f', 1), 11);
+        }
+
+        return report;
+    }
+
+    //!
+    //! \brief Profiler::reset
+    //! drop recorded histograms, names are kept
+    //!
+    inline void Profiler::reset()
+    {
+        m_stats.clear();
+        m_requests = 0;
+    }
+
+    inline void Profiler::m_finish(const Profile &profile)
+    {
+        const auto &entries = profile.entries();
+
+        if (m_stats.size() < entries.size())
+            m_stats.resize(entries.size());
+
+        for (int i = 0; i < entries.size(); ++i)
+        {
+            const auto &entry = entries.at(i);
+
+            if (!m_stats.at(i))
+                m_stats[i] = QSharedPointer<Stats>::create();
+
+            auto &stats = *m_stats[i];
+
+            stats.downstream.record(entry.downstream.wall);
+            stats.upstream.record(entry.upstream.wall);
+            stats.cpu.record(entry.downstream.cpu + entry.upstream.cpu);
+            stats.allocations += entry.downstream.allocations + entry.upstream.allocations;
+        }
+
+        ++m_requests;
+    }
+
+    inline void Profiler::Distribution::record(qint64 value)
+    {
+        quint64 v = quint64(qMax<qint64>(0, value));
+        int index = int(v);
+
+        if (v >= 4)
+        {
+            int msb = 63 - qCountLeadingZeroBits(v);
+            index = qMin(247, 4 + (msb - 2) * 4 + int((v >> (msb - 2)) & 3));
+        }
+
+        ++buckets[index];
+        ++count;
+    }
+
+    //!
+    //! \brief Profiler::Distribution::percentile
+    //! \return upper bound of bucket holding q-th value
+    //!
+    inline qint64 Profiler::Distribution::percentile(double q) const
+    {
+        if (!count)
+            return 0;
+
+        quint64 rank = qMax<quint64>(1, quint64(q * count + 0.5));
+        quint64 seen = 0;
+
+        for (int index = 0; index < 248; ++index)
+        {
+            seen += buckets[index];
+
+            if (seen < rank)
+                continue;
+
+            if (index < 4)
+                return index;
+
+            int shift = (index - 4) / 4;
+            return qint64((quint64(5 + (index - 4) % 4) << shift) - 1);
+        }
+
+        return 0;
+    }
+}
+
+#ifdef RECURSE_PROFILE_ALLOCATIONS
+//
+// allocation counting hook, define RECURSE_PROFILE_ALLOCATIONS in exactly one translation unit
+// of the program
+//
+// with glibc malloc, calloc and realloc are replaced, Qt containers (QString, QByteArray,
+// QHash nodes) allocate with them and operator new ends there too. Elsewhere only global
+// operator new is replaced and allocations of Qt containers are not counted
+//
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(std::size_t size);
+void *__libc_calloc(std::size_t count, std::size_t size);
+void *__libc_realloc(void *p, std::size_t size);
+
+void *malloc(std::size_t size)
+{
+    ++Recurse::Profile::allocations();
+    return __libc_malloc(size);
+}
+
+void *calloc(std::size_t count, std::size_t size)
+{
+    ++Recurse::Profile::allocations();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, std::size_t size)
+{
+    ++Recurse::Profile::allocations();
+    return __libc_realloc(p, size);
+}
+}
+#else
+void *operator new(std::size_t size)
+{
+    ++Recurse::Profile::allocations();
+
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+#endif
+#endif
+
+#endif
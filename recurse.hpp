@@ -2,11 +2,13 @@
 #define RECURSE_HPP
 
 #include <QCoreApplication>
+#include <QEventLoop>
 #include <QFile>
 #include <QHostAddress>
 #include <QObject>
 #include <QPointer>
 #include <QProcessEnvironment>
+#include <QScopedPointer>
 #include <QSslCertificate>
 #include <QSslConfiguration>
 #include <QSslKey>
@@ -14,6 +16,7 @@
 #include <QStringBuilder>
 #include <QTcpServer>
 #include <QTcpSocket>
+#include <QTimer>
 #include <QVector>
 #include <functional>
 #include <iostream>
@@ -21,6 +24,13 @@
 #include "request.hpp"
 #include "response.hpp"
 #include "context.hpp"
+#include "executor.hpp"
+#include "stream.hpp"
+#include "writer.hpp"
+#include "metrics.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+#include "watchdog.hpp"
 
 namespace Recurse
 {
@@ -82,6 +92,7 @@ namespace Recurse
         Q_DISABLE_COPY(SslTcpServer)
 
         typedef void (QSslSocket::*RSslErrors)(const QList<QSslError> &);
+        typedef void (QAbstractSocket::*RSocketError)(QAbstractSocket::SocketError);
 
     public:
         SslTcpServer(QObject *parent = NULL);
@@ -93,6 +104,7 @@ namespace Recurse
         Q_SIGNALS : void connectionEncrypted();
         void sslErrors(const QList<QSslError> &errors);
         void peerVerifyError(const QSslError &error);
+        void handshakeFailed();
 
     protected:
         //!
@@ -100,14 +112,24 @@ namespace Recurse
         //!
         virtual void incomingConnection(qintptr socket_descriptor)
         {
+            RECURSE_PROBE1(accept, socket_descriptor);
+
             auto socket = new QSslSocket();
 
+            // handshake time is part of connection in trace
+            socket->setProperty("recurse_accepted", Tracer::now());
+
             socket->setSslConfiguration(m_ssl_configuration);
             socket->setSocketDescriptor(socket_descriptor);
 
             connect(socket, &QSslSocket::encrypted, this, &SslTcpServer::connectionEncrypted);
             connect(socket, static_cast<RSslErrors>(&QSslSocket::sslErrors), this, &SslTcpServer::sslErrors);
             connect(socket, &QSslSocket::peerVerifyError, this, &SslTcpServer::peerVerifyError);
+            connect(socket, static_cast<RSocketError>(&QAbstractSocket::error), this, [this](QAbstractSocket::SocketError error)
+            {
+                if (error == QAbstractSocket::SslHandshakeFailedError)
+                    emit handshakeFailed();
+            });
 
             addPendingConnection(socket);
             socket->startServerEncryption();
@@ -164,6 +186,7 @@ namespace Recurse
 
     signals:
         void socketReady(QTcpSocket *socket);
+        void socketRejected();
     };
 
     inline HttpServer::HttpServer(QObject *parent)
@@ -203,15 +226,21 @@ namespace Recurse
                 // FIXME: send signal instead of only setting an error and
                 // erroneously (?) returning
                 ret.setErrorCode(101);
+                emit socketRejected();
                 return ret;
             }
 
+            RECURSE_PROBE1(accept, socket->socketDescriptor());
+
             emit socketReady(socket);
 
             ret.setErrorCode(0);
             return ret;
         });
 
+        // eg: out of file descriptors
+        connect(&m_tcp_server, &QTcpServer::acceptError, this, &HttpServer::socketRejected);
+
         ret.setErrorCode(0);
         return ret;
     }
@@ -239,6 +268,8 @@ namespace Recurse
 
     signals:
         void socketReady(QTcpSocket *socket);
+        void socketRejected();
+        void handshakeFailed();
     };
 
     inline HttpsServer::HttpsServer(QObject *parent)
@@ -279,15 +310,21 @@ namespace Recurse
                 delete socket;
                 // FIXME: send signal instead of throwing
                 ret.setErrorCode(101);
+                emit socketRejected();
                 return ret;
             }
 
+            RECURSE_PROBE1(tls_done, socket->socketDescriptor());
+
             emit socketReady(socket);
 
             ret.setErrorCode(0);
             return ret;
         });
 
+        connect(&m_tcp_server, &QTcpServer::acceptError, this, &HttpsServer::socketRejected);
+        connect(&m_tcp_server, &SslTcpServer::handshakeFailed, this, &HttpsServer::handshakeFailed);
+
         ret.setErrorCode(0);
         return ret;
     }
@@ -401,6 +438,37 @@ namespace Recurse
         void use(DownstreamUpstream next);
         void use(Final next);
 
+        void dispatch(QSharedPointer<Context> ctx, std::function<void(Context &ctx)> done);
+
+        void inject(const QByteArray &request, std::function<void(const QByteArray &reply)> done);
+        QByteArray inject(const QByteArray &request);
+        QHash<QString, QVariant> inject(const QVector<QByteArray> &requests, quint64 count,
+            std::function<void(const QByteArray &reply)> done = nullptr);
+
+        Executor &executor();
+        Metrics &metrics();
+        Application &metricsPath(const QString &path);
+
+        Application &profile(const QHash<QString, QVariant> &options = QHash<QString, QVariant>());
+        Application &named(const QString &name);
+        Profiler &profiler();
+
+        Application &trace(int capacity = 65536);
+        Tracer &tracer();
+
+        Application &watch(const QHash<QString, QVariant> &options = QHash<QString, QVariant>());
+        Watchdog *watchdog();
+
+        Application &timeout(qint64 msec);
+        Application &timeout(const QRegExp &path, qint64 msec);
+        Application &timeoutHeader(const QString &header);
+
+        Application &onHeaders(std::function<void(Context &ctx)> f);
+
+        Application &staticResponse(const QString &method, const QString &path, quint16 status,
+            const QHash<QString, QString> &headers = QHash<QString, QString>(),
+            const QByteArray &body = QByteArray());
+
     public slots:
         bool handleConnection(QTcpSocket *socket);
 
@@ -410,6 +478,25 @@ namespace Recurse
         QPointer<HttpsServer> https;
         Returns ret;
 
+        Executor m_executor;
+        Metrics m_metrics;
+        QString m_metrics_path;
+        Profiler m_profiler;
+        Tracer m_tracer;
+        QScopedPointer<Watchdog> m_watchdog;
+
+        qint64 m_timeout = 0;
+        QVector<QPair<QRegExp, qint64>> m_route_timeouts;
+        QString m_timeout_header;
+
+        QVector<std::function<void(Context &ctx)>> m_headers_hooks;
+
+        QHash<QString, QByteArray> m_static_responses;
+        QByteArray m_not_found_body = "Not Found";
+        QByteArray m_not_found = m_serialize(404, QHash<QString, QString>(), m_not_found_body);
+
+        QHash<Context *, QPair<QSharedPointer<Context>, QSharedPointer<QVector<Prev>>>> m_injected;
+
         QVector<DownstreamUpstream> m_middleware_next;
         bool m_http_set = false;
         bool m_https_set = false;
@@ -419,8 +506,20 @@ namespace Recurse
         bool m_debug = false;
         bool m_int_core = false;
 
-        void m_start_upstream(Context *ctx, QVector<Prev> *middleware_prev);
+        void m_start_upstream(Context *ctx, QVector<Prev> *middleware_prev, Prev last);
+        void m_dispatch(Context *ctx, QVector<Prev> *middleware_prev, Prev last);
+        void m_start_request(QTcpSocket *socket);
+        void m_receive(Context *ctx, QVector<Prev> *middleware_prev, const QByteArray &chunk);
         void m_send_response(Context *ctx);
+        void m_send_prepared(Context *ctx, const QByteArray &reply);
+        void m_write(Context *ctx, const QVector<Response::Segment> &segments);
+
+        template <typename F>
+        void m_instrumented(Context *ctx, int index, F &&f, bool upstream = false);
+        void m_respond_not_found(Context &ctx);
+        static QByteArray m_serialize(quint16 status, const QHash<QString, QString> &headers, const QByteArray &body);
+        void m_start_deadline(Context *ctx);
+        void m_expire(Context *ctx);
         void m_call_next(Prev prev, Context *ctx, int current_middleware, QVector<Prev> *middleware_prev);
 
         quint16 appExitHandler(quint16 code);
@@ -473,14 +572,22 @@ namespace Recurse
     //! final function to be called for creating/sending response
     //! \param request
     //! \param response
+    //! \param last function finishing the response, eg: m_send_response
     //!
-    inline void Application::m_start_upstream(Context *ctx, QVector<void_f> *middleware_prev)
+    inline void Application::m_start_upstream(Context *ctx, QVector<void_f> *middleware_prev, Prev last)
     {
         debug("start upstream: " + QString::number(middleware_prev->size()));
 
-        // if there are no upstream middlewares send response directly
+        // client is gone or deadline passed, there is no one to send response to
+        if (ctx->cancellation.isCancelled())
+        {
+            debug("request cancelled, upstream skipped");
+            return;
+        }
+
+        // if there are no upstream middlewares finish response directly
         if (!middleware_prev->size())
-            m_send_response(ctx);
+            last();
         else
             middleware_prev->at(middleware_prev->size() - 1)();
     }
@@ -495,18 +602,194 @@ namespace Recurse
     {
         debug("end upstream");
 
-        auto request = ctx->request;
-        auto response = ctx->response;
+        auto &request = ctx->request;
+        auto &response = ctx->response;
+
+        if (response.sent || ctx->cancellation.isCancelled())
+            return;
+
+        response.sent = true;
+
+        // sampled requests get their timings, header drops reply serialized ahead of time
+        if (ctx->profile && m_profiler.serverTiming())
+            response.setHeader("server-timing", m_profiler.serverTiming(*ctx->profile));
+
+        // nothing was changed since reply was serialized
+        if (!response.prepared().isEmpty())
+        {
+            m_send_prepared(ctx, response.prepared());
+            return;
+        }
 
         response.method = request.method;
         response.protocol = request.protocol;
 
-        QString reply = response.create_reply();
+        // send head and body segments to the client, connection is closed once they are written
+        m_write(ctx, response.create_segments());
+    }
+
+    //!
+    //! \brief Application::m_send_prepared
+    //! send reply serialized ahead of time, shared buffer is written without copying
+    //!
+    //! \param ctx
+    //! \param reply whole HTTP/1.1 reply
+    //!
+    inline void Application::m_send_prepared(Context *ctx, const QByteArray &reply)
+    {
+        Response::Segment segment;
+        segment.data = reply;
+
+        // status line follows request protocol, other versions get their own copy
+        const QString &protocol = ctx->request.protocol;
+
+        if (protocol != "HTTP/1.1" && protocol.size() == 8)
+            segment.data = protocol.toLatin1() + reply.mid(8);
+
+        m_write(ctx, { segment });
+    }
+
+    //!
+    //! \brief Application::m_write
+    //! hand serialized response over to writer, record it for metrics and tracing
+    //!
+    //! \param ctx
+    //! \param segments head and body segments
+    //!
+    inline void Application::m_write(Context *ctx, const QVector<Response::Segment> &segments)
+    {
+        QTcpSocket *socket = ctx->request.socket;
+
+        qint64 bytes = 0;
+        for (const auto &segment : segments)
+            bytes += segment.size();
+
+        m_metrics.add(Metrics::BytesSent, quint64(bytes));
+
+        if (ctx->started)
+            m_metrics.observe(Metrics::TimeToFirstByte, Metrics::now() - ctx->started);
+
+        RECURSE_PROBE2(serialized, quintptr(socket), bytes);
+
+        // injected request, reply is handed over in one buffer
+        if (!socket)
+        {
+            if (ctx->sink)
+                ctx->sink(Response::join(segments));
+
+            return;
+        }
+
+        if (!m_tracer.isEnabled())
+        {
+            Writer::send(socket, segments);
+            return;
+        }
+
+        m_tracer.instant("serialized", quintptr(socket), bytes);
+
+        Writer::send(socket, segments, true, [this, socket]
+        {
+            m_tracer.instant("written", quintptr(socket));
+        });
+    }
+
+    //!
+    //! \brief Application::m_respond_not_found
+    //! default 404 fallback installed by listen(), upstream middlewares still see and can
+    //! change the response, untouched it is sent as prepared reply
+    //!
+    //! \param ctx
+    //!
+    inline void Application::m_respond_not_found(Context &ctx)
+    {
+        auto &response = ctx.response;
+        bool untouched = response.getHeaders().isEmpty();
+
+        response.status(404).rawBody(m_not_found_body);
+
+        if (untouched)
+            response.prepared(m_not_found);
+
+        response.end();
+    }
+
+    //!
+    //! \brief Application::m_serialize
+    //! serialize whole HTTP/1.1 reply once, for responses that never change
+    //!
+    //! \return QByteArray reply
+    //!
+    inline QByteArray Application::m_serialize(quint16 status, const QHash<QString, QString> &headers, const QByteArray &body)
+    {
+        Response response;
+        response.protocol = "HTTP/1.1";
+        response.status(status);
+
+        for (auto i = headers.constBegin(); i != headers.constEnd(); ++i)
+            response.setHeader(i.key(), i.value());
+
+        response.rawBody(body);
+
+        return response.create_reply();
+    }
+
+    //!
+    //! \brief Application::m_start_deadline
+    //! set request deadline from route timeout and timeout request header,
+    //! header can only shorten configured timeout
+    //!
+    //! \param ctx
+    //!
+    inline void Application::m_start_deadline(Context *ctx)
+    {
+        qint64 timeout = m_timeout;
+        QString path = ctx->request.url.path();
+
+        for (const auto &route : m_route_timeouts)
+        {
+            if (route.first.indexIn(path) != -1)
+            {
+                timeout = route.second;
+                break;
+            }
+        }
+
+        if (!m_timeout_header.isEmpty())
+        {
+            bool ok = false;
+            qint64 requested = ctx->request.getHeader(m_timeout_header).trimmed().toLongLong(&ok);
+
+            if (ok && requested > 0 && (timeout <= 0 || requested < timeout))
+                timeout = requested;
+        }
+
+        if (timeout <= 0)
+            return;
 
-        // send response to the client
-        request.socket->write(reply.toUtf8());
+        ctx->deadline.setRemainingTime(timeout);
 
-        request.socket->disconnectFromHost();
+        // timer is bound to context scope, it's gone with the context
+        QTimer::singleShot(static_cast<int>(timeout), ctx->scope(), std::bind(&Application::m_expire, this, ctx));
+    }
+
+    //!
+    //! \brief Application::m_expire
+    //! deadline passed, answer with 504 if nothing was sent yet and cancel the request
+    //!
+    //! \param ctx
+    //!
+    inline void Application::m_expire(Context *ctx)
+    {
+        debug("deadline exceeded: " + ctx->request.url.toString());
+
+        if (!ctx->response.sent && !ctx->cancellation.isCancelled())
+        {
+            ctx->response.status(504).body(ctx->response.http_codes.value(504));
+            m_send_response(ctx);
+        }
+
+        ctx->cancellation.cancel();
     }
 
     //!
@@ -517,13 +800,358 @@ namespace Recurse
     {
         debug("calling next: " + QString::number(current_middleware) + " num: " + QString::number(m_middleware_next.size()));
 
+        bool instrumented = ctx->profile || m_tracer.isEnabled() || m_watchdog;
+
+        if (instrumented)
+        {
+            prev = [this, ctx, prev, current_middleware]
+            {
+                m_instrumented(ctx, current_middleware, prev, true);
+            };
+        }
+
         ++current_middleware;
 
-        // save previous middleware function
-        middleware_prev->push_back(std::move(prev));
+        // save previous middleware function, it's also passed to next middleware
+        middleware_prev->push_back(prev);
+
+        auto next = std::bind(&Application::m_call_next, this, std::placeholders::_1, ctx, current_middleware, middleware_prev);
+
+        RECURSE_PROBE2(middleware_enter, quintptr(ctx->request.socket), current_middleware);
 
         // call next function with current prev
-        m_middleware_next[current_middleware](*ctx, std::bind(&Application::m_call_next, this, std::placeholders::_1, ctx, current_middleware, middleware_prev), prev);
+        if (instrumented)
+        {
+            m_instrumented(ctx, current_middleware, [&]
+            {
+                m_middleware_next[current_middleware](*ctx, next, prev);
+            });
+        }
+        else
+        {
+            m_middleware_next[current_middleware](*ctx, next, prev);
+        }
+
+        RECURSE_PROBE2(middleware_exit, quintptr(ctx->request.socket), current_middleware);
+    }
+
+    //!
+    //! \brief Application::m_instrumented
+    //! run middleware (or its upstream part) of profiled or traced request, or while
+    //! watchdog is enabled
+    //!
+    //! \param ctx
+    //! \param index middleware index
+    //! \param f function running the middleware
+    //! \param upstream true for upstream part
+    //!
+    template <typename F>
+    inline void Application::m_instrumented(Context *ctx, int index, F &&f, bool upstream)
+    {
+        // profile is kept, response may be finished while middleware is running
+        auto profile = ctx->profile;
+        quintptr id = quintptr(ctx->request.socket);
+
+        if (profile)
+            profile->enter(index, upstream);
+
+        if (m_tracer.isEnabled())
+            m_tracer.enter(index, id, upstream);
+
+        Watchdog::Running previous;
+
+        if (m_watchdog)
+            previous = m_watchdog->enter(ctx, index, ctx->request.url);
+
+        f();
+
+        if (m_watchdog)
+            m_watchdog->restore(previous);
+
+        if (m_tracer.isEnabled())
+            m_tracer.exit(index, id, upstream);
+
+        if (profile)
+            m_profiler.leave(*profile, ctx->response.sent);
+    }
+
+    //!
+    //! \brief Application::m_dispatch
+    //! run middleware chain for context, starting with first middleware
+    //!
+    //! \param ctx context to run chain for
+    //! \param middleware_prev upstream functions storage
+    //! \param last final upstream function, called once response is done
+    //!
+    inline void Application::m_dispatch(Context *ctx, QVector<Prev> *middleware_prev, Prev last)
+    {
+        ctx->response.end = std::bind(&Application::m_start_upstream, this, ctx, middleware_prev, last);
+
+        auto next = std::bind(&Application::m_call_next, this, std::placeholders::_1, ctx, 0, middleware_prev);
+
+        RECURSE_PROBE2(middleware_enter, quintptr(ctx->request.socket), 0);
+
+        if (ctx->profile || m_tracer.isEnabled() || m_watchdog)
+        {
+            m_instrumented(ctx, 0, [&]
+            {
+                m_middleware_next[0](*ctx, next, last);
+            });
+        }
+        else
+        {
+            m_middleware_next[0](*ctx, next, last);
+        }
+
+        RECURSE_PROBE2(middleware_exit, quintptr(ctx->request.socket), 0);
+    }
+
+    //!
+    //! \brief Application::dispatch
+    //! run middleware chain for context that is not bound to client connection (subrequest),
+    //! instead of being sent, response is handed to `done` callback
+    //!
+    //! ctx->request.socket should be set to nullptr, middlewares must not rely on it
+    //! context is kept alive until response is done and freed afterwards
+    //!
+    //! \param ctx context to run chain for
+    //! \param done called with finished context when upstream reaches the end
+    //!
+    inline void Application::dispatch(QSharedPointer<Context> ctx, std::function<void(Context &ctx)> done)
+    {
+        debug("dispatching subrequest");
+
+        auto middleware_prev = new QVector<Prev>;
+        middleware_prev->reserve(m_middleware_next.count());
+
+        m_dispatch(ctx.data(), middleware_prev, [ctx, middleware_prev, done]
+        {
+            done(*ctx);
+
+            // we are still inside of the chain, free it on next event loop iteration
+            QTimer::singleShot(0, [ctx, middleware_prev]
+            {
+                ctx->response.end = nullptr;
+                delete middleware_prev;
+            });
+        });
+    }
+
+    //!
+    //! \brief Application::executor
+    //! blocking work executor with named, bounded thread pools, see executor.hpp
+    //!
+    //! \return Executor application's executor
+    //!
+    inline Executor &Application::executor()
+    {
+        return m_executor;
+    }
+
+    //!
+    //! \brief Application::timeout
+    //! set default request timeout, when it passes client gets 504 and
+    //! ctx.cancellation is cancelled
+    //!
+    //! \param msec timeout in milliseconds, 0 to disable (default)
+    //! \return Application chainable
+    //!
+    inline Application &Application::timeout(qint64 msec)
+    {
+        m_timeout = msec;
+        return *this;
+    }
+
+    //!
+    //! \brief Application::timeout
+    //! overloaded function,
+    //! set timeout for requests with matching url path, first matching route wins
+    //!
+    //! \param path regular expression matched against url path, eg: "^/reports/"
+    //! \param msec timeout in milliseconds, 0 to disable
+    //! \return Application chainable
+    //!
+    inline Application &Application::timeout(const QRegExp &path, qint64 msec)
+    {
+        m_route_timeouts.push_back(qMakePair(path, msec));
+        return *this;
+    }
+
+    //!
+    //! \brief Application::timeoutHeader
+    //! allow clients to shorten their timeout with request header
+    //!
+    //! \param header case-insensitive header name, value in milliseconds, eg: "x-request-timeout"
+    //! \return Application chainable
+    //!
+    inline Application &Application::timeoutHeader(const QString &header)
+    {
+        m_timeout_header = header.toLower();
+        return *this;
+    }
+
+    //!
+    //! \brief Application::metrics
+    //! server counters and latency histograms, recorded always
+    //!
+    //! \return Metrics
+    //!
+    inline Metrics &Application::metrics()
+    {
+        return m_metrics;
+    }
+
+    //!
+    //! \brief Application::metricsPath
+    //! serve metrics in Prometheus text format, requests to path are answered before
+    //! middlewares run
+    //!
+    //! \param path exact url path, eg: /metrics, empty to disable (default)
+    //! \return Application chainable
+    //!
+    inline Application &Application::metricsPath(const QString &path)
+    {
+        m_metrics_path = path;
+        return *this;
+    }
+
+    //!
+    //! \brief Application::profile
+    //! enable per-middleware profiling, see profiler.hpp
+    //!
+    //! \param options QHash options of <QString, QVariant>
+    //!     "sample" profile every n-th request, 1 by default (every request)
+    //!     "server_timing" add Server-Timing header to profiled responses, true by default
+    //! \return Application chainable
+    //!
+    inline Application &Application::profile(const QHash<QString, QVariant> &options)
+    {
+        m_profiler.enable(options);
+        return *this;
+    }
+
+    //!
+    //! \brief Application::named
+    //! name most recently added middleware, used in profiler report and Server-Timing header
+    //!
+    //!     app.use(auth);
+    //!     app.named("auth");
+    //!
+    //! \param name middleware name
+    //! \return Application chainable
+    //!
+    inline Application &Application::named(const QString &name)
+    {
+        if (!m_middleware_next.isEmpty())
+        {
+            m_profiler.name(m_middleware_next.size() - 1, name);
+            m_tracer.name(m_middleware_next.size() - 1, name);
+        }
+
+        return *this;
+    }
+
+    //!
+    //! \brief Application::profiler
+    //! \return Profiler per-middleware histograms and report
+    //!
+    inline Profiler &Application::profiler()
+    {
+        return m_profiler;
+    }
+
+    //!
+    //! \brief Application::trace
+    //! record request lifecycle into ring buffer, see trace.hpp
+    //!
+    //! \param capacity number of events kept
+    //! \return Application chainable
+    //!
+    inline Application &Application::trace(int capacity)
+    {
+        m_tracer.enable(capacity);
+        return *this;
+    }
+
+    //!
+    //! \brief Application::tracer
+    //! \return Tracer recorded events, eg: tracer().dump("trace.json")
+    //!
+    inline Tracer &Application::tracer()
+    {
+        return m_tracer;
+    }
+
+    //!
+    //! \brief Application::watch
+    //! start event loop stall watchdog for application thread, see watchdog.hpp
+    //! event loop lag and stalls are recorded in metrics
+    //!
+    //! \param options QHash options of <QString, QVariant>
+    //!     "interval" heartbeat interval in milliseconds, 10 by default
+    //!     "threshold" milliseconds without heartbeat reported as stall, 100 by default
+    //!     "stack_signal" signal used to sample stack of blocked thread, SIGURG by default,
+    //!         0 to disable sampling (Linux/glibc only)
+    //! \return Application chainable
+    //!
+    inline Application &Application::watch(const QHash<QString, QVariant> &options)
+    {
+        m_watchdog.reset(new Watchdog(options, &m_metrics));
+        m_watchdog->watch(thread(), "application");
+
+        return *this;
+    }
+
+    //!
+    //! \brief Application::watchdog
+    //! \return Watchdog event loop watchdog, nullptr unless watch() was called
+    //!
+    inline Watchdog *Application::watchdog()
+    {
+        return m_watchdog.data();
+    }
+
+    //!
+    //! \brief Application::onHeaders
+    //! register function called once request headers are parsed, before body is read
+    //! and before middlewares run, eg: to set ctx.request.body_reader for streamed uploads
+    //!
+    //! \param f function to be called with request context
+    //! \return Application chainable
+    //!
+    inline Application &Application::onHeaders(std::function<void(Context &ctx)> f)
+    {
+        m_headers_hooks.push_back(std::move(f));
+        return *this;
+    }
+
+    //!
+    //! \brief Application::staticResponse
+    //! serve fixed response, eg: health checks or robots.txt; whole reply is serialized once
+    //! and matching requests are answered with it before middlewares run
+    //!
+    //!     app.staticResponse("GET", "/health", 200, {{ "content-type", "application/json" }}, "{\"ok\":true}");
+    //!
+    //! GET responses answer HEAD requests too, with head only
+    //!
+    //! \param method HTTP method, eg: GET
+    //! \param path exact url path, eg: /robots.txt
+    //! \param status HTTP status
+    //! \param headers response headers, content-type is text/plain if not set
+    //! \param body response body
+    //! \return Application chainable
+    //!
+    inline Application &Application::staticResponse(const QString &method, const QString &path, quint16 status,
+        const QHash<QString, QString> &headers, const QByteArray &body)
+    {
+        QByteArray reply = m_serialize(status, headers, body);
+
+        m_static_responses.insert(method.toUpper() + ' ' + path, reply);
+
+        if (method.toUpper() == "GET")
+            m_static_responses.insert("HEAD " + path, reply.left(reply.indexOf("\r\n\r\n") + 4));
+
+        return *this;
     }
 
     //!
@@ -576,7 +1204,8 @@ namespace Recurse
 
     //!
     //! \brief Application::handleConnection
-    //! creates new recurse context for a tcp session
+    //! watches new tcp session, recurse context is created once client starts sending request,
+    //! until then connection holds only its socket
     //!
     //! \param pointer to the socket sent from http/https server
     //!
@@ -586,32 +1215,291 @@ namespace Recurse
     {
         debug("handling new connection");
 
+        m_metrics.add(Metrics::ConnectionsAccepted);
+
+        RECURSE_PROBE2(connection, quintptr(socket), socket->socketDescriptor());
+
+        if (m_tracer.isEnabled())
+        {
+            // TLS servers keep time connection was accepted at, before handshake
+            m_tracer.begin("connection", quintptr(socket), socket->property("recurse_accepted").toLongLong());
+
+            if (qobject_cast<QSslSocket *>(socket))
+                m_tracer.instant("tls_done", quintptr(socket));
+        }
+
+        // idle handlers are replaced by request ones on first data
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket]
+        {
+            disconnect(socket, nullptr, this, nullptr);
+            m_start_request(socket);
+        });
+
+        connect(socket, &QAbstractSocket::disconnected, this, [this, socket]
+        {
+            m_metrics.add(Metrics::ConnectionsClosed);
+
+            if (m_tracer.isEnabled())
+                m_tracer.end("connection", quintptr(socket));
+        });
+
+        connect(socket, &QAbstractSocket::disconnected, socket, &QObject::deleteLater);
+
+        return true;
+    }
+
+    //!
+    //! \brief Application::m_start_request
+    //! create context and upstream storage for request client started sending
+    //!
+    //! \param socket connection request arrives on, with data ready to be read
+    //!
+    inline void Application::m_start_request(QTcpSocket *socket)
+    {
         auto middleware_prev = QSharedPointer<QVector<Prev>>(new QVector<Prev>);
         middleware_prev->reserve(m_middleware_next.count());
 
         auto ctx = QSharedPointer<Context>(new Context);
         ctx->request.socket = socket;
 
-        connect(socket, &QTcpSocket::readyRead, [this, ctx, middleware_prev, socket]
+        connect(socket, &QTcpSocket::readyRead, this, [this, ctx, middleware_prev, socket]
+        {
+            // data belongs to protocol connection was upgraded to
+            if (ctx->response.upgraded)
+                return;
+
+            m_receive(ctx.data(), middleware_prev.data(), socket->readAll());
+        });
+
+        // stop work bound to this request, nothing can be sent anymore
+        connect(socket, &QAbstractSocket::disconnected, this, [this, ctx, socket]
         {
-            QString data(socket->readAll());
+            ctx->cancellation.cancel();
 
-            ctx->request.parse(data);
+            m_metrics.add(Metrics::ConnectionsClosed);
 
-            if (ctx->request.length < ctx->request.getHeader("content-length").toLongLong())
+            if (m_tracer.isEnabled())
+                m_tracer.end("connection", quintptr(socket));
+
+            // upgraded connections and event streams outlive their request, only status is counted
+            if (ctx->response.sent)
+                m_metrics.request(ctx->response.status(), ctx->response.upgraded ? -1 : Metrics::now() - ctx->started);
+        });
+
+        m_receive(ctx.data(), middleware_prev.data(), socket->readAll());
+    }
+
+    //!
+    //! \brief Application::m_receive
+    //! feed data read from client into request, once it's complete answer it from metrics
+    //! page or static responses, or run middleware chain
+    //!
+    //! \param ctx
+    //! \param middleware_prev upstream functions storage
+    //! \param chunk data read from client
+    //!
+    inline void Application::m_receive(Context *ctx, QVector<Prev> *middleware_prev, const QByteArray &chunk)
+    {
+        quintptr id = quintptr(ctx->request.socket);
+
+        if (!ctx->started)
+        {
+            ctx->started = Metrics::now();
+
+            RECURSE_PROBE1(first_byte, id);
+
+            if (m_tracer.isEnabled())
+                m_tracer.instant("first_byte", id);
+        }
+
+        m_metrics.add(Metrics::BytesReceived, quint64(chunk.size()));
+
+        bool complete = ctx->request.feed(chunk, [this, ctx, id]
+        {
+            RECURSE_PROBE1(headers, id);
+
+            if (m_tracer.isEnabled())
+                m_tracer.instant("headers", id);
+
+            for (const auto &f : m_headers_hooks)
+                f(*ctx);
+        });
+
+        if (!complete)
+            return;
+
+        if (ctx->request.method.isEmpty() || !ctx->request.protocol.startsWith("HTTP/"))
+            m_metrics.add(Metrics::ParseErrors);
+
+        if (!m_metrics_path.isEmpty() && ctx->request.url.path() == m_metrics_path)
+        {
+            ctx->response.type("text/plain; version=0.0.4").rawBody(m_metrics.render(&m_executor));
+            m_send_response(ctx);
+            return;
+        }
+
+        if (!m_static_responses.isEmpty())
+        {
+            auto reply = m_static_responses.constFind(ctx->request.method + ' ' + ctx->request.url.path());
+
+            if (reply != m_static_responses.constEnd())
+            {
+                // status is kept for metrics, "HTTP/1.1 200 ..."
+                ctx->response.status(reply.value().mid(9, 3).toUShort());
+                ctx->response.sent = true;
+                m_send_prepared(ctx, reply.value());
                 return;
+            }
+        }
+
+        ctx->profile = m_profiler.start();
+
+        m_start_deadline(ctx);
+        m_dispatch(ctx, middleware_prev, std::bind(&Application::m_send_response, this, ctx));
+    }
+
+    //!
+    //! \brief Application::inject
+    //! run raw request through the same path as requests read from socket (parsing, metrics
+    //! page, static responses, middlewares, serialization) without any socket, eg: for tests
+    //! and measuring framework overhead. Streamed and upgraded responses need real client
+    //!
+    //!     app.inject("GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n", [](const QByteArray &reply)
+    //!     {
+    //!         qDebug() << reply;
+    //!     });
+    //!
+    //! \param request whole HTTP request, head and body
+    //! \param done called with serialized reply, right away when middlewares finish synchronously,
+    //! empty reply for incomplete request
+    //!
+    inline void Application::inject(const QByteArray &request, std::function<void(const QByteArray &reply)> done)
+    {
+        auto ctx = QSharedPointer<Context>(new Context);
+        auto middleware_prev = QSharedPointer<QVector<Prev>>(new QVector<Prev>);
+        middleware_prev->reserve(m_middleware_next.count());
+
+        ctx->request.socket = nullptr;
+
+        Context *raw = ctx.data();
+
+        ctx->sink = [this, raw, done](const QByteArray &reply)
+        {
+            m_metrics.request(raw->response.status(), Metrics::now() - raw->started);
 
-            ctx->response.end = std::bind(&Application::m_start_upstream, this, ctx.data(), middleware_prev.data());
+            if (done)
+                done(reply);
+
+            // response was sent asynchronously, chain is still running, free it afterwards
+            if (m_injected.contains(raw))
+            {
+                QTimer::singleShot(0, this, [this, raw]
+                {
+                    m_injected.remove(raw);
+                });
+            }
+        };
+
+        m_receive(raw, middleware_prev.data(), request);
+
+        // head or body is incomplete, there will be no more data
+        if (!ctx->response.sent && !ctx->response.end)
+        {
+            if (done)
+                done(QByteArray());
+
+            return;
+        }
+
+        // context has to outlive the call, it is released once reply is handed over
+        if (!ctx->response.sent && !ctx->cancellation.isCancelled())
+            m_injected.insert(raw, qMakePair(ctx, middleware_prev));
+    }
+
+    //!
+    //! \brief Application::inject
+    //! overloaded function, run request and wait for its reply, event loop is run while
+    //! waiting for asynchronous middlewares
+    //!
+    //! \param request whole HTTP request
+    //! \return QByteArray serialized reply
+    //!
+    inline QByteArray Application::inject(const QByteArray &request)
+    {
+        QByteArray reply;
+        bool finished = false;
+        QEventLoop *waiting = nullptr;
 
-            m_middleware_next[0](
-            *ctx,
-            std::bind(&Application::m_call_next, this, std::placeholders::_1, ctx.data(), 0, middleware_prev.data()),
-            std::bind(&Application::m_send_response, this, ctx.data()));
+        inject(request, [&reply, &finished, &waiting](const QByteArray &r)
+        {
+            reply = r;
+            finished = true;
+
+            if (waiting)
+                waiting->quit();
         });
 
-        connect(socket, &QAbstractSocket::disconnected, socket, &QObject::deleteLater);
+        if (!finished)
+        {
+            QEventLoop loop;
+            waiting = &loop;
+            loop.exec();
+        }
 
-        return true;
+        return reply;
+    }
+
+    //!
+    //! \brief Application::inject
+    //! overloaded function, batch mode, replay requests in turns until count of them was run,
+    //! measures framework overhead without kernel and network
+    //!
+    //!     auto stats = app.inject({ get, post }, 1000000);
+    //!     qDebug() << stats["per_second"].toDouble();
+    //!
+    //! \param requests whole HTTP requests
+    //! \param count number of requests to run
+    //! \param done optional, called with every reply
+    //! \return QHash<QString, QVariant> "requests", "responses", "bytes", "nsecs", "per_second"
+    //!
+    inline QHash<QString, QVariant> Application::inject(const QVector<QByteArray> &requests, quint64 count,
+        std::function<void(const QByteArray &reply)> done)
+    {
+        quint64 responses = 0;
+        quint64 bytes = 0;
+        QEventLoop loop;
+
+        auto reply = [&](const QByteArray &r)
+        {
+            ++responses;
+            bytes += quint64(r.size());
+
+            if (done)
+                done(r);
+
+            if (responses == count)
+                loop.quit();
+        };
+
+        qint64 started = Metrics::now();
+
+        for (quint64 i = 0; i < count && !requests.isEmpty(); ++i)
+            inject(requests.at(int(i % quint64(requests.size()))), reply);
+
+        // asynchronous middlewares
+        if (responses < count && !requests.isEmpty())
+            loop.exec();
+
+        qint64 nsecs = Metrics::now() - started;
+
+        QHash<QString, QVariant> stats;
+        stats["requests"] = requests.isEmpty() ? 0 : count;
+        stats["responses"] = responses;
+        stats["bytes"] = bytes;
+        stats["nsecs"] = nsecs;
+        stats["per_second"] = nsecs ? double(responses) * 1e9 / nsecs : 0.0;
+
+        return stats;
     }
 
     //!
@@ -702,9 +1590,9 @@ namespace Recurse
     //!
     inline Returns Application::listen(quint16 port, QHostAddress address)
     {
-        use([](auto &ctx)
+        use([this](auto &ctx)
         {
-            ctx.response.status(404).send("Not Found");
+            m_respond_not_found(ctx);
         });
 
         // if this function is called and m_http_set is true, ignore new values
@@ -727,6 +1615,7 @@ namespace Recurse
 
         // connect HttpServer signal 'socketReady' to this class' 'handleConnection' slot
         connect(http, &HttpServer::socketReady, this, &Application::handleConnection);
+        connect(http, &HttpServer::socketRejected, this, [this] { m_metrics.add(Metrics::ConnectionsRejected); });
 
         if (m_int_core)
         {
@@ -757,9 +1646,9 @@ namespace Recurse
     //!
     inline Returns Application::listen()
     {
-        use([](auto &ctx)
+        use([this](auto &ctx)
         {
-            ctx.response.status(404).send("Not Found");
+            m_respond_not_found(ctx);
         });
 
         if (m_http_set)
@@ -775,6 +1664,7 @@ namespace Recurse
             }
 
             connect(http, &HttpServer::socketReady, this, &Application::handleConnection);
+            connect(http, &HttpServer::socketRejected, this, [this] { m_metrics.add(Metrics::ConnectionsRejected); });
         }
 
         if (m_https_set)
@@ -790,6 +1680,8 @@ namespace Recurse
             }
 
             connect(https, &HttpsServer::socketReady, this, &Application::handleConnection);
+            connect(https, &HttpsServer::socketRejected, this, [this] { m_metrics.add(Metrics::ConnectionsRejected); });
+            connect(https, &HttpsServer::handshakeFailed, this, [this] { m_metrics.add(Metrics::TlsHandshakeFailures); });
         }
 
         if (!m_http_set && !m_https_set)
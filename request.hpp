@@ -2,9 +2,11 @@
 #define RECURSE_REQUEST_HPP
 
 #include <QTcpSocket>
+#include <QByteArray>
 #include <QHash>
 #include <QUrl>
 #include <QUrlQuery>
+#include <functional>
 
 class Request
 {
@@ -12,7 +14,7 @@ class Request
 public:
     //!
     //! \brief data
-    //! client request buffer data
+    //! client request head data, request line and headers
     //!
     QString data;
 
@@ -20,7 +22,7 @@ public:
     //! \brief socket
     //! underlying client socket
     //!
-    QTcpSocket *socket;
+    QTcpSocket *socket = nullptr;
 
     //!
     //! \brief body_parsed
@@ -30,9 +32,24 @@ public:
 
     //!
     //! \brief body
+    //! request body decoded from UTF-8, empty if it was consumed by body_reader
     //!
     QString body;
 
+    //!
+    //! \brief raw_body
+    //! request body bytes as received, empty if it was consumed by body_reader
+    //!
+    QByteArray raw_body;
+
+    //!
+    //! \brief body_reader
+    //! Optional consumer of body chunks as they arrive, set once headers are parsed
+    //! (see Application::onHeaders), body is not buffered then. Called with empty chunk
+    //! once whole body is read
+    //!
+    std::function<void(const QByteArray &chunk)> body_reader;
+
     //!
     //! \brief method
     //! HTTP method, eg: GET
@@ -72,7 +89,7 @@ public:
 
     //!
     //! \brief length
-    //! HTTP request Content-Length
+    //! number of body bytes received so far
     //!
     qint64 length = 0;
 
@@ -152,6 +169,17 @@ public:
     //!
     bool parse(QString request);
 
+    //!
+    //! \brief feed
+    //! incremental parsing of data as it is read from client, head is parsed once it's
+    //! complete, body bytes are buffered or handed over to body_reader
+    //!
+    //! \param chunk data read from client
+    //! \param headers_done optional, called once head is parsed and before body is read
+    //! \return true once whole request is received (head and Content-Length bytes of body)
+    //!
+    bool feed(const QByteArray &chunk, const std::function<void()> &headers_done = nullptr);
+
 private:
     //!
     //! \brief header
@@ -167,49 +195,112 @@ private:
     QHash<QString, QString> m_cookies;
 
     //!
-    //! \brief httpRx
-    //! match HTTP request line
+    //! \brief m_buffer
+    //! received data until head is complete
     //!
-    QRegExp httpRx = QRegExp("^(?=[A-Z]).* \\/.* HTTP\\/[0-9]\\.[0-9]\\r\\n");
+    QByteArray m_buffer;
+
+    //!
+    //! \brief m_head_done
+    //! head was parsed, further data is body
+    //!
+    bool m_head_done = false;
+
+    //!
+    //! \brief m_content_length
+    //! value of Content-Length header
+    //!
+    qint64 m_content_length = 0;
+
+    //!
+    //! \brief m_complete
+    //! whole request was received, further data is ignored
+    //!
+    bool m_complete = false;
+
+    void m_parse_head();
 };
 
 inline bool Request::parse(QString request)
 {
-    // buffer all data
-    this->data += request;
+    feed(request.toUtf8());
+    return true;
+}
+
+inline bool Request::feed(const QByteArray &chunk, const std::function<void()> &headers_done)
+{
+    if (m_complete)
+        return false;
+
+    QByteArray body_chunk;
+
+    if (!m_head_done)
+    {
+        m_buffer += chunk;
 
-    // Save client ip address
-    this->ip = this->socket->peerAddress();
+        int end = m_buffer.indexOf("\r\n\r\n");
+        if (end == -1)
+            return false;
 
-    // if no header is present, just append all data to request.body
-    if (!this->data.contains(httpRx))
+        this->data = QString::fromUtf8(m_buffer.constData(), end + 2);
+        body_chunk = m_buffer.mid(end + 4);
+
+        m_buffer.clear();
+        m_head_done = true;
+
+        m_parse_head();
+
+        if (headers_done)
+            headers_done();
+    }
+    else
+    {
+        body_chunk = chunk;
+    }
+
+    if (!body_chunk.isEmpty())
     {
-        this->body.append(this->data);
-        return true;
+        this->length += body_chunk.size();
+
+        if (this->body_reader)
+            this->body_reader(body_chunk);
+        else
+            this->raw_body += body_chunk;
     }
 
+    if (this->length < m_content_length)
+        return false;
+
+    m_complete = true;
+
+    if (this->body_reader)
+        this->body_reader(QByteArray());
+    else
+        this->body = QString::fromUtf8(this->raw_body);
+
+    return true;
+}
+
+inline void Request::m_parse_head()
+{
+    // Save client ip address, injected requests have no socket
+    if (this->socket)
+        this->ip = this->socket->peerAddress();
+
     auto data_list = this->data.splitRef("\r\n");
-    bool is_body = false;
 
     for (int i = 0; i < data_list.size(); ++i)
     {
-        if (is_body)
-        {
-            this->body.append(data_list.at(i));
-            this->length += this->body.size();
-            continue;
-        }
-
         auto entity_item = data_list.at(i).split(":");
 
-        if (entity_item.length() < 2 && entity_item.at(0).size() < 1 && !is_body)
-        {
-            is_body = true;
+        if (entity_item.length() < 2 && entity_item.at(0).size() < 1)
             continue;
-        }
         else if (i == 0 && entity_item.length() < 2)
         {
             auto first_line = entity_item.at(0).split(" ");
+            if (first_line.size() < 3)
+                continue;
+
             this->method = first_line.at(0).toString();
             this->url = first_line.at(1).toString();
             this->query.setQuery(this->url.query());
@@ -223,6 +314,8 @@ inline bool Request::parse(QString request)
     if (m_headers.contains("host"))
         this->hostname = m_headers["host"];
 
+    m_content_length = m_headers.value("content-length").trimmed().toLongLong();
+
     // extract cookies
     // eg: USER_TOKEN=Yes;test=val
     if (m_headers.contains("cookie"))
@@ -242,8 +335,6 @@ inline bool Request::parse(QString request)
             m_cookies[key.toString().toLower()] = value.toString();
         }
     }
-
-    return true;
 }
 
 #endif
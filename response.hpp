@@ -1,14 +1,36 @@
 #ifndef RECURSE_RESPONSE_HPP
 #define RECURSE_RESPONSE_HPP
 
+#include <QFile>
+#include <QFileInfo>
 #include <QHash>
 #include <QJsonDocument>
+#include <QVector>
 #include <functional>
 
+#include "json.hpp"
+
 class Response
 {
 
 public:
+    //!
+    //! \brief The Segment struct
+    //! Part of serialized response, in-memory buffer or range of file
+    //!
+    struct Segment
+    {
+        QByteArray data;
+        QString path;
+        qint64 offset = 0;
+        qint64 length = 0;
+
+        qint64 size() const
+        {
+            return path.isEmpty() ? data.size() : length;
+        }
+    };
+
     //!
     //! \brief get
     //! Returns the HTTP response header specified by key
@@ -21,17 +43,29 @@ public:
         return m_headers[key.toLower()];
     }
 
+    //!
+    //! \brief getHeaders
+    //! Returns all HTTP response headers as key/value, useful for upstream middleware
+    //!
+    //! \return QHash<QString, QString> headers
+    //!
+    QHash<QString, QString> getHeaders() const
+    {
+        return m_headers;
+    }
+
     //!
     //! \brief set
     //! Sets the response HTTP header to value.
     //!
-    //! \param QString key of the header
+    //! \param QString case-insensitive key of the header, saved in lowercase
     //! \param QString value for the header
     //! \return Response chainable
     //!
     Response &setHeader(const QString &key, const QString &value)
     {
-        m_headers[key] = value;
+        m_headers[key.toLower()] = value;
+        m_prepared.clear();
         return *this;
     }
 
@@ -56,6 +90,7 @@ public:
     Response &status(quint16 status)
     {
         m_status = status;
+        m_prepared.clear();
         return *this;
     }
 
@@ -80,6 +115,7 @@ public:
     Response &type(const QString &type)
     {
         m_headers["content-type"] = type;
+        m_prepared.clear();
         return *this;
     }
 
@@ -91,7 +127,7 @@ public:
     //!
     QString body() const
     {
-        return m_body;
+        return QString::fromUtf8(m_body);
     }
 
     //!
@@ -102,11 +138,135 @@ public:
     //! \return  Response chainable
     //!
     Response &body(const QString &body)
+    {
+        m_body = body.toUtf8();
+        m_segments.clear();
+        m_prepared.clear();
+        return *this;
+    }
+
+    //!
+    //! \brief rawBody
+    //! Get current response body as UTF-8 bytes, without conversion
+    //! segments added with writeRaw() or writeFile() are not included, see segments()
+    //!
+    //! \return QByteArray response content
+    //!
+    const QByteArray &rawBody() const
+    {
+        return m_body;
+    }
+
+    //!
+    //! \brief rawBody
+    //! Set response content as bytes, overrides existing
+    //!
+    //! \param QByteArray body
+    //! \return Response chainable
+    //!
+    Response &rawBody(const QByteArray &body)
     {
         m_body = body;
+        m_segments.clear();
+        m_prepared.clear();
+        return *this;
+    }
+
+    //!
+    //! \brief writeRaw
+    //! Appends bytes as separate body segment, it's sent as it is without being copied
+    //! into reply, eg: large or shared (cached) buffers
+    //!
+    //! \param QByteArray data to be added
+    //! \return Response chainable
+    //!
+    Response &writeRaw(const QByteArray &data)
+    {
+        Segment segment;
+        segment.data = data;
+
+        m_segments.push_back(segment);
+        m_prepared.clear();
+        return *this;
+    }
+
+    //!
+    //! \brief writeFile
+    //! Appends range of file as body segment, file is read (or sent by kernel) only while
+    //! response is being written to client
+    //!
+    //! \param path file path
+    //! \param offset start of range
+    //! \param length length of range, -1 for rest of file
+    //! \return Response chainable
+    //!
+    Response &writeFile(const QString &path, qint64 offset = 0, qint64 length = -1)
+    {
+        Segment segment;
+        segment.path = path;
+        segment.offset = offset;
+        segment.length = length < 0 ? qMax<qint64>(0, QFileInfo(path).size() - offset) : length;
+
+        m_segments.push_back(segment);
+        m_prepared.clear();
+        return *this;
+    }
+
+    //!
+    //! \brief segments
+    //! Body segments added after rawBody with writeRaw() and writeFile()
+    //!
+    //! \return QVector<Segment> segments
+    //!
+    const QVector<Segment> &segments() const
+    {
+        return m_segments;
+    }
+
+    //!
+    //! \brief prepared
+    //! Get reply serialized ahead of time, empty if there is none or response was changed since
+    //!
+    //! \return QByteArray whole HTTP/1.1 reply
+    //!
+    const QByteArray &prepared() const
+    {
+        return m_prepared;
+    }
+
+    //!
+    //! \brief prepared
+    //! Set reply serialized ahead of time for current status, headers and body (see
+    //! Application::staticResponse), it is sent as it is unless response is changed afterwards
+    //!
+    //! \param QByteArray whole HTTP/1.1 reply
+    //! \return Response chainable
+    //!
+    Response &prepared(const QByteArray &reply)
+    {
+        m_prepared = reply;
         return *this;
     }
 
+    //!
+    //! \brief json
+    //! Start JSON response, content is written straight into response body
+    //!
+    //!     ctx.response.json().beginObject().key("id").value(1).endObject();
+    //!     ctx.response.send();
+    //!
+    //! \return Recurse::JsonWriter writing into response body
+    //!
+    Recurse::JsonWriter json()
+    {
+        type("application/json");
+        m_body.resize(0);
+        m_segments.clear();
+        m_prepared.clear();
+
+        return Recurse::JsonWriter(m_body);
+    }
+
     //!
     //! \brief write
     //! Appends data to existing content (set by write() or body())
@@ -116,7 +276,12 @@ public:
     //!
     Response &write(const QString &data)
     {
-        m_body += data;
+        // keep order with segments already added
+        if (!m_segments.isEmpty())
+            return writeRaw(data.toUtf8());
+
+        m_body += data.toUtf8();
+        m_prepared.clear();
         return *this;
     }
 
@@ -129,7 +294,7 @@ public:
     void send(const QString &body = "")
     {
         if (body.size())
-            m_body = body;
+            this->body(body);
 
         end();
     }
@@ -143,7 +308,7 @@ public:
     void send(const QJsonDocument &body)
     {
         type("application/json");
-        m_body = body.toJson(QJsonDocument::Compact);
+        rawBody(body.toJson(QJsonDocument::Compact));
 
         end();
     }
@@ -205,6 +370,19 @@ public:
     //!
     std::function<void()> end;
 
+    //!
+    //! \brief sent
+    //! set once response was handed over to the client, later sends are ignored
+    //!
+    bool sent = false;
+
+    //!
+    //! \brief upgraded
+    //! set once connection was taken over by other protocol (eg: WebSocket) or long-lived
+    //! event stream, application stops reading from it and leaves it open
+    //!
+    bool upgraded = false;
+
     //!
     //! \brief method
     //! Response method, eg: GET
@@ -219,8 +397,88 @@ public:
 
     //!
     //! \brief http codes
+    //! reason phrases, shares one table between all responses until changed
     //!
-    QHash<quint16, QString> http_codes{
+    QHash<quint16, QString> http_codes = m_http_codes();
+
+    //!
+    //! \brief create_reply
+    //! create reply for sending to client
+    //!
+    //! \return QByteArray reply to be sent
+    //!
+    QByteArray create_reply();
+
+    //!
+    //! \brief create_head
+    //! create status line and headers only, used for streamed responses
+    //!
+    //! \return QByteArray head to be sent
+    //!
+    QByteArray create_head();
+
+    //!
+    //! \brief create_segments
+    //! create reply as head buffer followed by body segments, for vectored writes
+    //! without concatenating body into reply
+    //!
+    //! \return QVector<Segment> segments to be sent in order
+    //!
+    QVector<Segment> create_segments();
+
+    //!
+    //! \brief join
+    //! concatenate segments into single buffer, file ranges are read
+    //!
+    //! \param segments eg: from create_segments()
+    //! \return QByteArray joined data, empty if file range can't be read whole as reply would
+    //! be shorter than its Content-Length
+    //!
+    static QByteArray join(const QVector<Segment> &segments);
+
+private:
+    //!
+    //! \brief m_status
+    //! HTTP response status
+    //!
+    quint16 m_status = 200;
+
+    //!
+    //! \brief header
+    //! holds all header data as key/value
+    //!
+
+    QHash<QString, QString> m_headers;
+    //!
+    //! \brief m_body
+    //! HTTP response content, UTF-8 encoded
+    //!
+    QByteArray m_body;
+
+    //!
+    //! \brief m_segments
+    //! body segments sent after m_body
+    //!
+    QVector<Segment> m_segments;
+
+    //!
+    //! \brief m_prepared
+    //! reply serialized ahead of time, cleared by any change of response
+    //!
+    QByteArray m_prepared;
+
+    qint64 m_content_length() const;
+    bool m_bodyless() const;
+    static const QHash<quint16, QString> &m_http_codes();
+};
+
+//!
+//! \brief Response::m_http_codes
+//! built once, every Response holds only reference to it, instead of its own ~40 entries
+//!
+inline const QHash<quint16, QString> &Response::m_http_codes()
+{
+    static const QHash<quint16, QString> codes{
         { 100, "Continue" },
         { 101, "Switching Protocols" },
         { 200, "OK" },
@@ -263,56 +521,138 @@ public:
         { 505, "HTTP Version not supported" }
     };
 
-    //!
-    //! \brief create_reply
-    //! create reply for sending to client
-    //!
-    //! \return QString reply to be sent
-    //!
-    QString create_reply();
+    return codes;
+}
 
-private:
-    //!
-    //! \brief m_status
-    //! HTTP response status
-    //!
-    quint16 m_status = 200;
+// https://tools.ietf.org/html/rfc7230#page-19
+inline QByteArray Response::create_reply()
+{
+    return join(create_segments());
+}
 
-    //!
-    //! \brief header
-    //! holds all header data as key/value
-    //!
+inline QVector<Response::Segment> Response::create_segments()
+{
+    QVector<Segment> segments;
 
-    QHash<QString, QString> m_headers;
-    //!
-    //! \brief m_body
-    //! HTTP response content
-    //!
-    QString m_body;
-};
+    // no body and no length, 304 length would have to match the full response
+    if (m_bodyless())
+    {
+        m_headers.remove("content-length");
 
-// https://tools.ietf.org/html/rfc7230#page-19
-inline QString Response::create_reply()
+        Segment head;
+        head.data = create_head();
+        segments.push_back(head);
+
+        return segments;
+    }
+
+    m_headers["content-length"] = QString::number(m_content_length());
+
+    segments.reserve(m_segments.size() + 2);
+
+    Segment head;
+    head.data = create_head();
+    segments.push_back(head);
+
+    if (m_body.size())
+    {
+        Segment body;
+        body.data = m_body;
+        segments.push_back(body);
+    }
+
+    for (const auto &segment : m_segments)
+    {
+        if (segment.size())
+            segments.push_back(segment);
+    }
+
+    return segments;
+}
+
+inline QByteArray Response::join(const QVector<Segment> &segments)
 {
-    QString reply = this->protocol % " " % QString::number(this->status()) % " "
-    % this->http_codes[this->status()] % "\r\n";
+    // single buffer is shared, not copied
+    if (segments.size() == 1 && segments.first().path.isEmpty())
+        return segments.first().data;
+
+    qint64 size = 0;
+    for (const auto &segment : segments)
+        size += segment.size();
 
-    // set content length
-    m_headers["content-length"] = QString::number(this->body().size());
+    QByteArray joined;
+    joined.reserve(int(size));
 
+    for (const auto &segment : segments)
+    {
+        if (segment.path.isEmpty())
+        {
+            joined += segment.data;
+            continue;
+        }
+
+        QFile file(segment.path);
+
+        if (!file.open(QIODevice::ReadOnly) || !file.seek(segment.offset))
+            return QByteArray();
+
+        QByteArray data = file.read(segment.length);
+
+        if (data.size() != segment.length)
+            return QByteArray();
+
+        joined += data;
+    }
+
+    return joined;
+}
+
+inline qint64 Response::m_content_length() const
+{
+    qint64 length = m_body.size();
+
+    for (const auto &segment : m_segments)
+        length += segment.size();
+
+    return length;
+}
+
+//!
+//! \brief Response::m_bodyless
+//! \return true for statuses that never have body: 1xx, 204 and 304
+//!
+inline bool Response::m_bodyless() const
+{
+    return m_status / 100 == 1 || m_status == 204 || m_status == 304;
+}
+
+inline QByteArray Response::create_head()
+{
     // set content type if not set
-    if (!m_headers.contains("content-type"))
+    if (!m_headers.contains("content-type") && !m_bodyless())
         m_headers["content-type"] = "text/plain";
 
+    QByteArray reply;
+    reply.reserve(256);
+
+    reply += this->protocol.toLatin1();
+    reply += ' ';
+    reply += QByteArray::number(this->status());
+    reply += ' ';
+    reply += this->http_codes.value(this->status()).toLatin1();
+    reply += "\r\n";
+
     // set custom header fields
     for (auto i = m_headers.constBegin(); i != m_headers.constEnd(); ++i)
-        reply = reply % i.key() % ": " % i.value() % "\r\n";
+    {
+        reply += i.key().toLatin1();
+        reply += ": ";
+        reply += i.value().toUtf8();
+        reply += "\r\n";
+    }
 
     reply += "\r\n";
 
-    if (this->body().size())
-        reply += this->body();
-
     return reply;
 }
 
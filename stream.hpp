@@ -0,0 +1,245 @@
+#ifndef RECURSE_STREAM_HPP
+#define RECURSE_STREAM_HPP
+
+#include <QByteArray>
+#include <QPointer>
+#include <QTcpSocket>
+#include <functional>
+
+#include "context.hpp"
+
+namespace Recurse
+{
+
+    //!
+    //! \brief The Stream class
+    //! Streamed (chunked transfer encoding) response
+    //!
+    //! Response is marked as sent right away so regular send() is ignored, status and headers
+    //! set on ctx.response are written together with first chunk. Upstream middlewares are not
+    //! called for streamed responses. HTTP/1.0 clients get connection-delimited body instead.
+    //!
+    //! Producers should respect backpressure: when writable() is false, wait for onDrain().
+    //! Stream stops being open when client disconnects or request is cancelled, cancelled
+    //! stream that was not ended closes connection so client doesn't wait for rest of the body.
+    //!
+    //!     auto stream = QSharedPointer<Recurse::Stream>::create(ctx, "text/plain");
+    //!     stream->write("first part\n");
+    //!     stream->write("second part\n");
+    //!     stream->end();
+    //!
+    class Stream
+    {
+    public:
+        Stream(Context &ctx, const QString &type = QString());
+
+        bool isOpen() const;
+        bool writable() const;
+        bool write(const QByteArray &data);
+        void end();
+        void abort(quint16 status = 500, const QString &body = QString());
+        void onDrain(std::function<void()> f);
+
+        Stream &setWatermark(qint64 high);
+
+    private:
+        QPointer<QTcpSocket> m_socket;
+        Response *m_response;
+        Cancellation m_cancellation;
+        bool m_chunked;
+        bool m_head_sent = false;
+        bool m_ended = false;
+        qint64 m_high = 64 * 1024;
+
+        void m_write_head();
+    };
+
+    //!
+    //! \brief Stream::Stream
+    //!
+    //! \param ctx request context, stream must not outlive its client
+    //! \param type optional Content-Type
+    //!
+    inline Stream::Stream(Context &ctx, const QString &type)
+        : m_socket(ctx.request.socket),
+          m_response(&ctx.response),
+          m_cancellation(ctx.cancellation)
+    {
+        m_chunked = ctx.request.protocol != "HTTP/1.0";
+
+        m_response->method = ctx.request.method;
+        m_response->protocol = ctx.request.protocol;
+        m_response->sent = true;
+
+        if (!type.isEmpty())
+            m_response->type(type);
+
+        QPointer<QTcpSocket> socket = m_socket;
+
+        // cancellation may come from other thread, socket is closed in its own; ended stream
+        // is no longer connected and flushes its remaining data
+        m_cancellation.onCancel([socket]
+        {
+            if (!socket)
+                return;
+
+            QMetaObject::invokeMethod(socket.data(), [socket]
+            {
+                if (socket && socket->state() == QAbstractSocket::ConnectedState)
+                    socket->abort();
+            },
+            Qt::QueuedConnection);
+        });
+    }
+
+    //!
+    //! \brief Stream::isOpen
+    //! \return false once client is gone, request cancelled or stream ended
+    //!
+    inline bool Stream::isOpen() const
+    {
+        return !m_ended && m_socket && m_socket->state() == QAbstractSocket::ConnectedState
+            && !m_cancellation.isCancelled();
+    }
+
+    //!
+    //! \brief Stream::writable
+    //! \return true if socket buffer is below high watermark
+    //!
+    inline bool Stream::writable() const
+    {
+        return isOpen() && m_socket->bytesToWrite() < m_high;
+    }
+
+    //!
+    //! \brief Stream::setWatermark
+    //! buffered bytes above which stream is not writable, drain is signalled at half of it
+    //!
+    //! \param high watermark in bytes, 64KB by default
+    //! \return Stream chainable
+    //!
+    inline Stream &Stream::setWatermark(qint64 high)
+    {
+        m_high = high;
+        return *this;
+    }
+
+    //!
+    //! \brief Stream::write
+    //! send data as one chunk
+    //!
+    //! \param data chunk data, empty data is ignored as it would end the stream
+    //! \return false if stream is not open
+    //!
+    inline bool Stream::write(const QByteArray &data)
+    {
+        if (!isOpen())
+            return false;
+
+        m_write_head();
+
+        if (data.isEmpty())
+            return true;
+
+        if (m_chunked)
+            m_socket->write(QByteArray::number(data.size(), 16) + "\r\n" + data + "\r\n");
+        else
+            m_socket->write(data);
+
+        return true;
+    }
+
+    //!
+    //! \brief Stream::end
+    //! send terminating chunk and close connection
+    //!
+    inline void Stream::end()
+    {
+        if (!isOpen())
+            return;
+
+        m_write_head();
+
+        if (m_chunked)
+            m_socket->write("0\r\n\r\n");
+
+        m_ended = true;
+        m_socket->disconnectFromHost();
+    }
+
+    //!
+    //! \brief Stream::abort
+    //! stop stream on error, if nothing was sent yet client gets regular response with status,
+    //! otherwise connection is closed without terminating chunk so client sees incomplete body
+    //!
+    //! \param status HTTP status
+    //! \param body response body
+    //!
+    inline void Stream::abort(quint16 status, const QString &body)
+    {
+        if (!isOpen())
+            return;
+
+        if (!m_head_sent)
+        {
+            m_response->status(status).body(body.isEmpty() ? m_response->http_codes.value(status) : body);
+            m_socket->write(m_response->create_reply());
+            m_head_sent = true;
+        }
+
+        m_ended = true;
+        m_socket->disconnectFromHost();
+    }
+
+    //!
+    //! \brief Stream::onDrain
+    //! call f once when buffered data drops to half of the watermark, or right away if it's
+    //! already there. Not called if client goes away
+    //!
+    //! \param f function to be called
+    //!
+    inline void Stream::onDrain(std::function<void()> f)
+    {
+        if (!isOpen())
+            return;
+
+        qint64 low = m_high / 2;
+
+        if (m_socket->bytesToWrite() <= low)
+        {
+            f();
+            return;
+        }
+
+        auto connection = QSharedPointer<QMetaObject::Connection>::create();
+        QPointer<QTcpSocket> socket = m_socket;
+
+        *connection = QObject::connect(m_socket.data(), &QIODevice::bytesWritten, [connection, socket, low, f]
+        {
+            if (socket && socket->bytesToWrite() > low)
+                return;
+
+            QObject::disconnect(*connection);
+            f();
+        });
+    }
+
+    //!
+    //! \brief Stream::m_write_head
+    //! write status line and headers before first chunk
+    //!
+    inline void Stream::m_write_head()
+    {
+        if (m_head_sent)
+            return;
+
+        m_head_sent = true;
+
+        if (m_chunked)
+            m_response->setHeader("transfer-encoding", "chunked");
+
+        m_socket->write(m_response->create_head());
+    }
+}
+
+#endif
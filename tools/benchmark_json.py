@@ -0,0 +1,52 @@
+#!/usr/bin/env python
+
+#
+# convert QTest XML output of benchmarks to JSON
+#
+# usage:
+#
+# ./recurse_benchmarks -o results.xml,xml
+# python benchmark_json.py results.xml > results.json
+#
+# result: {"benchmarks": [{"name": "parse/small", "metric": "WalltimeMilliseconds",
+#                          "value": 0.0012, "iterations": 65536}, ...]}
+# value is per iteration
+#
+
+import argparse
+import json
+import sys
+import xml.etree.ElementTree as ElementTree
+
+# parse command-line arguments
+cli_parser = argparse.ArgumentParser()
+
+cli_parser.add_argument('input',
+                        help='QTest XML output file')
+cli_parser.add_argument('-o',
+                        '--output',
+                        help='JSON output file, standard output by default')
+
+args = cli_parser.parse_args()
+
+benchmarks = []
+
+for function in ElementTree.parse(args.input).getroot().iter('TestFunction'):
+    for result in function.iter('BenchmarkResult'):
+        iterations = int(result.get('iterations', '1')) or 1
+        name = function.get('name')
+
+        if result.get('tag'):
+            name += '/' + result.get('tag')
+
+        # QTest XML logger writes value per iteration already
+        benchmarks.append({
+            'name': name,
+            'metric': result.get('metric'),
+            'value': float(result.get('value')),
+            'iterations': iterations
+        })
+
+output = open(args.output, 'w') if args.output else sys.stdout
+json.dump({'benchmarks': benchmarks}, output, indent=2)
+output.write('\n')
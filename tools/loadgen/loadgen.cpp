@@ -0,0 +1,1363 @@
+/*
+*
+* HTTP load generator for benchmarking recurse applications end to end
+*
+* Requests are sent at fixed arrival rate (open loop) over keep-alive connections, optionally
+* pipelined and over TLS. Latency of every request is measured from the time it was supposed
+* to be sent, not when it was actually written, so requests delayed by a slow server count
+* with their full waiting time (coordinated omission correction, as in wrk2/HdrHistogram).
+* Without --rate every connection sends next request as soon as previous one finishes
+* (closed loop, maximum throughput), latency is then measured from actual send.
+*
+* Requests lost when server closes connection are sent again with their original time,
+* connection closed by server right after a response is not reused for more than one request
+* (recurse closes every connection after its response). Requests still waiting when the run
+* ends are recorded with the time they waited.
+*
+* qmake && make
+* ./recurse_loadgen http://127.0.0.1:3000/ -c 64 -t 2 -d 30 -r 5000 --no-keepalive
+* ./recurse_loadgen https://127.0.0.1:3020/ --insecure -p 8 --mix mix.txt --json result.json
+*
+* requests captured with Module::Capture are replayed at their original arrival times, scaled
+* with --speed (0 for as fast as possible), latency is reported per route
+*
+* ./recurse_loadgen http://127.0.0.1:3000/ --replay traffic.rcap --speed 2
+*
+* mix file, one request per line: weight method path [body file]
+*
+*     # 90% reads, 10% writes
+*     9 GET /api/items?id=42
+*     1 POST /api/items item.json
+*/
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDeadlineTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QSslSocket>
+#include <QTcpSocket>
+#include <QTextStream>
+#include <QThread>
+#include <QTimer>
+#include <QUrl>
+#include <QVector>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <limits>
+#include <random>
+
+#include <modules/capture.hpp>
+
+namespace
+{
+    qint64 now()
+    {
+        return QDeadlineTimer::current().deadlineNSecs();
+    }
+
+    //!
+    //! \brief The Histogram class
+    //! HdrHistogram-style latency histogram in microseconds, 2048 linear sub-buckets per
+    //! power of two, so every value is kept with 3 significant digits up to ~12 days
+    //!
+    class Histogram
+    {
+    public:
+        Histogram();
+
+        void record(qint64 usecs);
+        void add(const Histogram &other);
+
+        qint64 percentile(double q) const;
+        qint64 max() const;
+        double mean() const;
+        quint64 count() const;
+
+    private:
+        static constexpr int SubBits = 11;
+        static constexpr int Half = 1 << (SubBits - 1);
+        static constexpr int MaxBits = 40;
+        static constexpr int Size = (MaxBits - SubBits + 2) * Half;
+
+        QVector<quint64> m_counts;
+        quint64 m_count = 0;
+        qint64 m_max = 0;
+        double m_sum = 0;
+
+        static int m_index(quint64 value);
+        static qint64 m_highest(int index);
+    };
+
+    inline Histogram::Histogram()
+        : m_counts(Size, 0)
+    {
+    }
+
+    inline void Histogram::record(qint64 usecs)
+    {
+        quint64 value = quint64(qBound<qint64>(0, usecs, (qint64(1) << MaxBits) - 1));
+
+        ++m_counts[m_index(value)];
+        ++m_count;
+        m_max = qMax(m_max, qint64(value));
+        m_sum += value;
+    }
+
+    inline void Histogram::add(const Histogram &other)
+    {
+        for (int i = 0; i < Size; ++i)
+            m_counts[i] += other.m_counts.at(i);
+
+        m_count += other.m_count;
+        m_max = qMax(m_max, other.m_max);
+        m_sum += other.m_sum;
+    }
+
+    //!
+    //! \brief Histogram::percentile
+    //! \return highest value equivalent to q-th value (within histogram precision)
+    //!
+    inline qint64 Histogram::percentile(double q) const
+    {
+        if (!m_count)
+            return 0;
+
+        quint64 rank = qMax<quint64>(1, quint64(std::ceil(q * m_count)));
+        quint64 seen = 0;
+
+        for (int i = 0; i < Size; ++i)
+        {
+            seen += m_counts.at(i);
+
+            if (seen >= rank)
+                return qMin(m_highest(i), m_max);
+        }
+
+        return m_max;
+    }
+
+    inline qint64 Histogram::max() const
+    {
+        return m_max;
+    }
+
+    inline double Histogram::mean() const
+    {
+        return m_count ? m_sum / m_count : 0;
+    }
+
+    inline quint64 Histogram::count() const
+    {
+        return m_count;
+    }
+
+    inline int Histogram::m_index(quint64 value)
+    {
+        if (value < 2 * Half)
+            return int(value);
+
+        int bucket = (63 - qCountLeadingZeroBits(value)) - (SubBits - 1);
+        return bucket * Half + int(value >> bucket);
+    }
+
+    inline qint64 Histogram::m_highest(int index)
+    {
+        if (index < 2 * Half)
+            return index;
+
+        int bucket = index / Half - 1;
+        qint64 sub = index - bucket * Half;
+
+        return ((sub + 1) << bucket) - 1;
+    }
+
+    //!
+    //! \brief The Entry struct
+    //! request of mix or captured request, time is its arrival in capture (nanoseconds)
+    //!
+    struct Entry
+    {
+        int weight;
+        QByteArray data;
+        bool head;
+        int route;
+        qint64 time;
+    };
+
+    struct Options
+    {
+        QString host;
+        quint16 port;
+        bool secure;
+        bool insecure;
+        bool keepalive;
+        int connections;
+        int threads;
+        int pipeline;
+        double rate;
+        qint64 duration;
+        qint64 warmup;
+        quint32 seed;
+        QVector<Entry> mix;
+
+        QVector<Entry> replay;
+        double speed;
+
+        QVector<QByteArray> routes;
+        QHash<QByteArray, int> route_ids;
+
+        bool scheduled() const
+        {
+            return replay.isEmpty() ? rate > 0 : speed > 0;
+        }
+    };
+
+    struct Result
+    {
+        Histogram corrected;
+        Histogram uncorrected;
+
+        quint64 completed = 0;
+        quint64 statuses[6] = {};
+        quint64 connect_errors = 0;
+        quint64 lost = 0;
+        quint64 unsent = 0;
+        quint64 bytes = 0;
+        qint64 duration = 0;
+
+        //!
+        //! \brief routes
+        //! latency of every route, indexed as Options::routes
+        //!
+        QVector<Histogram> routes;
+
+        void add(const Result &other)
+        {
+            corrected.add(other.corrected);
+            uncorrected.add(other.uncorrected);
+            completed += other.completed;
+
+            if (routes.size() < other.routes.size())
+                routes.resize(other.routes.size());
+
+            for (int i = 0; i < other.routes.size(); ++i)
+                routes[i].add(other.routes.at(i));
+
+            for (int i = 0; i < 6; ++i)
+                statuses[i] += other.statuses[i];
+
+            connect_errors += other.connect_errors;
+            lost += other.lost;
+            unsent += other.unsent;
+            bytes += other.bytes;
+            duration = qMax(duration, other.duration);
+        }
+    };
+
+    struct Pending
+    {
+        qint64 intended;
+        qint64 sent;
+        const Entry *entry;
+    };
+
+    class Worker;
+
+    //!
+    //! \brief The Connection class
+    //! one client connection, writes requests and parses responses in order
+    //! (Content-Length, chunked or until close), reconnects when server closes it
+    //!
+    class Connection : public QObject
+    {
+    public:
+        Connection(Worker &worker, const Options &options);
+
+        void open();
+        bool ready() const;
+        const std::deque<Pending> &inFlight() const;
+        void send(const Entry &entry, qint64 intended);
+
+    private:
+        enum State
+        {
+            Head,
+            Body,
+            ChunkSize,
+            ChunkData,
+            Trailer,
+            UntilClose
+        };
+
+        Worker &m_worker;
+        const Options &m_options;
+
+        QTcpSocket *m_socket = nullptr;
+        bool m_connected = false;
+        bool m_closing = false;
+
+        //!
+        //! \brief m_single
+        //! server closed connection after a response without saying so, it doesn't keep
+        //! connections alive and every connection takes single request from now on
+        //!
+        bool m_single = false;
+        int m_responses = 0;
+
+        std::deque<Pending> m_pending;
+        QByteArray m_buffer;
+
+        State m_state = Head;
+        qint64 m_remaining = 0;
+        int m_status = 0;
+
+        void m_read();
+        bool m_parse();
+        void m_finish();
+        void m_closed();
+    };
+
+    //!
+    //! \brief The Worker class
+    //! connections and request schedule of one thread
+    //!
+    class Worker
+    {
+    public:
+        Worker(const Options &options, int index, int connections);
+        ~Worker();
+
+        void run();
+        const Result &result() const;
+
+        bool running() const;
+        void dispatch();
+        void completed(const Pending &pending, int status);
+        void received(qint64 bytes);
+        void lost(const std::deque<Pending> &pending);
+        void failed();
+
+    private:
+        const Options &m_options;
+        int m_connection_count;
+        QVector<Connection *> m_connections;
+        int m_cursor = 0;
+
+        std::mt19937 m_random;
+        int m_total_weight = 0;
+
+        struct Due
+        {
+            qint64 intended;
+            const Entry *entry;
+        };
+
+        qint64 m_interval = 0;
+        qint64 m_offset = 0;
+        qint64 m_start = 0;
+        qint64 m_measure = 0;
+        qint64 m_end = 0;
+        qint64 m_next = 0;
+        std::deque<Due> m_backlog;
+
+        QVector<const Entry *> m_replay;
+        int m_replayed = 0;
+
+        QEventLoop *m_loop = nullptr;
+        Result m_result;
+
+        bool m_scheduled() const;
+        void m_unfinished(qint64 intended, const Entry *entry, qint64 t);
+        const Entry &m_pick();
+        void m_tick();
+    };
+
+    inline Connection::Connection(Worker &worker, const Options &options)
+        : m_worker(worker),
+          m_options(options)
+    {
+    }
+
+    inline void Connection::open()
+    {
+        if (m_options.secure)
+        {
+            auto socket = new QSslSocket(this);
+
+            if (m_options.insecure)
+            {
+                connect(socket, static_cast<void (QSslSocket::*)(const QList<QSslError> &)>(&QSslSocket::sslErrors), socket, [socket]
+                {
+                    socket->ignoreSslErrors();
+                });
+            }
+
+            connect(socket, &QSslSocket::encrypted, this, [this]
+            {
+                m_connected = true;
+                m_worker.dispatch();
+            });
+
+            m_socket = socket;
+            socket->connectToHostEncrypted(m_options.host, m_options.port);
+        }
+        else
+        {
+            m_socket = new QTcpSocket(this);
+
+            connect(m_socket, &QTcpSocket::connected, this, [this]
+            {
+                m_connected = true;
+                m_worker.dispatch();
+            });
+
+            m_socket->connectToHost(m_options.host, m_options.port);
+        }
+
+        m_socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+
+        connect(m_socket, &QTcpSocket::readyRead, this, [this]
+        {
+            m_read();
+        });
+
+        connect(m_socket, &QTcpSocket::stateChanged, this, [this](QAbstractSocket::SocketState state)
+        {
+            if (state == QAbstractSocket::UnconnectedState)
+                m_closed();
+        });
+    }
+
+    //!
+    //! \brief Connection::ready
+    //! \return true if another request can be written, without keep-alive every connection
+    //! takes single request
+    //!
+    inline bool Connection::ready() const
+    {
+        if (!m_connected || m_closing)
+            return false;
+
+        if (!m_options.keepalive || m_single)
+            return m_pending.empty();
+
+        return int(m_pending.size()) < m_options.pipeline;
+    }
+
+    inline const std::deque<Pending> &Connection::inFlight() const
+    {
+        return m_pending;
+    }
+
+    inline void Connection::send(const Entry &entry, qint64 intended)
+    {
+        m_pending.push_back({ intended, now(), &entry });
+        m_socket->write(entry.data);
+
+        if (!m_options.keepalive || m_single)
+            m_closing = true;
+    }
+
+    inline void Connection::m_read()
+    {
+        QByteArray data = m_socket->readAll();
+
+        m_worker.received(data.size());
+        m_buffer += data;
+
+        while (m_parse())
+        {
+        }
+
+        // without keep-alive or when server asked for it, reconnect once responses are read
+        if (m_closing && m_pending.empty())
+        {
+            m_socket->abort();
+            return;
+        }
+
+        m_worker.dispatch();
+    }
+
+    //!
+    //! \brief Connection::m_parse
+    //! \return true if buffered data can be parsed further
+    //!
+    inline bool Connection::m_parse()
+    {
+        switch (m_state)
+        {
+        case Head:
+        {
+            int end = m_buffer.indexOf("\r\n\r\n");
+            if (end == -1)
+                return false;
+
+            QByteArray head = m_buffer.left(end + 2);
+            m_buffer.remove(0, end + 4);
+
+            m_status = head.mid(9, 3).toInt();
+
+            bool length = false;
+            bool chunked = false;
+
+            for (const auto &line : head.split('\n'))
+            {
+                QByteArray header = line.trimmed().toLower();
+
+                if (header.startsWith("content-length:"))
+                {
+                    m_remaining = header.mid(15).trimmed().toLongLong();
+                    length = true;
+                }
+                else if (header.startsWith("transfer-encoding:") && header.contains("chunked"))
+                    chunked = true;
+                else if (header.startsWith("connection:") && header.contains("close"))
+                    m_closing = true;
+            }
+
+            bool head_request = !m_pending.empty() && m_pending.front().entry->head;
+
+            if (head_request || m_status / 100 == 1 || m_status == 204 || m_status == 304)
+                m_finish();
+            else if (chunked)
+                m_state = ChunkSize;
+            else if (length && m_remaining == 0)
+                m_finish();
+            else
+                m_state = length ? Body : UntilClose;
+
+            return true;
+        }
+        case Body:
+        case ChunkData:
+        {
+            qint64 size = qMin<qint64>(m_remaining, m_buffer.size());
+
+            m_buffer.remove(0, int(size));
+            m_remaining -= size;
+
+            if (m_remaining)
+                return false;
+
+            if (m_state == Body)
+                m_finish();
+            else
+                m_state = ChunkSize;
+
+            return true;
+        }
+        case ChunkSize:
+        {
+            int end = m_buffer.indexOf("\r\n");
+            if (end == -1)
+                return false;
+
+            qint64 size = m_buffer.left(end).split(';').first().trimmed().toLongLong(nullptr, 16);
+            m_buffer.remove(0, end + 2);
+
+            if (size)
+            {
+                m_remaining = size + 2;
+                m_state = ChunkData;
+            }
+            else
+            {
+                m_state = Trailer;
+            }
+
+            return true;
+        }
+        case Trailer:
+        {
+            int end = m_buffer.indexOf("\r\n");
+            if (end == -1)
+                return false;
+
+            m_buffer.remove(0, end + 2);
+
+            if (!end)
+                m_finish();
+
+            return true;
+        }
+        case UntilClose:
+            m_buffer.clear();
+            return false;
+        }
+
+        return false;
+    }
+
+    inline void Connection::m_finish()
+    {
+        m_state = Head;
+
+        if (m_pending.empty())
+            return;
+
+        Pending pending = m_pending.front();
+        m_pending.pop_front();
+
+        ++m_responses;
+        m_worker.completed(pending, m_status);
+    }
+
+    inline void Connection::m_closed()
+    {
+        bool was_connected = m_connected;
+
+        // body delimited by end of connection is complete now
+        if (m_state == UntilClose)
+            m_finish();
+
+        if (!was_connected)
+            m_worker.failed();
+
+        // closed after a response, but requests written after it were not answered
+        if (m_responses && !m_pending.empty() && !m_closing)
+            m_single = true;
+
+        m_worker.lost(m_pending);
+
+        m_pending.clear();
+        m_buffer.clear();
+        m_state = Head;
+        m_connected = false;
+        m_closing = false;
+        m_responses = 0;
+
+        m_socket->disconnect(this);
+        m_socket->deleteLater();
+        m_socket = nullptr;
+
+        if (m_worker.running())
+            QTimer::singleShot(was_connected ? 0 : 100, this, [this]
+            {
+                open();
+            });
+    }
+
+    //!
+    //! \brief Worker::Worker
+    //! rate and captured requests are split between threads, arrivals of threads are interleaved
+    //!
+    //! \param options
+    //! \param index thread index
+    //! \param connections number of connections of this thread
+    //!
+    inline Worker::Worker(const Options &options, int index, int connections)
+        : m_options(options),
+          m_connection_count(connections),
+          m_random(options.seed + quint32(index))
+    {
+        for (const auto &entry : m_options.mix)
+            m_total_weight += entry.weight;
+
+        for (int i = index; i < m_options.replay.size(); i += m_options.threads)
+            m_replay.push_back(&m_options.replay.at(i));
+
+        if (m_options.rate > 0 && m_options.replay.isEmpty())
+        {
+            m_interval = qMax<qint64>(1, qint64(1e9 * m_options.threads / m_options.rate));
+            m_offset = qint64(index * 1e9 / m_options.rate);
+        }
+    }
+
+    inline Worker::~Worker()
+    {
+        qDeleteAll(m_connections);
+    }
+
+    //!
+    //! \brief Worker::run
+    //! run event loop of current thread until duration passes and responses are read
+    //!
+    inline void Worker::run()
+    {
+        QEventLoop loop;
+        m_loop = &loop;
+
+        m_start = now();
+        m_next = m_start + m_offset;
+
+        // replay ends once captured requests run out
+        if (m_options.replay.isEmpty())
+        {
+            m_measure = m_start + m_options.warmup;
+            m_end = m_measure + m_options.duration;
+        }
+        else
+        {
+            m_measure = m_start;
+            m_end = std::numeric_limits<qint64>::max();
+        }
+
+        for (int i = 0; i < m_connection_count; ++i)
+        {
+            m_connections.push_back(new Connection(*this, m_options));
+            m_connections.last()->open();
+        }
+
+        QTimer timer;
+        timer.setTimerType(Qt::PreciseTimer);
+        QObject::connect(&timer, &QTimer::timeout, [this]
+        {
+            m_tick();
+        });
+        timer.start(1);
+
+        loop.exec();
+
+        m_result.duration = qMin(now(), m_end) - m_measure;
+        m_loop = nullptr;
+    }
+
+    inline const Result &Worker::result() const
+    {
+        return m_result;
+    }
+
+    inline bool Worker::running() const
+    {
+        return now() < m_end;
+    }
+
+    //!
+    //! \brief Worker::dispatch
+    //! hand due requests to connections that can take them, requests keep their intended
+    //! send time while they wait
+    //!
+    inline void Worker::dispatch()
+    {
+        if (!running())
+            return;
+
+        for (int checked = 0; checked < m_connections.size(); ++checked)
+        {
+            Connection *connection = m_connections.at(m_cursor);
+
+            while (connection->ready())
+            {
+                // due requests and requests lost with closed connection go first
+                if (!m_backlog.empty())
+                {
+                    Due due = m_backlog.front();
+                    m_backlog.pop_front();
+
+                    connection->send(*due.entry, due.intended);
+                }
+                else if (m_scheduled())
+                {
+                    return;
+                }
+                else if (!m_options.replay.isEmpty())
+                {
+                    if (m_replayed == m_replay.size())
+                        return;
+
+                    connection->send(*m_replay.at(m_replayed++), now());
+                }
+                else
+                {
+                    connection->send(m_pick(), now());
+                }
+            }
+
+            m_cursor = (m_cursor + 1) % m_connections.size();
+        }
+    }
+
+    inline void Worker::completed(const Pending &pending, int status)
+    {
+        if (pending.intended < m_measure || pending.intended >= m_end)
+            return;
+
+        qint64 t = now();
+
+        m_result.corrected.record((t - pending.intended) / 1000);
+        m_result.uncorrected.record((t - pending.sent) / 1000);
+
+        if (m_result.routes.size() <= pending.entry->route)
+            m_result.routes.resize(pending.entry->route + 1);
+
+        m_result.routes[pending.entry->route].record((t - pending.intended) / 1000);
+        m_result.statuses[qBound(0, status / 100, 5)]++;
+        m_result.completed++;
+    }
+
+    inline void Worker::received(qint64 bytes)
+    {
+        m_result.bytes += quint64(bytes);
+    }
+
+    //!
+    //! \brief Worker::lost
+    //! requests of closed connection, they are sent again with their original intended time
+    //! so that the wait counts into their latency
+    //!
+    inline void Worker::lost(const std::deque<Pending> &pending)
+    {
+        m_result.lost += quint64(pending.size());
+
+        for (auto it = pending.rbegin(); it != pending.rend(); ++it)
+            m_backlog.push_front({ it->intended, it->entry });
+    }
+
+    inline void Worker::failed()
+    {
+        m_result.connect_errors++;
+    }
+
+    //!
+    //! \brief Worker::m_scheduled
+    //! \return true if requests are sent at given times (fixed rate or timed replay), not as
+    //! fast as possible
+    //!
+    inline bool Worker::m_scheduled() const
+    {
+        return m_options.replay.isEmpty() ? m_interval > 0 : m_options.speed > 0;
+    }
+
+    //!
+    //! \brief Worker::m_unfinished
+    //! request without response when run ends, its latency is at least the time it waited
+    //!
+    inline void Worker::m_unfinished(qint64 intended, const Entry *entry, qint64 t)
+    {
+        if (intended < m_measure || intended >= m_end)
+            return;
+
+        m_result.corrected.record((t - intended) / 1000);
+
+        if (m_result.routes.size() <= entry->route)
+            m_result.routes.resize(entry->route + 1);
+
+        m_result.routes[entry->route].record((t - intended) / 1000);
+    }
+
+    inline const Entry &Worker::m_pick()
+    {
+        if (m_options.mix.size() == 1)
+            return m_options.mix.first();
+
+        int pick = std::uniform_int_distribution<int>(0, m_total_weight - 1)(m_random);
+
+        for (const auto &entry : m_options.mix)
+        {
+            pick -= entry.weight;
+
+            if (pick < 0)
+                return entry;
+        }
+
+        return m_options.mix.last();
+    }
+
+    inline void Worker::m_tick()
+    {
+        qint64 t = now();
+
+        if (t < m_end)
+        {
+            while (m_interval && m_next <= t)
+            {
+                m_backlog.push_back({ m_next, &m_pick() });
+                m_next += m_interval;
+            }
+
+            // captured arrival times, scaled by speed
+            while (m_scheduled() && m_replayed < m_replay.size())
+            {
+                const Entry *entry = m_replay.at(m_replayed);
+                qint64 intended = m_start + qint64(entry->time / m_options.speed);
+
+                if (intended > t)
+                    break;
+
+                m_backlog.push_back({ intended, entry });
+                ++m_replayed;
+            }
+
+            dispatch();
+
+            if (m_options.replay.isEmpty() || m_replayed < m_replay.size() || !m_backlog.empty())
+                return;
+
+            m_end = t;
+        }
+
+        // requests that were due but never got a free connection
+        m_result.unsent += m_backlog.size();
+
+        for (const auto &due : m_backlog)
+            m_unfinished(due.intended, due.entry, m_end);
+
+        m_backlog.clear();
+
+        int in_flight = 0;
+        for (auto connection : m_connections)
+            in_flight += int(connection->inFlight().size());
+
+        // give responses in flight 2 seconds, rest is lost
+        if (!in_flight || t >= m_end + 2000000000LL)
+        {
+            m_result.lost += quint64(in_flight);
+
+            for (auto connection : m_connections)
+            {
+                for (const auto &pending : connection->inFlight())
+                    m_unfinished(pending.intended, pending.entry, t);
+            }
+
+            m_loop->quit();
+        }
+    }
+
+    class WorkerThread : public QThread
+    {
+    public:
+        WorkerThread(const Options &options, int index, int connections)
+            : m_options(options),
+              m_index(index),
+              m_connections(connections)
+        {
+        }
+
+        Result result;
+
+    protected:
+        void run() override
+        {
+            Worker worker(m_options, m_index, m_connections);
+            worker.run();
+            result = worker.result();
+        }
+
+    private:
+        const Options &m_options;
+        int m_index;
+        int m_connections;
+    };
+
+    //!
+    //! \brief route
+    //! route of request for latency breakdown, method and path without query, numeric path
+    //! segments are replaced with ":n", eg: "GET /users/:n/posts"
+    //!
+    //! \return int index into Options::routes
+    //!
+    int route(Options &options, const QByteArray &request)
+    {
+        QList<QByteArray> line = request.left(request.indexOf("\r\n")).split(' ');
+        QByteArray path = line.value(1);
+
+        int query = path.indexOf('?');
+        if (query != -1)
+            path.truncate(query);
+
+        QList<QByteArray> segments = path.split('/');
+
+        for (auto &segment : segments)
+        {
+            bool numeric = false;
+            segment.toLongLong(&numeric);
+
+            if (numeric)
+                segment = ":n";
+        }
+
+        QByteArray name = line.value(0) + " " + segments.join('/');
+
+        auto id = options.route_ids.constFind(name);
+        if (id != options.route_ids.constEnd())
+            return id.value();
+
+        // keep report readable, rest of routes is counted together
+        if (options.routes.size() >= 200)
+            name = "other";
+
+        if (!options.route_ids.contains(name))
+        {
+            options.route_ids.insert(name, options.routes.size());
+            options.routes.push_back(name);
+        }
+
+        return options.route_ids.value(name);
+    }
+
+    QByteArray request(const Options &options, const QByteArray &method, const QByteArray &path,
+        const QByteArray &body, const QList<QByteArray> &headers)
+    {
+        QByteArray data = method + " " + path + " HTTP/1.1\r\n";
+        data += "Host: " + options.host.toUtf8() + ":" + QByteArray::number(options.port) + "\r\n";
+
+        for (const auto &header : headers)
+            data += header + "\r\n";
+
+        if (!options.keepalive)
+            data += "Connection: close\r\n";
+
+        if (!body.isEmpty() || method == "POST" || method == "PUT" || method == "PATCH")
+            data += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+
+        return data + "\r\n" + body;
+    }
+
+    //!
+    //! \brief mix
+    //! parse request mix lines "weight method path [body file]"
+    //!
+    bool mix(Options &options, const QStringList &lines, const QList<QByteArray> &headers, QString &error)
+    {
+        for (const auto &line : lines)
+        {
+            QString trimmed = line.trimmed();
+
+            if (trimmed.isEmpty() || trimmed.startsWith('#'))
+                continue;
+
+            QStringList parts = trimmed.split(' ', QString::SkipEmptyParts);
+            bool ok = false;
+            int weight = parts.value(0).toInt(&ok);
+
+            if (parts.size() < 3 || !ok || weight < 1)
+            {
+                error = "invalid request mix line: " + line;
+                return false;
+            }
+
+            QByteArray body;
+
+            if (parts.size() > 3)
+            {
+                QFile file(parts.at(3));
+
+                if (!file.open(QIODevice::ReadOnly))
+                {
+                    error = "can't read body file: " + parts.at(3);
+                    return false;
+                }
+
+                body = file.readAll();
+            }
+
+            QByteArray method = parts.at(1).toUpper().toLatin1();
+            QByteArray path = parts.at(2).toUtf8();
+
+            QByteArray data = request(options, method, path, body, headers);
+            options.mix.push_back({ weight, data, method == "HEAD", route(options, data), 0 });
+        }
+
+        return true;
+    }
+
+    void report(const Options &options, const Result &result)
+    {
+        QTextStream out(stdout);
+        double seconds = qMax(1e-9, double(result.duration) / 1e9);
+
+        out << "connections: " << options.connections << ", threads: " << options.threads
+            << ", pipeline: " << options.pipeline << (options.keepalive ? "" : ", no keep-alive")
+            << (options.secure ? ", TLS" : "") << "\n";
+
+        if (!options.replay.isEmpty())
+            out << "replay: " << options.replay.size() << " requests, "
+                << (options.speed > 0 ? QString::number(options.speed) + "x speed" : QString("maximum speed")) << "\n";
+        else if (options.rate > 0)
+            out << "target rate: " << options.rate << " req/s\n";
+
+        out << "requests: " << result.completed << " in " << QString::number(seconds, 'f', 2) << " s, "
+            << QString::number(result.completed / seconds, 'f', 1) << " req/s, "
+            << QString::number(result.bytes / seconds / 1048576, 'f', 2) << " MB/s\n";
+
+        out << "responses: 2xx " << result.statuses[2] << ", 3xx " << result.statuses[3]
+            << ", 4xx " << result.statuses[4] << ", 5xx " << result.statuses[5] << "\n";
+
+        out << "errors: connect " << result.connect_errors << ", lost " << result.lost
+            << ", unsent " << result.unsent << "\n";
+
+        const double percentiles[] = { 0.5, 0.75, 0.9, 0.99, 0.999, 0.9999, 1.0 };
+
+        auto table = [&](const char *title, const Histogram &histogram)
+        {
+            out << "\n" << title << " (ms), mean " << QString::number(histogram.mean() / 1000, 'f', 3) << "\n";
+
+            for (double q : percentiles)
+            {
+                out << qSetFieldWidth(10) << QString::number(q * 100, 'g', 6) + "%" << qSetFieldWidth(0)
+                    << QString::number(histogram.percentile(q) / 1000.0, 'f', 3) << "\n";
+            }
+        };
+
+        if (options.scheduled())
+        {
+            table("latency, corrected for coordinated omission", result.corrected);
+            table("service time, from actual send", result.uncorrected);
+        }
+        else
+        {
+            table("latency", result.uncorrected);
+        }
+
+        if (options.routes.size() < 2)
+            return;
+
+        // busiest routes first
+        QVector<int> order;
+        for (int i = 0; i < result.routes.size(); ++i)
+        {
+            if (result.routes.at(i).count())
+                order.push_back(i);
+        }
+
+        std::sort(order.begin(), order.end(), [&result](int a, int b)
+        {
+            return result.routes.at(a).count() > result.routes.at(b).count();
+        });
+
+        out << "\nroutes (ms)\n";
+        out << qSetFieldWidth(10) << "requests" << "p50" << "p99" << "max" << qSetFieldWidth(0) << "  route\n";
+
+        for (int i : order)
+        {
+            const Histogram &histogram = result.routes.at(i);
+
+            out << qSetFieldWidth(10) << histogram.count()
+                << QString::number(histogram.percentile(0.5) / 1000.0, 'f', 3)
+                << QString::number(histogram.percentile(0.99) / 1000.0, 'f', 3)
+                << QString::number(histogram.max() / 1000.0, 'f', 3)
+                << qSetFieldWidth(0) << "  " << options.routes.at(i) << "\n";
+        }
+    }
+
+    QByteArray json(const Options &options, const Result &result)
+    {
+        QByteArray out;
+        Recurse::JsonWriter json(out);
+
+        double seconds = qMax(1e-9, double(result.duration) / 1e9);
+
+        auto histogram = [&json](const Histogram &histogram)
+        {
+            const double percentiles[] = { 0.5, 0.75, 0.9, 0.99, 0.999, 0.9999 };
+
+            json.beginObject();
+            json.key("requests").value(histogram.count());
+            json.key("mean_ms").value(histogram.mean() / 1000);
+            json.key("max_ms").value(histogram.max() / 1000.0);
+
+            for (double q : percentiles)
+                json.key("p" + QString::number(q * 100, 'g', 6)).value(histogram.percentile(q) / 1000.0);
+
+            json.endObject();
+        };
+
+        json.beginObject();
+        json.key("connections").value(options.connections);
+        json.key("threads").value(options.threads);
+        json.key("pipeline").value(options.pipeline);
+        json.key("keepalive").value(options.keepalive);
+        json.key("tls").value(options.secure);
+        json.key("rate").value(options.rate);
+        json.key("duration_s").value(seconds);
+        json.key("requests").value(result.completed);
+        json.key("throughput").value(result.completed / seconds);
+        json.key("bytes").value(result.bytes);
+
+        json.key("status").beginObject();
+        for (int i = 1; i < 6; ++i)
+            json.key(QString::number(i) + "xx").value(result.statuses[i]);
+        json.endObject();
+
+        json.key("errors").beginObject();
+        json.key("connect").value(result.connect_errors);
+        json.key("lost").value(result.lost);
+        json.key("unsent").value(result.unsent);
+        json.endObject();
+
+        json.key("latency");
+        histogram(options.scheduled() ? result.corrected : result.uncorrected);
+
+        json.key("service_time");
+        histogram(result.uncorrected);
+
+        json.key("routes").beginObject();
+
+        for (int i = 0; i < result.routes.size(); ++i)
+        {
+            if (!result.routes.at(i).count())
+                continue;
+
+            json.key(QString::fromUtf8(options.routes.at(i)));
+            histogram(result.routes.at(i));
+        }
+
+        json.endObject();
+
+        json.endObject();
+        json.flush();
+
+        return out + "\n";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("HTTP load generator with coordinated omission corrected latency");
+    parser.addHelpOption();
+    parser.addPositionalArgument("url", "target, eg: http://127.0.0.1:3000/");
+
+    parser.addOptions({
+        { { "c", "connections" }, "Number of connections, 16 by default.", "n", "16" },
+        { { "t", "threads" }, "Number of threads, 1 by default.", "n", "1" },
+        { { "d", "duration" }, "Measured seconds, 10 by default.", "s", "10" },
+        { { "w", "warmup" }, "Seconds of load before measuring, 0 by default.", "s", "0" },
+        { { "r", "rate" }, "Requests per second (open loop), 0 for as fast as possible.", "n", "0" },
+        { { "p", "pipeline" }, "Requests in flight per connection, 1 by default.", "n", "1" },
+        { { "H", "header" }, "Request header, eg: \"Accept: application/json\".", "header" },
+        { { "m", "request" }, "Request of mix: \"weight method path [body file]\".", "request" },
+        { "mix", "File with request mix, one request per line.", "file" },
+        { "no-keepalive", "New connection for every request." },
+        { "insecure", "Ignore TLS certificate errors." },
+        { "seed", "Seed of request mix, 1 by default.", "n", "1" },
+        { "json", "Write result as JSON into file, \"-\" for standard output.", "file" },
+        { "replay", "Replay requests captured with Module::Capture instead of request mix.", "file" },
+        { "speed", "Replay speed, 1 for original arrival times, 0 for as fast as possible.", "x", "1" },
+    });
+
+    parser.process(app);
+
+    QTextStream err(stderr);
+
+    if (parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    QUrl url(parser.positionalArguments().first());
+
+    if (!url.isValid() || (url.scheme() != "http" && url.scheme() != "https"))
+    {
+        err << "invalid url, http:// or https:// expected\n";
+        return 1;
+    }
+
+    Options options;
+    options.secure = url.scheme() == "https";
+    options.host = url.host();
+    options.port = quint16(url.port(options.secure ? 443 : 80));
+    options.insecure = parser.isSet("insecure");
+    options.keepalive = !parser.isSet("no-keepalive");
+    options.connections = qMax(1, parser.value("connections").toInt());
+    options.threads = qBound(1, parser.value("threads").toInt(), options.connections);
+    options.pipeline = qMax(1, parser.value("pipeline").toInt());
+    options.rate = qMax(0.0, parser.value("rate").toDouble());
+    options.duration = qint64(qMax(0.001, parser.value("duration").toDouble()) * 1e9);
+    options.warmup = qint64(qMax(0.0, parser.value("warmup").toDouble()) * 1e9);
+    options.seed = parser.value("seed").toUInt();
+    options.speed = qMax(0.0, parser.value("speed").toDouble());
+
+    if (options.secure && !QSslSocket::supportsSsl())
+    {
+        err << "TLS is not supported by this Qt build\n";
+        return 1;
+    }
+
+    QList<QByteArray> headers;
+    for (const auto &header : parser.values("header"))
+        headers.push_back(header.toUtf8());
+
+    QStringList lines = parser.values("request");
+
+    if (parser.isSet("mix"))
+    {
+        QFile file(parser.value("mix"));
+
+        if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        {
+            err << "can't read mix file: " << parser.value("mix") << "\n";
+            return 1;
+        }
+
+        lines += QString::fromUtf8(file.readAll()).split('\n');
+    }
+
+    if (lines.isEmpty())
+    {
+        QByteArray path = url.path(QUrl::FullyEncoded).toUtf8();
+
+        if (url.hasQuery())
+            path += "?" + url.query(QUrl::FullyEncoded).toUtf8();
+
+        lines.push_back("1 GET " + QString::fromUtf8(path.isEmpty() ? "/" : path));
+    }
+
+    QString error;
+
+    if (parser.isSet("replay"))
+    {
+        // captured requests are sent as they are, including their Host header
+        for (const auto &record : Module::Capture::load(parser.value("replay"), &error))
+        {
+            bool head = record.data.startsWith("HEAD ");
+            options.replay.push_back({ 1, record.data, head, route(options, record.data), record.time });
+        }
+
+        if (options.replay.isEmpty())
+        {
+            err << "can't replay " << parser.value("replay") << ": " << (error.isEmpty() ? "no requests" : error) << "\n";
+            return 1;
+        }
+    }
+    else if (!mix(options, lines, headers, error))
+    {
+        err << error << "\n";
+        return 1;
+    }
+
+    QVector<WorkerThread *> threads;
+
+    for (int i = 0; i < options.threads; ++i)
+    {
+        int connections = options.connections / options.threads + (i < options.connections % options.threads ? 1 : 0);
+        threads.push_back(new WorkerThread(options, i, connections));
+    }
+
+    for (auto thread : threads)
+        thread->start();
+
+    Result result;
+
+    for (auto thread : threads)
+    {
+        thread->wait();
+        result.add(thread->result);
+    }
+
+    qDeleteAll(threads);
+
+    report(options, result);
+
+    if (parser.isSet("json"))
+    {
+        QFile file(parser.value("json"));
+        bool opened;
+
+        if (parser.value("json") == "-")
+            opened = file.open(stdout, QIODevice::WriteOnly);
+        else
+            opened = file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+
+        if (!opened || file.write(json(options, result)) == -1)
+        {
+            err << "can't write json file: " << parser.value("json") << "\n";
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,33 @@
+TARGET = recurse_loadgen
+
+QT       += core network
+QT       -= gui
+
+CONFIG   += console
+CONFIG   += c++14
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+SOURCES += loadgen.cpp
+HEADERS += ../../recurse.hpp \
+           ../../request.hpp \
+           ../../response.hpp \
+           ../../context.hpp \
+           ../../executor.hpp \
+           ../../stream.hpp \
+           ../../json.hpp \
+           ../../writer.hpp \
+           ../../metrics.hpp \
+           ../../profiler.hpp \
+           ../../trace.hpp \
+           ../../watchdog.hpp \
+           ../../modules/capture.hpp
+
+QMAKE_CXXFLAGS += -std=c++14
+
+macx {
+    QMAKE_CXXFLAGS += -stdlib=libc++
+}
+
+INCLUDEPATH += $$PWD/../../
@@ -0,0 +1,259 @@
+#ifndef RECURSE_TRACE_HPP
+#define RECURSE_TRACE_HPP
+
+#include <QCoreApplication>
+#include <QDeadlineTimer>
+#include <QFile>
+#include <QHash>
+#include <QVector>
+
+#include "json.hpp"
+
+//
+// USDT (statically defined tracing) probes, provider "recurse"
+//
+// probes are single nop instructions until tracer attaches to them, eg:
+//
+//     bpftrace -e 'usdt:./app:recurse:middleware_enter { @start[arg0, arg1] = nsecs; }'
+//
+// available when systemtap's <sys/sdt.h> is found, define RECURSE_NO_USDT to leave them out
+//
+//     accept(fd)                   connection accepted
+//     tls_done(fd)                 TLS handshake finished
+//     connection(socket, fd)       connection handed to application, socket is id used below
+//     first_byte(socket)           first request data read
+//     headers(socket)              request head parsed
+//     middleware_enter(socket, i)  i-th middleware called
+//     middleware_exit(socket, i)   i-th middleware returned
+//     serialized(socket, bytes)    response serialized and handed to writer
+//     written(socket)              last response byte written
+//
+#if !defined(RECURSE_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RECURSE_USDT
+#endif
+#endif
+
+#ifdef RECURSE_USDT
+#define RECURSE_PROBE1(name, a) DTRACE_PROBE1(recurse, name, a)
+#define RECURSE_PROBE2(name, a, b) DTRACE_PROBE2(recurse, name, a, b)
+#else
+#define RECURSE_PROBE1(name, a) \
+    do                          \
+    {                           \
+    } while (0)
+#define RECURSE_PROBE2(name, a, b) \
+    do                             \
+    {                              \
+    } while (0)
+#endif
+
+namespace Recurse
+{
+
+    //!
+    //! \brief The Tracer class
+    //! In-process recorder of request lifecycle events, dumped as Chrome trace-event JSON
+    //! (chrome://tracing, Perfetto)
+    //!
+    //! Events go into fixed-size ring buffer, oldest are overwritten. Connections are async
+    //! spans with lifecycle stages as instant events, middlewares are nested duration events.
+    //! Recorder is used from application thread only.
+    //!
+    //!     app.trace(100000);
+    //!     ...
+    //!     app.tracer().dump("/tmp/recurse.json");
+    //!
+    class Tracer
+    {
+    public:
+        void enable(int capacity = 65536);
+        bool isEnabled() const;
+
+        void begin(const char *name, quintptr id, qint64 ts = 0);
+        void end(const char *name, quintptr id);
+        void instant(const char *name, quintptr id, qint64 arg = -1);
+        void enter(int index, quintptr id, bool upstream = false);
+        void exit(int index, quintptr id, bool upstream = false);
+
+        void name(int index, const QString &name);
+
+        QByteArray dump() const;
+        bool dump(const QString &path) const;
+
+        static qint64 now();
+
+    private:
+        struct Event
+        {
+            const char *name;
+            char phase;
+            bool upstream;
+            int index;
+            qint64 arg;
+            quintptr id;
+            qint64 ts;
+        };
+
+        QVector<Event> m_events;
+        quint64 m_head = 0;
+        QHash<int, QString> m_names;
+
+        void m_record(const Event &event);
+    };
+
+    //!
+    //! \brief Tracer::enable
+    //! start recording
+    //!
+    //! \param capacity number of events kept
+    //!
+    inline void Tracer::enable(int capacity)
+    {
+        m_events.resize(qMax(1, capacity));
+        m_head = 0;
+    }
+
+    inline bool Tracer::isEnabled() const
+    {
+        return !m_events.isEmpty();
+    }
+
+    inline qint64 Tracer::now()
+    {
+        return QDeadlineTimer::current().deadlineNSecs();
+    }
+
+    //!
+    //! \brief Tracer::begin
+    //! start async span, eg: connection
+    //!
+    //! \param name static string, it is not copied
+    //! \param id span id
+    //! \param ts monotonic timestamp in nanoseconds, 0 for now
+    //!
+    inline void Tracer::begin(const char *name, quintptr id, qint64 ts)
+    {
+        m_record({ name, 'b', false, -1, -1, id, ts ? ts : now() });
+    }
+
+    inline void Tracer::end(const char *name, quintptr id)
+    {
+        m_record({ name, 'e', false, -1, -1, id, now() });
+    }
+
+    //!
+    //! \brief Tracer::instant
+    //! stage of async span
+    //!
+    //! \param name static string, it is not copied
+    //! \param id span id
+    //! \param arg optional value, eg: bytes
+    //!
+    inline void Tracer::instant(const char *name, quintptr id, qint64 arg)
+    {
+        m_record({ name, 'n', false, -1, arg, id, now() });
+    }
+
+    inline void Tracer::enter(int index, quintptr id, bool upstream)
+    {
+        m_record({ nullptr, 'B', upstream, index, -1, id, now() });
+    }
+
+    inline void Tracer::exit(int index, quintptr id, bool upstream)
+    {
+        m_record({ nullptr, 'E', upstream, index, -1, id, now() });
+    }
+
+    //!
+    //! \brief Tracer::name
+    //! set middleware name shown in trace
+    //!
+    inline void Tracer::name(int index, const QString &name)
+    {
+        m_names[index] = name;
+    }
+
+    //!
+    //! \brief Tracer::dump
+    //! \return recorded events as Chrome trace-event JSON
+    //!
+    inline QByteArray Tracer::dump() const
+    {
+        QByteArray out;
+        JsonWriter json(out);
+
+        qint64 pid = QCoreApplication::applicationPid();
+        quint64 size = qMin<quint64>(m_head, quint64(m_events.size()));
+
+        json.beginObject().key("traceEvents").beginArray();
+
+        for (quint64 i = m_head - size; i < m_head; ++i)
+        {
+            const Event &event = m_events.at(int(i % quint64(m_events.size())));
+
+            json.beginObject();
+
+            if (event.name)
+            {
+                json.key("name").value(event.name);
+                json.key("id").value(QString::number(event.id, 16));
+            }
+            else
+            {
+                QString name = m_names.value(event.index, "mw" + QString::number(event.index));
+
+                if (event.upstream)
+                    name += " upstream";
+
+                json.key("name").value(name);
+            }
+
+            json.key("cat").value("recurse");
+            json.key("ph").value(QString(QChar(event.phase)));
+            json.key("ts").value(double(event.ts) / 1000);
+            json.key("pid").value(pid);
+            json.key("tid").value(1);
+
+            json.key("args").beginObject();
+            json.key("connection").value(QString::number(event.id, 16));
+
+            if (event.arg >= 0)
+                json.key("value").value(event.arg);
+
+            json.endObject();
+
+            json.endObject();
+        }
+
+        json.endArray().endObject();
+        json.flush();
+
+        return out;
+    }
+
+    //!
+    //! \brief Tracer::dump
+    //! overloaded function, write trace to file
+    //!
+    //! \return false if file can't be written
+    //!
+    inline bool Tracer::dump(const QString &path) const
+    {
+        QFile file(path);
+
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+            return false;
+
+        return file.write(dump()) != -1;
+    }
+
+    inline void Tracer::m_record(const Event &event)
+    {
+        m_events[int(m_head % quint64(m_events.size()))] = event;
+        ++m_head;
+    }
+}
+
+#endif
@@ -0,0 +1,508 @@
+#ifndef RECURSE_WATCHDOG_HPP
+#define RECURSE_WATCHDOG_HPP
+
+#include <QAtomicInteger>
+#include <QDeadlineTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPointer>
+#include <QStringList>
+#include <QThread>
+#include <QTimer>
+#include <QUrl>
+#include <QVector>
+#include <QWaitCondition>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include "metrics.hpp"
+
+#if defined(Q_OS_LINUX) && defined(__GLIBC__)
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#define RECURSE_WATCHDOG_STACKS
+#endif
+
+namespace Recurse
+{
+
+    //!
+    //! \brief The Watchdog class
+    //! Detects event loops blocked by long running code
+    //!
+    //! Every watched loop runs heartbeat timer, its delay is event loop lag. Separate thread
+    //! checks heartbeats and reports loops that did not beat for longer than threshold, with
+    //! middleware index and request url that were running (see Application::watch()) and
+    //! stack of the blocked thread, sampled with signal (Linux/glibc).
+    //!
+    //! Reports are delivered from watchdog thread while loop is still blocked.
+    //!
+    //!     app.watch({{ "threshold", 200 }});
+    //!     app.watchdog()->onStall([](const Recurse::Watchdog::Stall &stall)
+    //!     {
+    //!         qWarning() << stall.url << stall.middleware << stall.stack;
+    //!     });
+    //!
+    class Watchdog
+    {
+    public:
+        //!
+        //! \brief The Stall struct
+        //! blocked event loop report
+        //!
+        struct Stall
+        {
+            QString loop;
+            qint64 duration = 0;
+            int middleware = -1;
+            QString url;
+            QStringList stack;
+        };
+
+        //!
+        //! \brief The Running struct
+        //! what watched loop is running, used to restore it once nested middleware returns
+        //!
+        struct Running
+        {
+            const void *request = nullptr;
+            int middleware = -1;
+        };
+
+        Watchdog(const QHash<QString, QVariant> &options = QHash<QString, QVariant>(), Metrics *metrics = nullptr);
+        ~Watchdog();
+
+        void watch(QThread *thread, const QString &name);
+        void onStall(std::function<void(const Stall &stall)> f);
+
+        Running enter(const void *request, int middleware, const QUrl &url);
+        void restore(const Running &previous);
+
+        quint64 stalls() const;
+
+    private:
+        //!
+        //! \brief The Loop struct
+        //! state of watched event loop, written by loop thread and read by watchdog thread
+        //!
+        struct Loop
+        {
+            QString name;
+            QPointer<QTimer> timer;
+
+            QAtomicInteger<qint64> beat;
+            qint64 expected = 0;
+            qint64 reported = 0;
+
+            QAtomicInt middleware{ -1 };
+            const void *request = nullptr;
+
+            // url of running request, guarded by sequence number (odd while being written)
+            QAtomicInteger<quint32> sequence;
+            char url[256];
+            int url_size = 0;
+
+#ifdef RECURSE_WATCHDOG_STACKS
+            QAtomicInt has_thread;
+            pthread_t thread;
+#endif
+        };
+
+        qint64 m_interval;
+        qint64 m_threshold;
+        int m_signal;
+        Metrics *m_metrics;
+
+        std::function<void(const Stall &stall)> m_on_stall;
+
+        QMutex m_mutex;
+        QWaitCondition m_wake;
+        bool m_stop = false;
+        std::vector<std::unique_ptr<Loop>> m_loops;
+        Loop *m_main = nullptr;
+        std::thread m_thread;
+        QAtomicInteger<quint64> m_stalls;
+
+        void m_run();
+        bool m_check(Loop &loop, qint64 now, Stall &stall);
+        QString m_url(Loop &loop);
+        QStringList m_stack(Loop &loop);
+
+#ifdef RECURSE_WATCHDOG_STACKS
+        struct Sample
+        {
+            void *frames[64];
+            QAtomicInt depth;
+            QAtomicInt done;
+        };
+
+        static Sample &m_sample();
+        static void m_signal_handler(int);
+
+        struct sigaction m_previous_action;
+#endif
+    };
+
+    //!
+    //! \brief Watchdog::Watchdog
+    //!
+    //! \param options QHash options of <QString, QVariant>
+    //!     "interval" heartbeat interval in milliseconds, 10 by default
+    //!     "threshold" milliseconds without heartbeat reported as stall, 100 by default
+    //!     "stack_signal" signal used to sample stack of blocked thread, SIGURG by default,
+    //!         0 to disable sampling (Linux/glibc only)
+    //! \param metrics optional, lag histogram and stalls counter are recorded there
+    //!
+    inline Watchdog::Watchdog(const QHash<QString, QVariant> &options, Metrics *metrics)
+        : m_metrics(metrics)
+    {
+        m_interval = qMax(1, options.value("interval", 10).toInt());
+        m_threshold = qMax(1, options.value("threshold", 100).toInt());
+        m_signal = 0;
+
+        m_on_stall = [](const Stall &stall)
+        {
+            std::cerr << "(recurse watchdog) " << stall.loop.toStdString() << " event loop blocked for "
+                      << stall.duration << " ms, middleware " << stall.middleware << ", url "
+                      << stall.url.toStdString() << std::endl;
+
+            for (const auto &frame : stall.stack)
+                std::cerr << "    " << frame.toStdString() << std::endl;
+        };
+
+#ifdef RECURSE_WATCHDOG_STACKS
+        m_signal = options.value("stack_signal", SIGURG).toInt();
+
+        if (m_signal)
+        {
+            // first backtrace() loads unwinder, it must not happen inside of signal handler
+            void *frames[1];
+            backtrace(frames, 1);
+            m_sample();
+
+            struct sigaction action;
+            std::memset(&action, 0, sizeof(action));
+            action.sa_handler = &Watchdog::m_signal_handler;
+            action.sa_flags = SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            sigaction(m_signal, &action, &m_previous_action);
+        }
+#endif
+
+        m_thread = std::thread([this]
+        {
+            m_run();
+        });
+    }
+
+    inline Watchdog::~Watchdog()
+    {
+        {
+            QMutexLocker lock(&m_mutex);
+            m_stop = true;
+            m_wake.wakeAll();
+        }
+
+        m_thread.join();
+
+#ifdef RECURSE_WATCHDOG_STACKS
+        // handler is process-wide, give signal back to whoever had it
+        if (m_signal)
+            sigaction(m_signal, &m_previous_action, nullptr);
+#endif
+
+        for (const auto &loop : m_loops)
+        {
+            if (!loop->timer)
+                continue;
+
+            // heartbeats must not reach freed loop state before timer is deleted
+            QObject::disconnect(loop->timer, nullptr, nullptr, nullptr);
+            loop->timer->deleteLater();
+        }
+    }
+
+    //!
+    //! \brief Watchdog::watch
+    //! start heartbeats of event loop, first watched loop is the one enter() reports about
+    //!
+    //! \param thread thread running event loop
+    //! \param name loop name used in reports
+    //!
+    inline void Watchdog::watch(QThread *thread, const QString &name)
+    {
+        auto loop = std::unique_ptr<Loop>(new Loop);
+        Loop *state = loop.get();
+
+        state->name = name;
+
+        QTimer *timer = new QTimer;
+        timer->setTimerType(Qt::PreciseTimer);
+        timer->setInterval(int(m_interval));
+        timer->moveToThread(thread);
+        state->timer = timer;
+
+        qint64 interval = m_interval * 1000000;
+
+        QObject::connect(timer, &QTimer::timeout, timer, [this, state, interval]
+        {
+            qint64 now = QDeadlineTimer::current().deadlineNSecs();
+
+#ifdef RECURSE_WATCHDOG_STACKS
+            if (!state->has_thread.load())
+            {
+                state->thread = pthread_self();
+                state->has_thread.storeRelease(1);
+            }
+#endif
+
+            if (state->expected && m_metrics)
+                m_metrics->observe(Metrics::EventLoopLag, qMax<qint64>(0, now - state->expected));
+
+            state->expected = now + interval;
+            state->beat.storeRelease(now);
+        });
+
+        {
+            QMutexLocker lock(&m_mutex);
+
+            if (!m_main)
+                m_main = state;
+
+            m_loops.push_back(std::move(loop));
+        }
+
+        QMetaObject::invokeMethod(timer, [timer]
+        {
+            timer->start();
+        }, Qt::QueuedConnection);
+    }
+
+    //!
+    //! \brief Watchdog::onStall
+    //! replace default report (printed to stderr), called from watchdog thread
+    //!
+    inline void Watchdog::onStall(std::function<void(const Stall &stall)> f)
+    {
+        QMutexLocker lock(&m_mutex);
+        m_on_stall = std::move(f);
+    }
+
+    //!
+    //! \brief Watchdog::enter
+    //! middleware starts running in first watched loop, url is copied only when request changes
+    //!
+    //! \param request request identity, eg: context pointer
+    //! \param middleware middleware index
+    //! \param url request url
+    //! \return Running previous state, to be restored once middleware returns
+    //!
+    inline Watchdog::Running Watchdog::enter(const void *request, int middleware, const QUrl &url)
+    {
+        Running previous;
+
+        if (!m_main)
+            return previous;
+
+        Loop &loop = *m_main;
+
+        previous.request = loop.request;
+        previous.middleware = loop.middleware.load();
+
+        if (loop.request != request)
+        {
+            QByteArray encoded = url.toEncoded();
+            int size = qMin(encoded.size(), int(sizeof(loop.url)));
+
+            loop.sequence.fetchAndAddRelease(1);
+            std::memcpy(loop.url, encoded.constData(), size_t(size));
+            loop.url_size = size;
+            loop.sequence.fetchAndAddRelease(1);
+
+            loop.request = request;
+        }
+
+        loop.middleware.storeRelease(middleware);
+
+        return previous;
+    }
+
+    //!
+    //! \brief Watchdog::restore
+    //! middleware returned, previous one (or none) is running again
+    //!
+    inline void Watchdog::restore(const Running &previous)
+    {
+        if (!m_main)
+            return;
+
+        // url stays, it is replaced by next request
+        m_main->request = previous.request;
+        m_main->middleware.storeRelease(previous.middleware);
+    }
+
+    //!
+    //! \brief Watchdog::stalls
+    //! \return number of reported stalls
+    //!
+    inline quint64 Watchdog::stalls() const
+    {
+        return m_stalls.load();
+    }
+
+    inline void Watchdog::m_run()
+    {
+        QMutexLocker lock(&m_mutex);
+
+        while (!m_stop)
+        {
+            m_wake.wait(&m_mutex, quint64(m_interval));
+
+            qint64 now = QDeadlineTimer::current().deadlineNSecs();
+            QVector<Stall> stalls;
+
+            for (const auto &loop : m_loops)
+            {
+                Stall stall;
+
+                if (m_check(*loop, now, stall))
+                    stalls.push_back(stall);
+            }
+
+            if (stalls.isEmpty() || !m_on_stall)
+                continue;
+
+            // callback may call onStall() itself
+            auto on_stall = m_on_stall;
+            lock.unlock();
+
+            for (const auto &stall : stalls)
+                on_stall(stall);
+
+            lock.relock();
+        }
+    }
+
+    //!
+    //! \brief Watchdog::m_check
+    //! report loop once per stall, called with m_mutex locked
+    //!
+    //! \param stall filled with report of stalled loop
+    //! \return true if loop is newly stalled
+    //!
+    inline bool Watchdog::m_check(Loop &loop, qint64 now, Stall &stall)
+    {
+        qint64 beat = loop.beat.loadAcquire();
+
+        if (!beat || beat == loop.reported || now - beat < m_threshold * 1000000)
+            return false;
+
+        loop.reported = beat;
+
+        stall.loop = loop.name;
+        stall.duration = (now - beat) / 1000000;
+        stall.middleware = loop.middleware.loadAcquire();
+
+        if (stall.middleware >= 0)
+            stall.url = m_url(loop);
+
+        stall.stack = m_stack(loop);
+
+        m_stalls.fetchAndAddRelaxed(1);
+
+        if (m_metrics)
+            m_metrics->add(Metrics::EventLoopStalls);
+
+        return true;
+    }
+
+    //!
+    //! \brief Watchdog::m_url
+    //! \return url copied consistently, empty if it kept changing
+    //!
+    inline QString Watchdog::m_url(Loop &loop)
+    {
+        char url[sizeof(loop.url)];
+
+        for (int attempt = 0; attempt < 8; ++attempt)
+        {
+            quint32 before = loop.sequence.loadAcquire();
+
+            if (before & 1)
+                continue;
+
+            int size = loop.url_size;
+            std::memcpy(url, loop.url, size_t(size));
+
+            if (loop.sequence.loadAcquire() == before)
+                return QString::fromUtf8(url, size);
+        }
+
+        return QString();
+    }
+
+    //!
+    //! \brief Watchdog::m_stack
+    //! \return symbolized stack of blocked loop thread, empty where sampling isn't available
+    //!
+    inline QStringList Watchdog::m_stack(Loop &loop)
+    {
+        QStringList stack;
+
+#ifdef RECURSE_WATCHDOG_STACKS
+        if (!m_signal || !loop.has_thread.loadAcquire())
+            return stack;
+
+        Sample &sample = m_sample();
+        sample.done.storeRelease(0);
+
+        if (pthread_kill(loop.thread, m_signal) != 0)
+            return stack;
+
+        // handler runs as soon as the thread gets scheduled
+        QDeadlineTimer timeout(100);
+
+        while (!sample.done.loadAcquire() && !timeout.hasExpired())
+            QThread::usleep(200);
+
+        if (!sample.done.loadAcquire())
+            return stack;
+
+        int depth = sample.depth.load();
+        char **symbols = backtrace_symbols(sample.frames, depth);
+
+        // first frames belong to signal handler
+        for (int i = 2; i < depth; ++i)
+            stack << (symbols ? QString::fromLocal8Bit(symbols[i]) : QString::number(quintptr(sample.frames[i]), 16));
+
+        free(symbols);
+#else
+        Q_UNUSED(loop);
+#endif
+
+        return stack;
+    }
+
+#ifdef RECURSE_WATCHDOG_STACKS
+    inline Watchdog::Sample &Watchdog::m_sample()
+    {
+        static Sample sample;
+        return sample;
+    }
+
+    inline void Watchdog::m_signal_handler(int)
+    {
+        Sample &sample = m_sample();
+
+        sample.depth.store(backtrace(sample.frames, 64));
+        sample.done.storeRelease(1);
+    }
+#endif
+}
+
+#endif
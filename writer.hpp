@@ -0,0 +1,358 @@
+#ifndef RECURSE_WRITER_HPP
+#define RECURSE_WRITER_HPP
+
+#include <QFile>
+#include <QObject>
+#include <QPointer>
+#include <QSslSocket>
+#include <QTcpSocket>
+#include <QVector>
+
+#include "response.hpp"
+#include "trace.hpp"
+
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <sys/sendfile.h>
+#endif
+
+namespace Recurse
+{
+
+    //!
+    //! \brief The Writer class
+    //! Writes response segments to client without concatenating them
+    //!
+    //! On plain TCP sockets in-memory segments are gathered into sendmsg() calls on native
+    //! descriptor and file ranges are sent with sendfile() (Linux), so head, body and large
+    //! or shared buffers go out without being copied into one reply or into socket buffer.
+    //! When kernel buffer is full, at most 64KB of current buffer is handed over to QTcpSocket
+    //! and writing continues directly once it is flushed. TLS sockets and other platforms use
+    //! QTcpSocket writes, files are read in blocks as socket drains.
+    //!
+    //! Writer is owned by the socket and deletes itself once all segments are written.
+    //!
+    class Writer : public QObject
+    {
+    public:
+        static void send(QTcpSocket *socket, const QVector<Response::Segment> &segments, bool close = true,
+            std::function<void()> written = nullptr);
+
+    private:
+        Writer(QTcpSocket *socket, const QVector<Response::Segment> &segments, bool close);
+
+        static void m_ignore_sigpipe();
+
+        QPointer<QTcpSocket> m_socket;
+        QVector<Response::Segment> m_segments;
+        bool m_close;
+        std::function<void()> m_written;
+        bool m_native = false;
+
+        int m_index = 0;
+        qint64 m_offset = 0;
+        QFile m_file;
+
+        bool m_flush();
+        bool m_write_buffers();
+        void m_queue_block();
+        bool m_write_file(const Response::Segment &segment);
+        void m_advance(qint64 written);
+    };
+
+    //!
+    //! \brief Writer::send
+    //! write segments in order, then optionally close connection
+    //!
+    //! \param socket client socket
+    //! \param segments reply segments, eg: from Response::create_segments()
+    //! \param close disconnect once everything is written
+    //! \param written optional, called once last byte is written (before closing)
+    //!
+    inline void Writer::send(QTcpSocket *socket, const QVector<Response::Segment> &segments, bool close,
+        std::function<void()> written)
+    {
+        auto writer = new Writer(socket, segments, close);
+        writer->m_written = std::move(written);
+
+        // most replies are written right away, writer waits for socket only when kernel is busy
+        if (writer->m_flush())
+            delete writer;
+    }
+
+    inline Writer::Writer(QTcpSocket *socket, const QVector<Response::Segment> &segments, bool close)
+        : QObject(socket),
+          m_socket(socket),
+          m_segments(segments),
+          m_close(close)
+    {
+#ifdef Q_OS_UNIX
+        // TLS sockets have to encrypt data, it can't be written to descriptor directly
+        m_native = socket->socketDescriptor() != -1 && !qobject_cast<QSslSocket *>(socket);
+
+        if (m_native)
+            m_ignore_sigpipe();
+#endif
+
+        connect(socket, &QIODevice::bytesWritten, this, [this]
+        {
+            if (m_flush())
+                deleteLater();
+        });
+    }
+
+    //!
+    //! \brief Writer::m_ignore_sigpipe
+    //! writes to descriptor bypass QTcpSocket, which ignores SIGPIPE only once it writes itself.
+    //! sendfile() has no flag to suppress it, so closed client would kill the process
+    //!
+    inline void Writer::m_ignore_sigpipe()
+    {
+#ifdef Q_OS_UNIX
+        static bool ignored = []
+        {
+            // keep handler installed by application
+            struct sigaction action;
+            sigaction(SIGPIPE, nullptr, &action);
+
+            if (action.sa_handler == SIG_DFL)
+            {
+                action.sa_handler = SIG_IGN;
+                sigaction(SIGPIPE, &action, nullptr);
+            }
+
+            return true;
+        }();
+
+        Q_UNUSED(ignored);
+#endif
+    }
+
+    //!
+    //! \brief Writer::m_flush
+    //! write as much as possible
+    //!
+    //! \return true once everything was written (and connection closed if requested)
+    //!
+    inline bool Writer::m_flush()
+    {
+        if (!m_socket)
+            return true;
+
+        while (m_index < m_segments.size())
+        {
+            // data queued in socket has to go first to keep order
+            if (m_native && m_socket->bytesToWrite() > 0)
+                return false;
+
+            const auto &segment = m_segments.at(m_index);
+            bool progress = segment.path.isEmpty() ? m_write_buffers() : m_write_file(segment);
+
+            if (!progress)
+                return false;
+        }
+
+        RECURSE_PROBE1(written, quintptr(m_socket.data()));
+
+        if (m_written)
+            m_written();
+
+        if (m_close)
+            m_socket->disconnectFromHost();
+
+        return true;
+    }
+
+    //!
+    //! \brief Writer::m_write_buffers
+    //! write consecutive in-memory segments
+    //!
+    //! \return false if writer has to wait for socket
+    //!
+    inline bool Writer::m_write_buffers()
+    {
+#ifdef Q_OS_UNIX
+        if (m_native)
+        {
+            iovec vectors[64];
+            int count = 0;
+            qint64 total = 0;
+
+            for (int i = m_index; i < m_segments.size() && count < 64; ++i)
+            {
+                const auto &segment = m_segments.at(i);
+
+                if (!segment.path.isEmpty())
+                    break;
+
+                qint64 skip = i == m_index ? m_offset : 0;
+
+                vectors[count].iov_base = const_cast<char *>(segment.data.constData() + skip);
+                vectors[count].iov_len = size_t(segment.data.size() - skip);
+                total += segment.data.size() - skip;
+                ++count;
+            }
+
+            ssize_t written;
+
+#ifdef MSG_NOSIGNAL
+            msghdr message = {};
+            message.msg_iov = vectors;
+            message.msg_iovlen = count;
+
+            do
+                written = ::sendmsg(int(m_socket->socketDescriptor()), &message, MSG_NOSIGNAL);
+            while (written < 0 && errno == EINTR);
+#else
+            do
+                written = ::writev(int(m_socket->socketDescriptor()), vectors, count);
+            while (written < 0 && errno == EINTR);
+#endif
+
+            if (written >= 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (written > 0)
+                    m_advance(written);
+
+                if (written == total)
+                    return true;
+
+                // kernel buffer is full, socket reports when it drains
+                m_queue_block();
+
+                return false;
+            }
+
+            // socket error, let QTcpSocket report it
+            m_native = false;
+        }
+#endif
+
+        const auto &segment = m_segments.at(m_index);
+
+        m_socket->write(segment.data.constData() + m_offset, segment.data.size() - m_offset);
+        m_advance(segment.data.size() - m_offset);
+
+        return true;
+    }
+
+    //!
+    //! \brief Writer::m_queue_block
+    //! hand next block of current buffer to socket, so that writer is woken up by bytesWritten,
+    //! rest of the buffer is written directly afterwards instead of being copied
+    //!
+    inline void Writer::m_queue_block()
+    {
+        const auto &segment = m_segments.at(m_index);
+        qint64 block = qMin<qint64>(segment.data.size() - m_offset, 64 * 1024);
+
+        m_socket->write(segment.data.constData() + m_offset, block);
+        m_advance(block);
+    }
+
+    //!
+    //! \brief Writer::m_write_file
+    //! send file range, block by block through socket if it can't go directly
+    //!
+    //! \return false if writer has to wait for socket
+    //!
+    inline bool Writer::m_write_file(const Response::Segment &segment)
+    {
+        if (!m_file.isOpen())
+        {
+            m_file.setFileName(segment.path);
+
+            if (!m_file.open(QIODevice::ReadOnly))
+            {
+                // length was promised in head already, client can't get valid response
+                m_socket->abort();
+                m_index = m_segments.size();
+                return false;
+            }
+        }
+
+        qint64 remaining = segment.length - m_offset;
+
+#ifdef Q_OS_LINUX
+        if (m_native)
+        {
+            off_t position = off_t(segment.offset + m_offset);
+            ssize_t written;
+
+            do
+                written = ::sendfile(int(m_socket->socketDescriptor()), m_file.handle(), &position, size_t(remaining));
+            while (written < 0 && errno == EINTR);
+
+            if (written > 0)
+            {
+                m_advance(written);
+
+                if (written == remaining)
+                    return true;
+            }
+            else if (written == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                // file got shorter or socket error
+                m_socket->abort();
+                m_index = m_segments.size();
+                return false;
+            }
+
+            remaining = segment.length - m_offset;
+        }
+#endif
+
+        // next block goes through socket, writer continues once it is written
+        if (m_socket->bytesToWrite() >= 64 * 1024)
+            return false;
+
+        m_file.seek(segment.offset + m_offset);
+        QByteArray block = m_file.read(qMin<qint64>(remaining, 64 * 1024));
+
+        if (block.isEmpty())
+        {
+            m_socket->abort();
+            m_index = m_segments.size();
+            return false;
+        }
+
+        m_socket->write(block);
+        m_advance(block.size());
+
+        return !m_native;
+    }
+
+    //!
+    //! \brief Writer::m_advance
+    //! move position by written bytes, possibly over multiple segments
+    //!
+    inline void Writer::m_advance(qint64 written)
+    {
+        while (written > 0 && m_index < m_segments.size())
+        {
+            qint64 left = m_segments.at(m_index).size() - m_offset;
+
+            if (written < left)
+            {
+                m_offset += written;
+                return;
+            }
+
+            written -= left;
+
+            if (!m_segments.at(m_index).path.isEmpty())
+                m_file.close();
+
+            ++m_index;
+            m_offset = 0;
+        }
+    }
+}
+
+#endif